@@ -0,0 +1,489 @@
+// LD_PRELOAD shim running unmodified TCP-style applications over ATP.
+//
+//     LD_PRELOAD=libatp_preload.so ATP_PRELOAD_SIGNALLING=libsignal.so ./server
+//
+// A socket is routed to ATP when either
+//   (1) it is created with socket(AF_INET, SOCK_STREAM, IPPROTO_ATP) - bind() and
+//       connect() then take a struct sockaddr_atp, or
+//   (2) it is a plain AF_INET/SOCK_STREAM socket which is bind()'ed or connect()'ed
+//       to an address listed in ATP_PRELOAD_ROUTES, a comma separated list of
+//       ip:port=hostname:service entries.
+//
+// The signalling provider is loaded from the shared object named by
+// ATP_PRELOAD_SIGNALLING, which must export
+//     extern "C" Atp::ISignallingProvider* AtpCreateSignallingProvider();
+//
+// Only the control path is intercepted. Sockets use the socketpair data path, so
+// read/write/send/recv/poll/epoll_* work on ATP fds as they are and are not
+// interposed at all. For anything else, the only cost is a bitmap lookup.
+//
+// NOTE: epoll_* is deliberately left alone: readiness of the socketpair end (or,
+// for a listener, of the eventfd which replaces it) is the real thing. What epoll
+// cannot follow is listen() and connect() replacing the open file behind an fd:
+// for route-based sockets dup2() puts the Context's fd over the application's
+// (see AttachRoutedSocket), and every listener swaps its socketpair end for an
+// eventfd. epoll registers the open file, not the number, so an fd added to an
+// epoll set before then is silently dropped from it. Add ATP fds to epoll after
+// listen()/connect() returns, as most servers do anyway. Interposing epoll_ctl
+// to re-add them would mean tracking every epoll set an fd is in.
+
+#include <atp/common.h>
+#include <atp/context.h>
+#include <atp/coroutine.h>
+#include <atp/types.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+using SocketFn = int (*)(int, int, int);
+using BindFn = int (*)(int, const struct sockaddr*, socklen_t);
+using ListenFn = int (*)(int, int);
+using AcceptFn = int (*)(int, struct sockaddr*, socklen_t*);
+using Accept4Fn = int (*)(int, struct sockaddr*, socklen_t*, int);
+using ConnectFn = int (*)(int, const struct sockaddr*, socklen_t);
+using GetSockOptFn = int (*)(int, int, int, void*, socklen_t*);
+using SetSockOptFn = int (*)(int, int, int, const void*, socklen_t);
+using CloseFn = int (*)(int);
+
+struct Real {
+    SocketFn mSocket;
+    BindFn mBind;
+    ListenFn mListen;
+    AcceptFn mAccept;
+    Accept4Fn mAccept4;
+    ConnectFn mConnect;
+    GetSockOptFn mGetSockOpt;
+    SetSockOptFn mSetSockOpt;
+    CloseFn mClose;
+} gReal;
+
+/* fd table */
+
+constexpr int kMaxFds = 1 << 16;
+
+// Bit set = fd is routed to ATP. Checked on every intercepted call, everything
+// else about ATP fds is only touched after this says yes.
+std::atomic<uint64_t> gAtpFds[kMaxFds / 64];
+// Application-visible fd -> Context fd. They differ for route-based sockets,
+// whose ATP fd gets dup2()'ed over the fd the application already holds.
+int gContextFds[kMaxFds];
+
+inline bool IsAtpFd(int fd)
+{
+    if (static_cast<unsigned>(fd) >= kMaxFds)
+        return false;
+    return gAtpFds[fd / 64].load(std::memory_order_relaxed) & (uint64_t { 1 } << (fd % 64));
+}
+
+void MarkAtpFd(int fd, int contextFd)
+{
+    gContextFds[fd] = contextFd;
+    gAtpFds[fd / 64].fetch_or(uint64_t { 1 } << (fd % 64), std::memory_order_release);
+}
+
+void UnmarkAtpFd(int fd)
+{
+    gAtpFds[fd / 64].fetch_and(~(uint64_t { 1 } << (fd % 64)), std::memory_order_release);
+}
+
+/* Routes */
+
+struct Route {
+    struct sockaddr_in mAddress;
+    struct Atp::sockaddr_atp mAtpAddress;
+};
+
+std::vector<Route> gRoutes;
+
+void ParseRoutes(const char* spec)
+{
+    std::string routes { spec };
+    size_t start = 0;
+    while (start < routes.size()) {
+        size_t end = routes.find(',', start);
+        if (end == std::string::npos)
+            end = routes.size();
+        std::string entry = routes.substr(start, end - start);
+        start = end + 1;
+
+        size_t equals = entry.find('=');
+        if (equals == std::string::npos)
+            continue;
+        std::string from = entry.substr(0, equals);
+        std::string to = entry.substr(equals + 1);
+        size_t fromColon = from.rfind(':');
+        size_t toColon = to.rfind(':');
+        if (fromColon == std::string::npos || toColon == std::string::npos)
+            continue;
+
+        Route route {};
+        route.mAddress.sin_family = AF_INET;
+        route.mAddress.sin_port = htons(std::atoi(from.substr(fromColon + 1).c_str()));
+        if (inet_pton(AF_INET, from.substr(0, fromColon).c_str(), &route.mAddress.sin_addr) != 1)
+            continue;
+
+        std::string hostname = to.substr(0, toColon);
+        std::string service = to.substr(toColon + 1);
+        if (hostname.size() >= sizeof(route.mAtpAddress.hostname)
+            || service.size() >= sizeof(route.mAtpAddress.service))
+            continue;
+        route.mAtpAddress.sa_family = AF_INET;
+        memcpy(route.mAtpAddress.hostname, hostname.c_str(), hostname.size() + 1);
+        memcpy(route.mAtpAddress.service, service.c_str(), service.size() + 1);
+
+        gRoutes.push_back(route);
+    }
+}
+
+const Route* FindRoute(const struct sockaddr* addr, socklen_t addrlen)
+{
+    if (gRoutes.empty() || addr == nullptr || addr->sa_family != AF_INET
+        || addrlen < sizeof(struct sockaddr_in))
+        return nullptr;
+
+    const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(addr);
+    for (const Route& route : gRoutes) {
+        if (route.mAddress.sin_port == in->sin_port
+            && (route.mAddress.sin_addr.s_addr == in->sin_addr.s_addr
+                || route.mAddress.sin_addr.s_addr == htonl(INADDR_ANY)))
+            return &route;
+    }
+    return nullptr;
+}
+
+/* Context */
+
+std::once_flag gContextOnce;
+std::unique_ptr<Atp::ISignallingProvider> gSignallingProvider;
+std::unique_ptr<Atp::Context> gContext;
+
+Atp::Context* GetContext()
+{
+    std::call_once(gContextOnce, []() {
+        const char* path = getenv("ATP_PRELOAD_SIGNALLING");
+        if (path == nullptr)
+            return;
+        void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr)
+            return;
+
+        using FactoryFn = Atp::ISignallingProvider* (*)();
+        FactoryFn factory = reinterpret_cast<FactoryFn>(dlsym(handle, "AtpCreateSignallingProvider"));
+        if (factory == nullptr)
+            return;
+
+        gSignallingProvider.reset(factory());
+        if (gSignallingProvider == nullptr)
+            return;
+
+        // Unmodified applications read()/write() the fd directly
+        gContext = std::make_unique<Atp::Context>(gSignallingProvider.get(),
+            Atp::Context::Options { .mDataPath = Atp::AtpSocket::DataPath::kSocketpair });
+    });
+    return gContext.get();
+}
+
+int ErrorToErrno(int error)
+{
+    switch (static_cast<Atp::Error>(error)) {
+    case Atp::Error::ACCESS:
+        return EACCES;
+    case Atp::Error::AFNOSUPPORT:
+        return EAFNOSUPPORT;
+    case Atp::Error::INVAL:
+    case Atp::Error::ALREADYSET:
+        return EINVAL;
+    case Atp::Error::MFILE:
+    case Atp::Error::MAXSOCKETS:
+        return EMFILE;
+    case Atp::Error::NFILE:
+        return ENFILE;
+    case Atp::Error::NOMEM:
+        return ENOMEM;
+    case Atp::Error::PROTONOSUPPORT:
+        return EPROTONOSUPPORT;
+    case Atp::Error::BADFD:
+        return EBADF;
+    case Atp::Error::NOTBOUND:
+        return EDESTADDRREQ;
+    case Atp::Error::WOULDBLOCK:
+        return EAGAIN;
+    case Atp::Error::TIMEDOUT:
+        return ETIMEDOUT;
+    case Atp::Error::NOPROTOOPT:
+        return ENOPROTOOPT;
+    case Atp::Error::NATQUERYFAILURE:
+    case Atp::Error::NATDEPENDENT:
+    case Atp::Error::SIGNALLINGPROVIDER:
+        return ENETUNREACH;
+    default:
+        return EIO;
+    }
+}
+
+// Context functions return >= 0 on success, negative Atp::Error otherwise
+int ToPosix(int ret)
+{
+    if (ret >= 0)
+        return ret;
+    errno = ErrorToErrno(ret);
+    return -1;
+}
+
+bool IsNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && (flags & O_NONBLOCK);
+}
+
+template <typename Operation>
+Atp::Task<void> Await(Operation operation, std::promise<int>& result)
+{
+    result.set_value(co_await operation());
+}
+
+// Blocks the calling application thread until the operation completes
+template <typename Operation>
+int Wait(Operation operation)
+{
+    std::promise<int> result;
+    std::future<int> future = result.get_future();
+    Await(std::move(operation), result).Detach();
+    return future.get();
+}
+
+// Creates the ATP socket behind a route-based socket, and makes fd refer to it
+int AttachRoutedSocket(int fd)
+{
+    Atp::Context* context = GetContext();
+    if (context == nullptr) {
+        errno = ENETUNREACH;
+        return -1;
+    }
+
+    int contextFd = context->Socket(AF_INET, SOCK_STREAM, Atp::IPPROTO_ATP);
+    if (contextFd < 0)
+        return ToPosix(contextFd);
+
+    MarkAtpFd(fd, contextFd);
+    if (contextFd < kMaxFds)
+        MarkAtpFd(contextFd, contextFd);
+    return 0;
+}
+
+}
+
+__attribute__((constructor)) static void AtpPreloadInit()
+{
+    gReal.mSocket = reinterpret_cast<SocketFn>(dlsym(RTLD_NEXT, "socket"));
+    gReal.mBind = reinterpret_cast<BindFn>(dlsym(RTLD_NEXT, "bind"));
+    gReal.mListen = reinterpret_cast<ListenFn>(dlsym(RTLD_NEXT, "listen"));
+    gReal.mAccept = reinterpret_cast<AcceptFn>(dlsym(RTLD_NEXT, "accept"));
+    gReal.mAccept4 = reinterpret_cast<Accept4Fn>(dlsym(RTLD_NEXT, "accept4"));
+    gReal.mConnect = reinterpret_cast<ConnectFn>(dlsym(RTLD_NEXT, "connect"));
+    gReal.mGetSockOpt = reinterpret_cast<GetSockOptFn>(dlsym(RTLD_NEXT, "getsockopt"));
+    gReal.mSetSockOpt = reinterpret_cast<SetSockOptFn>(dlsym(RTLD_NEXT, "setsockopt"));
+    gReal.mClose = reinterpret_cast<CloseFn>(dlsym(RTLD_NEXT, "close"));
+
+    if (const char* routes = getenv("ATP_PRELOAD_ROUTES"))
+        ParseRoutes(routes);
+}
+
+extern "C" {
+
+int socket(int domain, int type, int protocol)
+{
+    if (likely(protocol != Atp::IPPROTO_ATP))
+        return gReal.mSocket(domain, type, protocol);
+
+    Atp::Context* context = GetContext();
+    if (context == nullptr) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    int fd = context->Socket(domain, type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC), protocol);
+    if (fd < 0)
+        return ToPosix(fd);
+    if (fd >= kMaxFds) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (type & SOCK_NONBLOCK)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    MarkAtpFd(fd, fd);
+    return fd;
+}
+
+int bind(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    const struct Atp::sockaddr_atp* atpAddress;
+
+    if (IsAtpFd(fd)) {
+        if (addrlen < sizeof(struct Atp::sockaddr_atp)) {
+            errno = EINVAL;
+            return -1;
+        }
+        atpAddress = reinterpret_cast<const struct Atp::sockaddr_atp*>(addr);
+    } else if (const Route* route = FindRoute(addr, addrlen)) {
+        if (AttachRoutedSocket(fd) != 0)
+            return -1;
+        atpAddress = &route->mAtpAddress;
+    } else {
+        return gReal.mBind(fd, addr, addrlen);
+    }
+
+    return ToPosix(GetContext()->Bind(gContextFds[fd], atpAddress));
+}
+
+int listen(int fd, int backlog)
+{
+    if (likely(!IsAtpFd(fd)))
+        return gReal.mListen(fd, backlog);
+
+    int contextFd = gContextFds[fd];
+    int ret = GetContext()->Listen(contextFd, backlog);
+    if (ret < 0)
+        return ToPosix(ret);
+
+    // The listening socket is never re-plumbed, so the application's fd can
+    // simply become the Context's fd
+    if (fd != contextFd && dup2(contextFd, fd) < 0)
+        return -1;
+    return 0;
+}
+
+int accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags)
+{
+    if (likely(!IsAtpFd(fd)))
+        return gReal.mAccept4(fd, addr, addrlen, flags);
+
+    Atp::Context* context = GetContext();
+    int contextFd = gContextFds[fd];
+    struct Atp::sockaddr_atp peer {};
+
+    int ret = IsNonBlocking(fd) ? context->Accept(contextFd, &peer)
+                                : Wait([&]() { return context->AcceptAsync(contextFd, &peer); });
+    if (ret < 0)
+        return ToPosix(ret);
+    if (ret >= kMaxFds) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (addr != nullptr && addrlen != nullptr) {
+        memcpy(addr, &peer, std::min<size_t>(*addrlen, sizeof(peer)));
+        *addrlen = sizeof(peer);
+    }
+    if (flags & SOCK_NONBLOCK)
+        fcntl(ret, F_SETFL, fcntl(ret, F_GETFL) | O_NONBLOCK);
+    if (flags & SOCK_CLOEXEC)
+        fcntl(ret, F_SETFD, FD_CLOEXEC);
+
+    MarkAtpFd(ret, ret);
+    return ret;
+}
+
+int accept(int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+    if (likely(!IsAtpFd(fd)))
+        return gReal.mAccept(fd, addr, addrlen);
+    return accept4(fd, addr, addrlen, 0);
+}
+
+int connect(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    const struct Atp::sockaddr_atp* atpAddress;
+
+    if (IsAtpFd(fd) && gContextFds[fd] == fd) {
+        if (addrlen < sizeof(struct Atp::sockaddr_atp)) {
+            errno = EINVAL;
+            return -1;
+        }
+        atpAddress = reinterpret_cast<const struct Atp::sockaddr_atp*>(addr);
+    } else if (const Route* route = FindRoute(addr, addrlen)) {
+        if (!IsAtpFd(fd) && AttachRoutedSocket(fd) != 0)
+            return -1;
+        atpAddress = &route->mAtpAddress;
+    } else {
+        return gReal.mConnect(fd, addr, addrlen);
+    }
+
+    Atp::Context* context = GetContext();
+    int contextFd = gContextFds[fd];
+
+    if (IsNonBlocking(fd)) {
+        int ret = context->Connect(contextFd, atpAddress);
+        if (ret < 0)
+            return ToPosix(ret);
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    int ret = Wait([&]() { return context->ConnectAsync(contextFd, atpAddress); });
+    if (ret < 0)
+        return ToPosix(ret);
+
+    // The Context's fd now refers to the connected socketpair end
+    if (fd != contextFd && dup2(contextFd, fd) < 0)
+        return -1;
+    return 0;
+}
+
+int getsockopt(int fd, int level, int optname, void* optval, socklen_t* optlen)
+{
+    if (likely(!IsAtpFd(fd)) || level != Atp::IPPROTO_ATP)
+        return gReal.mGetSockOpt(fd, level, optname, optval, optlen);
+
+    return ToPosix(GetContext()->GetSockOpt(gContextFds[fd], level, optname, optval, optlen));
+}
+
+int setsockopt(int fd, int level, int optname, const void* optval, socklen_t optlen)
+{
+    if (likely(!IsAtpFd(fd)))
+        return gReal.mSetSockOpt(fd, level, optname, optval, optlen);
+
+    if (level == Atp::IPPROTO_ATP)
+        return ToPosix(GetContext()->SetSockOpt(gContextFds[fd], level, optname, optval, optlen));
+
+    // TCP tuning (TCP_NODELAY etc.) has no meaning for ATP, don't fail the application
+    if (level == IPPROTO_TCP)
+        return 0;
+    return gReal.mSetSockOpt(fd, level, optname, optval, optlen);
+}
+
+int close(int fd)
+{
+    if (unlikely(IsAtpFd(fd))) {
+        int contextFd = gContextFds[fd];
+        UnmarkAtpFd(fd);
+        if (contextFd != fd && contextFd < kMaxFds)
+            UnmarkAtpFd(contextFd);
+
+        // Closes contextFd along with the socket. A route-based fd is a dup of
+        // it, or still the application's own socket, and is closed below.
+        int ret = GetContext()->Close(contextFd);
+        if (fd == contextFd && ret == +Atp::Error::SUCCESS)
+            return 0;
+    }
+    return gReal.mClose(fd);
+}
+
+}
@@ -0,0 +1,112 @@
+// Relay server for ATP connections which could not punch through, see atp/relay.h.
+//
+//     atp_relay [-p port] [-n max allocations]
+//
+// One thread, one UDP socket, forwarding with Relay::Server (see relay_server.h).
+// tests/bench_relay measures its throughput; scale out by running one instance
+// per core on different ports.
+
+#include "relay_server.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <plog/Formatters/TxtFormatter.h>
+#include <plog/Initializers/ConsoleInitializer.h>
+#include <plog/Log.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr int kSocketBufferSize = 8 * 1024 * 1024;
+constexpr uint64_t kSweepIntervalMs = 1000;
+constexpr uint64_t kStatsIntervalMs = 10 * 1000;
+
+}
+
+int main(int argc, char** argv)
+{
+    plog::init<plog::TxtFormatter>(plog::info, plog::streamStdOut);
+
+    int port = Atp::kRelayDefaultPort;
+    size_t maxAllocations = 1 << 16;
+
+    int option;
+    while ((option = getopt(argc, argv, "p:n:")) != -1) {
+        switch (option) {
+        case 'p':
+            port = std::atoi(optarg);
+            break;
+        case 'n':
+            maxAllocations = std::strtoull(optarg, nullptr, 10);
+            break;
+        default:
+            std::fprintf(stderr, "usage: %s [-p port] [-n max allocations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (port <= 0 || port > UINT16_MAX || maxAllocations == 0) {
+        std::fprintf(stderr, "%s: invalid port or allocation count\n", argv[0]);
+        return 1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        PLOG_ERROR << "socket failed - " << strerror(errno);
+        return 1;
+    }
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (bind(sockfd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        PLOG_ERROR << "bind failed - " << strerror(errno);
+        return 1;
+    }
+
+    // Bursts are absorbed by the kernel rather than dropped, best effort as the
+    // sysctl limits (net.core.rmem_max) apply
+    int bufferSize = kSocketBufferSize;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+
+    // Wake up now and then to expire allocations even when idle
+    struct timeval timeout { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Too big for the stack
+    auto server = std::make_unique<Relay::Server>(sockfd, maxAllocations);
+
+    PLOG_INFO << "Relaying on port " << port << ", up to " << maxAllocations << " allocations";
+
+    uint64_t nextSweepMs = Relay::GetTimeMs() + kSweepIntervalMs;
+    uint64_t nextStatsMs = Relay::GetTimeMs() + kStatsIntervalMs;
+
+    for (;;) {
+        // Blocks for the first datagram only, then takes whatever else is queued
+        if (server->ProcessBatch(MSG_WAITFORONE) < 0) {
+            PLOG_ERROR << "recvmmsg failed - " << strerror(errno);
+            return 1;
+        }
+
+        uint64_t now = Relay::GetTimeMs();
+        if (now >= nextSweepMs) {
+            server->Expire(now);
+            nextSweepMs = now + kSweepIntervalMs;
+        }
+        if (now >= nextStatsMs) {
+            const Relay::Server::Stats& stats = server->GetStats();
+            PLOG_INFO << "allocations=" << server->Allocations() << " received=" << stats.mReceived
+                      << " forwarded=" << stats.mForwarded << " dropped=" << stats.mDropped;
+            nextStatsMs = now + kStatsIntervalMs;
+        }
+    }
+}
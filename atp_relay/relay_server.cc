@@ -0,0 +1,191 @@
+#include "relay_server.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+namespace Relay {
+
+uint64_t GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static bool SameAddress(const struct sockaddr_in& a, const struct sockaddr_in& b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+AllocationTable::AllocationTable(size_t maxAllocations)
+{
+    // Load factor of at most 1/2 keeps probe sequences short
+    int bits = 4;
+    while ((size_t { 1 } << bits) < 2 * maxAllocations)
+        bits++;
+    mSlots.assign(size_t { 1 } << bits, Allocation {});
+    mMask = mSlots.size() - 1;
+    mShift = 64 - bits;
+    mMaxSize = maxAllocations;
+}
+
+AllocationTable::Allocation* AllocationTable::Find(uint64_t token)
+{
+    for (size_t i = Home(token);; i = (i + 1) & mMask) {
+        if (mSlots[i].mToken == token)
+            return &mSlots[i];
+        if (mSlots[i].mToken == 0)
+            return nullptr;
+    }
+}
+
+AllocationTable::Allocation* AllocationTable::Insert(uint64_t token)
+{
+    if (mSize == mMaxSize)
+        return nullptr;
+
+    size_t i = Home(token);
+    while (mSlots[i].mToken != 0)
+        i = (i + 1) & mMask;
+    mSlots[i] = Allocation {};
+    mSlots[i].mToken = token;
+    mSize++;
+    return &mSlots[i];
+}
+
+size_t AllocationTable::Expire(uint64_t now)
+{
+    size_t expired = 0;
+    for (size_t i = 0; i < mSlots.size();) {
+        if (mSlots[i].mToken != 0 && now - mSlots[i].mLastSeenMs >= Atp::kRelayIdleTimeoutMs) {
+            Erase(i);
+            expired++;
+            continue; // i now holds whatever was shifted into it
+        }
+        i++;
+    }
+    return expired;
+}
+
+void AllocationTable::Erase(size_t i)
+{
+    mSize--;
+    size_t j = i;
+    for (;;) {
+        mSlots[i].mToken = 0;
+        for (;;) {
+            j = (j + 1) & mMask;
+            if (mSlots[j].mToken == 0)
+                return;
+            // The entry at j may move to i only if its home is not cyclically in (i, j]
+            size_t home = Home(mSlots[j].mToken);
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays)
+                break;
+        }
+        mSlots[i] = mSlots[j];
+        i = j;
+    }
+}
+
+Server::Server(int sockfd, size_t maxAllocations)
+    : mSockfd { sockfd }
+    , mAllocations { maxAllocations }
+{
+    bzero(mRecvMsgs, sizeof(mRecvMsgs));
+    bzero(mSendMsgs, sizeof(mSendMsgs));
+    for (size_t i = 0; i < kBatchSize; i++) {
+        mRecvIov[i] = { .iov_base = mBuffers[i], .iov_len = kMaxDatagramSize };
+        mRecvMsgs[i].msg_hdr.msg_iov = &mRecvIov[i];
+        mRecvMsgs[i].msg_hdr.msg_iovlen = 1;
+        mRecvMsgs[i].msg_hdr.msg_name = &mSources[i];
+        mSendMsgs[i].msg_hdr.msg_iov = &mSendIov[i];
+        mSendMsgs[i].msg_hdr.msg_iovlen = 1;
+        mSendMsgs[i].msg_hdr.msg_name = &mDestinations[i];
+        mSendMsgs[i].msg_hdr.msg_namelen = sizeof(mDestinations[i]);
+    }
+}
+
+int Server::ProcessBatch(int flags)
+{
+    for (size_t i = 0; i < kBatchSize; i++)
+        mRecvMsgs[i].msg_hdr.msg_namelen = sizeof(mSources[i]);
+
+    int received = recvmmsg(mSockfd, mRecvMsgs, kBatchSize, flags, nullptr);
+    if (received < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+    uint64_t now = GetTimeMs();
+    size_t queued = 0;
+
+    for (int i = 0; i < received; i++) {
+        mStats.mReceived++;
+
+        Atp::relay_hdr header;
+        if (mRecvMsgs[i].msg_len < sizeof(header) || mRecvMsgs[i].msg_hdr.msg_namelen != sizeof(mSources[i])) {
+            mStats.mDropped++;
+            continue;
+        }
+        memcpy(&header, mBuffers[i], sizeof(header));
+        if (header.magic != Atp::kRelayMagic || header.version != Atp::kRelayVersion
+            || header.token == 0) {
+            mStats.mDropped++;
+            continue;
+        }
+
+        AllocationTable::Allocation* allocation = mAllocations.Find(header.token);
+        if (allocation == nullptr) {
+            // First of the two peers, nothing to forward to yet
+            if ((allocation = mAllocations.Insert(header.token)) == nullptr) {
+                mStats.mDropped++;
+                continue;
+            }
+            allocation->mPeers[0] = mSources[i];
+            allocation->mPeerCount = 1;
+            allocation->mLastSeenMs = now;
+            continue;
+        }
+
+        int side;
+        if (SameAddress(allocation->mPeers[0], mSources[i])) {
+            side = 0;
+        } else if (allocation->mPeerCount == 2 && SameAddress(allocation->mPeers[1], mSources[i])) {
+            side = 1;
+        } else if (allocation->mPeerCount == 1) {
+            allocation->mPeers[1] = mSources[i];
+            allocation->mPeerCount = 2;
+            side = 1;
+        } else {
+            // A third address knowing the token, not forwarded anywhere
+            mStats.mDropped++;
+            continue;
+        }
+
+        allocation->mLastSeenMs = now;
+        if (allocation->mPeerCount < 2)
+            continue;
+
+        // Forwarded as is, straight out of the receive buffer
+        mSendIov[queued] = { .iov_base = mBuffers[i], .iov_len = mRecvMsgs[i].msg_len };
+        mDestinations[queued] = allocation->mPeers[1 - side];
+        queued++;
+    }
+
+    for (size_t sent = 0; sent < queued;) {
+        int count = sendmmsg(mSockfd, mSendMsgs + sent, queued - sent, 0);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            // e.g ENOBUFS, UDP makes no promises so drop the rest of the batch
+            mStats.mDropped += queued - sent;
+            break;
+        }
+        sent += count;
+        mStats.mForwarded += count;
+    }
+
+    return received;
+}
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atp/relay.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace Relay {
+
+// Steady clock milliseconds, what allocations are stamped with
+uint64_t GetTimeMs();
+
+// Token -> the (up to) two peers of an allocation.
+//
+// Open addressing with linear probing in a single power of two sized array.
+// Tokens are random, a multiplicative hash spreads them fine. There are no
+// tombstones, erasing shifts the following entries of the cluster back instead,
+// so lookups never have to walk over dead slots.
+class AllocationTable {
+public:
+    struct Allocation {
+        uint64_t mToken; // 0 if the slot is free
+        struct sockaddr_in mPeers[2];
+        int mPeerCount;
+        uint64_t mLastSeenMs;
+    };
+
+    explicit AllocationTable(size_t maxAllocations);
+
+    Allocation* Find(uint64_t token);
+    // nullptr once maxAllocations are live
+    Allocation* Insert(uint64_t token);
+    // Returns how many allocations were dropped. An entry shifted back across
+    // the scan position may be skipped, it is simply caught by the next sweep.
+    size_t Expire(uint64_t now);
+
+    size_t Size() const
+    {
+        return mSize;
+    }
+
+private:
+    size_t Home(uint64_t token) const
+    {
+        return static_cast<size_t>((token * 0x9E3779B97F4A7C15ull) >> mShift);
+    }
+
+    void Erase(size_t i);
+
+    std::vector<Allocation> mSlots;
+    size_t mMask {};
+    int mShift {};
+    size_t mSize {};
+    size_t mMaxSize {};
+};
+
+// The forwarding loop of atp_relay, minus the loop: reads a batch of datagrams
+// with recvmmsg and forwards them with sendmmsg, straight out of the receive
+// buffers. Each datagram costs a single probe into the AllocationTable - no
+// allocation, no locking and two syscalls per batch.
+//
+// atp_relay blocks in ProcessBatch(MSG_WAITFORONE), tests and benchmarks poll
+// it with MSG_DONTWAIT next to their event loop.
+class Server {
+public:
+    struct Stats {
+        uint64_t mReceived {};
+        uint64_t mForwarded {};
+        uint64_t mDropped {};
+    };
+
+    static constexpr size_t kBatchSize = 64;
+    // An ATP datagram never exceeds 576 bytes, anything bigger is not ours
+    static constexpr size_t kMaxDatagramSize = 2048;
+
+    // sockfd is a bound UDP socket, which stays the caller's to close
+    Server(int sockfd, size_t maxAllocations);
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Reads up to kBatchSize datagrams, recvmmsg() flags, and forwards what
+    // belongs to a paired allocation. Returns the number of datagrams read, 0
+    // if there were none, -1 with errno set on a socket error.
+    int ProcessBatch(int flags);
+
+    // Drops the allocations idle for kRelayIdleTimeoutMs as of now (ms, steady
+    // clock), returns how many
+    size_t Expire(uint64_t now)
+    {
+        return mAllocations.Expire(now);
+    }
+
+    size_t Allocations() const
+    {
+        return mAllocations.Size();
+    }
+
+    const Stats& GetStats() const
+    {
+        return mStats;
+    }
+
+private:
+    int mSockfd;
+    AllocationTable mAllocations;
+    Stats mStats {};
+
+    char mBuffers[kBatchSize][kMaxDatagramSize];
+    struct iovec mRecvIov[kBatchSize];
+    struct sockaddr_in mSources[kBatchSize];
+    struct mmsghdr mRecvMsgs[kBatchSize];
+    struct iovec mSendIov[kBatchSize];
+    struct sockaddr_in mDestinations[kBatchSize];
+    struct mmsghdr mSendMsgs[kBatchSize];
+};
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace Atp {
+
+// Bounded lock-free multi-producer single-consumer queue.
+//
+// Application threads push commands, the EventCore thread pops and runs them.
+// Based off Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence
+// number which tells a producer whether the cell is free for position `pos`
+// (sequence == pos), and the consumer whether it has been filled
+// (sequence == pos + 1). Since there is a single consumer, the dequeue side
+// needs no CAS at all.
+//
+// Capacity *must* be a power of two.
+template <typename T, size_t Capacity>
+class MpscQueue final {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+        "MpscQueue capacity must be a power of two");
+
+public:
+    MpscQueue()
+        : mCells { std::make_unique<Cell[]>(Capacity) }
+    {
+        for (size_t i = 0; i < Capacity; i++)
+            mCells[i].mSequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Safe to call from any thread. Returns false if the queue is full, in
+    // which case value is left untouched.
+    bool TryPush(T&& value)
+    {
+        Cell* cell;
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+
+        for (;;) {
+            cell = &mCells[pos & kMask];
+            size_t sequence = cell->mSequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->mValue = std::move(value);
+        cell->mSequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // *Must* only be called from the consumer thread
+    bool TryPop(T& value)
+    {
+        Cell* cell = &mCells[mDequeuePos & kMask];
+        size_t sequence = cell->mSequence.load(std::memory_order_acquire);
+        if (sequence != mDequeuePos + 1)
+            return false; // empty, or producer has not finished writing yet
+
+        value = std::move(cell->mValue);
+        cell->mValue = T {};
+        cell->mSequence.store(mDequeuePos + Capacity, std::memory_order_release);
+        mDequeuePos++;
+        return true;
+    }
+
+private:
+    static constexpr size_t kMask = Capacity - 1;
+    static constexpr size_t kCacheLine = 64;
+
+    struct alignas(kCacheLine) Cell {
+        std::atomic<size_t> mSequence;
+        T mValue;
+    };
+
+    std::unique_ptr<Cell[]> mCells;
+
+    // Producers and the consumer hammer different indices, keep them on
+    // separate cache lines
+    alignas(kCacheLine) std::atomic<size_t> mEnqueuePos { 0 };
+    alignas(kCacheLine) size_t mDequeuePos { 0 };
+};
+
+}
@@ -19,16 +19,52 @@ namespace Atp {
 
 using mseconds_t = int;
 
-// TODO: Make most/all of these configurable using socket options
+// Per-socket values here are only defaults, see the SOL_ATP options in types.h
 namespace Config {
     static constexpr mseconds_t kNatKeepAliveTimeout = 5000;
-    static constexpr size_t kMaxSocketCount = 32;
+    // How long the NAT type learnt for an interface is trusted
+    static constexpr mseconds_t kNatCacheTtl = 5 * 60 * 1000;
+    // Resolutions started before the STUN servers are looked up check back this often
+    static constexpr mseconds_t kStunDnsPollInterval = 20;
     static constexpr size_t kMaxBacklog = 64;
+    // Pre-resolved sockets are re-queried this often, well within the ~30s UDP
+    // mapping timeout of common NATs
+    static constexpr mseconds_t kSocketPoolRefreshInterval = 15 * 1000;
+    // Same reasoning for the mappings of cached paths, see PathCache
+    static constexpr mseconds_t kPathKeepAliveInterval = 15 * 1000;
+    static constexpr size_t kPathCacheSize = 64;
+    // Punching starts with a burst of kPunchInitialInterval spaced packets and backs
+    // off exponentially up to kPunchInterval
+    static constexpr mseconds_t kPunchInitialInterval = 20;
     static constexpr mseconds_t kPunchInterval = 5000;
+    // Punching this long without success also starts trying the relay, if any
+    static constexpr mseconds_t kRelayFallbackTimeout = 3000;
+    // Ports punched for a peer behind a dependent NAT, along its predicted sequence
+    static constexpr int kMaxPredictedPorts = 64;
+    // Max check pairs punched per punch interval, a predicted candidate's pairs
+    // are sprayed round robin under this rate
+    static constexpr size_t kPunchSprayBurst = 16;
     static constexpr mseconds_t kPunchTimeout = 3 * 60 * 1000; 
+    // Retransmission timeout, RFC 6298 (1s initial, 60s cap). The floor is 200ms
+    // like Linux rather than the RFC's 1s.
+    static constexpr mseconds_t kRtoInitial = 1000;
+    static constexpr mseconds_t kRtoMin = 200;
+    static constexpr mseconds_t kRtoMax = 60 * 1000;
+    // Duplicate acks which trigger a retransmission before the RTO does
+    static constexpr int kDupAckThreshold = 3;
 
-    // HACK: Constant window size, for now. Need to implement properly later
-    static constexpr uint16_t kConstantWindow = 4096;
+    // Max commands in flight from application threads to the EventCore thread
+    static constexpr size_t kCommandQueueSize = 1024;
+
+    // Inline storage for EventCore callbacks, enough for a few captured pointers
+    static constexpr size_t kInlineCallbackSize = 48;
+
+    // Per direction, for sockets using the shared memory ring data path
+    static constexpr size_t kRingSize = 256 * 1024;
+
+    // Bounds for ATP_SNDBUF/ATP_RCVBUF
+    static constexpr int kMinBufferSize = 4096;
+    static constexpr int kMaxBufferSize = 64 * 1024 * 1024;
 };
 
 
@@ -5,6 +5,7 @@
 #include "socket.h"
 #include "types.h"
 
+#include <cerrno>
 #include <netinet/in.h>
 #include <strings.h>
 #include <stun/stun.h>
@@ -15,12 +16,29 @@
 namespace Atp {
 
 Context::Context(ISignallingProvider* signallingProvider)
-    : mSignallingProvider { signallingProvider }
-    , mEventCore()
+    : Context(signallingProvider, Options {})
 {
-    mSockets.reserve(Config::kMaxSocketCount);
+}
 
-    mEventLoopThread = std::thread(&EventCore::Run, &mEventCore);
+Context::Context(ISignallingProvider* signallingProvider, Options options)
+    : mOptions { options }
+    , mSignallingProvider { signallingProvider }
+    , mEventCore(options.mEventCore)
+    , mStunClient(&mEventCore, mOptions.mNatProfilePath)
+    , mNatResolver { options.mNatResolver ? options.mNatResolver : &mStunClient }
+    , mSocketPool(&mEventCore, mNatResolver, &mSocketFactory, mOptions.mSocketPoolSize)
+    , mPathCache(&mEventCore, mOptions.mPathCacheIdleTimeout)
+{
+    if (mOptions.mMode == Mode::kThreaded)
+        mEventLoopThread = std::thread(&EventCore::Run, &mEventCore);
+}
+
+Context::~Context()
+{
+    if (mEventLoopThread.joinable()) {
+        mEventCore.Stop();
+        mEventLoopThread.join();
+    }
 }
 
 int Context::Socket(int domain, int type, int protocol)
@@ -29,38 +47,380 @@ int Context::Socket(int domain, int type, int protocol)
         return +Error::AFNOSUPPORT;
     if (type != SOCK_STREAM || protocol != IPPROTO_ATP)
         return +Error::PROTONOSUPPORT;
-    if (mSockets.size() == Config::kMaxSocketCount)
-        return +Error::MAXSOCKETS;
-
-    std::expected<AtpSocket, Error> socket = AtpSocket::Create(&mEventCore, mSignallingProvider);
-    if (!socket) 
-        return +socket.error();
 
-    int fd = socket->GetApplicationFd();
-    mApplicationFds.insert(fd);
-    mSockets[fd] = std::move(*socket);
+    return Execute([&]() -> int {
+        Result<std::unique_ptr<AtpSocket>> socket = AtpSocket::Create(&mEventCore,
+            mSignallingProvider, mNatResolver, &mSocketFactory, &mPathCache,
+            mOptions.mDataPath, mSocketPool.Take());
+        if (!socket)
+            return +socket.error();
+        if (mOptions.mRelayAddress.sin_port != 0) {
+            Error error = (*socket)->SetSockOpt(SOL_ATP, ATP_RELAY, &mOptions.mRelayAddress,
+                sizeof(mOptions.mRelayAddress));
+            if (error != Error::SUCCESS)
+                return +error;
+        }
 
-    return fd;
+        int fd = (*socket)->GetApplicationFd();
+        TakeOwnership(std::move(*socket));
+        return fd;
+    });
 }
 
 int Context::Bind(int appfd, const struct sockaddr_atp* addr)
 {
-    if (!mApplicationFds.contains(appfd))
-        return +Error::BADFD;
+    return Execute([&]() -> int {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
 
-    Error ret = mSockets[appfd].Bind(addr);
-
-    return +ret;
+        return +socket->Bind(addr);
+    });
 }
 
 int Context::Listen(int appfd, int backlog)
 {
-    if (!mApplicationFds.contains(appfd))
-        return +Error::BADFD;
-    
-    SocketData* data = mFdToSocket[appfd];
-    if (data->mSignallingAddress == nullptr)
-        return +Error::NOTBOUND;
+    return Execute([&]() -> int {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        return +socket->Listen(backlog);
+    });
+}
+
+int Context::Accept(int appfd, struct sockaddr_atp* addr)
+{
+    return Execute([&]() -> int {
+        AtpSocket* listener = mSockets.Get(appfd);
+        if (listener == nullptr)
+            return +Error::BADFD;
+
+        Result<AtpSocket*> socket = listener->Accept(this);
+        if (!socket)
+            return +socket.error();
+
+        if (addr != nullptr)
+            *addr = *(*socket)->GetPeerAddress();
+        return (*socket)->GetApplicationFd();
+    });
+}
+
+int Context::AcceptMany(int appfd, std::span<AcceptResult> connections)
+{
+    if (connections.size() > Config::kMaxBacklog)
+        connections = connections.first(Config::kMaxBacklog);
+
+    return Execute([&]() -> int {
+        AtpSocket* listener = mSockets.Get(appfd);
+        if (listener == nullptr)
+            return +Error::BADFD;
+
+        AtpSocket* sockets[Config::kMaxBacklog];
+        Result<size_t> count = listener->AcceptMany(this,
+            std::span(sockets, connections.size()));
+        if (!count)
+            return +count.error();
+
+        for (size_t i = 0; i < *count; i++) {
+            connections[i].mFd = sockets[i]->GetApplicationFd();
+            connections[i].mAddress = *sockets[i]->GetPeerAddress();
+        }
+        return static_cast<int>(*count);
+    });
+}
+
+int Context::Connect(int appfd, const struct sockaddr_atp* addr)
+{
+    return Execute([&]() -> int {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        return +socket->Connect(addr);
+    });
+}
+
+int Context::Close(int appfd)
+{
+    return Execute([&]() -> int {
+        // Waits for any Read()/Write() still on the socket
+        std::unique_ptr<AtpSocket> socket = mSockets.Erase(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        return +Error::SUCCESS;
+    });
+}
+
+int Context::GetSockOpt(int appfd, int level, int optname, void* optval, socklen_t* optlen)
+{
+    return Execute([&]() -> int {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        return +socket->GetSockOpt(level, optname, optval, optlen);
+    });
+}
+
+int Context::SetSockOpt(int appfd, int level, int optname, const void* optval, socklen_t optlen)
+{
+    return Execute([&]() -> int {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        return +socket->SetSockOpt(level, optname, optval, optlen);
+    });
+}
+
+CallbackAwaitable<int> Context::ConnectAsync(int appfd, const struct sockaddr_atp* addr)
+{
+    return CallbackAwaitable<int>([this, appfd, addr](CallbackAwaitable<int>::completion_t completion) {
+        Dispatch([this, appfd, addr, completion = std::move(completion)]() mutable {
+            AtpSocket* socket = mSockets.Get(appfd);
+            if (socket == nullptr) {
+                completion(+Error::BADFD);
+                return;
+            }
+
+            Error ret = socket->Connect(addr);
+            if (ret != Error::SUCCESS) {
+                completion(+ret);
+                return;
+            }
+
+            socket->AwaitConnected([completion = std::move(completion)](Error error) mutable {
+                completion(+error);
+            });
+        });
+    });
+}
+
+CallbackAwaitable<int> Context::AcceptAsync(int appfd, struct sockaddr_atp* addr)
+{
+    return CallbackAwaitable<int>([this, appfd, addr](CallbackAwaitable<int>::completion_t completion) {
+        Dispatch([this, appfd, addr, completion = std::move(completion)]() mutable {
+            AcceptWhenReady(appfd, addr, std::move(completion));
+        });
+    });
+}
+
+CallbackAwaitable<ssize_t> Context::ReadAsync(int appfd, std::span<std::byte> buffer)
+{
+    return CallbackAwaitable<ssize_t>([this, appfd, buffer](CallbackAwaitable<ssize_t>::completion_t completion) {
+        Dispatch([this, appfd, buffer, completion = std::move(completion)]() mutable {
+            ReadWhenReady(appfd, buffer, std::move(completion));
+        });
+    });
+}
+
+CallbackAwaitable<ssize_t> Context::WriteAsync(int appfd, std::span<const std::byte> buffer)
+{
+    return CallbackAwaitable<ssize_t>([this, appfd, buffer](CallbackAwaitable<ssize_t>::completion_t completion) {
+        Dispatch([this, appfd, buffer, completion = std::move(completion)]() mutable {
+            WriteWhenReady(appfd, buffer, std::move(completion));
+        });
+    });
+}
+
+void Context::AcceptWhenReady(int appfd, struct sockaddr_atp* addr,
+    CallbackAwaitable<int>::completion_t completion)
+{
+    AtpSocket* listener = mSockets.Get(appfd);
+    if (listener == nullptr) {
+        completion(+Error::BADFD);
+        return;
+    }
+
+    Result<AtpSocket*> socket = listener->Accept(this);
+    if (socket) {
+        if (addr != nullptr)
+            *addr = *(*socket)->GetPeerAddress();
+        completion((*socket)->GetApplicationFd());
+        return;
+    }
+    if (socket.error() != Error::WOULDBLOCK) {
+        completion(+socket.error());
+        return;
+    }
+
+    listener->AwaitConnection([this, appfd, addr, completion = std::move(completion)](Error error) mutable {
+        if (error != Error::SUCCESS) {
+            completion(+error);
+            return;
+        }
+        AcceptWhenReady(appfd, addr, std::move(completion));
+    });
+}
+
+void Context::ReadWhenReady(int appfd, std::span<std::byte> buffer,
+    CallbackAwaitable<ssize_t>::completion_t completion)
+{
+    AtpSocket* socket = mSockets.Get(appfd);
+    if (socket == nullptr) {
+        completion(+Error::BADFD);
+        return;
+    }
+
+    ssize_t ret = ReadApplication(appfd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+    if (ret != +Error::WOULDBLOCK) {
+        completion(ret);
+        return;
+    }
+
+    // The socketpair is not connected before ESTABLISHED, there is nothing to
+    // poll until then
+    if (socket->GetRingChannel() == nullptr && socket->IsConnecting()) {
+        socket->AwaitConnected([this, appfd, buffer, completion = std::move(completion)](Error error) mutable {
+            if (error != Error::SUCCESS) {
+                completion(+error);
+                return;
+            }
+            ReadWhenReady(appfd, buffer, std::move(completion));
+        });
+        return;
+    }
+
+    socket->AwaitApplicationReady(0,
+        [this, appfd, buffer, completion = std::move(completion)](Error error) mutable {
+            if (error != Error::SUCCESS) {
+                completion(+error);
+                return;
+            }
+            ReadWhenReady(appfd, buffer, std::move(completion));
+        });
+}
+
+void Context::WriteWhenReady(int appfd, std::span<const std::byte> buffer,
+    CallbackAwaitable<ssize_t>::completion_t completion)
+{
+    AtpSocket* socket = mSockets.Get(appfd);
+    if (socket == nullptr) {
+        completion(+Error::BADFD);
+        return;
+    }
+
+    ssize_t ret = WriteApplication(appfd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+    if (ret != +Error::WOULDBLOCK) {
+        completion(ret);
+        return;
+    }
+
+    socket->AwaitApplicationReady(IEventCore::kWritable,
+        [this, appfd, buffer, completion = std::move(completion)](Error error) mutable {
+            if (error != Error::SUCCESS) {
+                completion(+error);
+                return;
+            }
+            WriteWhenReady(appfd, buffer, std::move(completion));
+        });
+}
+
+ssize_t Context::Read(int appfd, void* buf, size_t count)
+{
+    return ReadApplication(appfd, buf, count, 0);
+}
+
+ssize_t Context::Write(int appfd, const void* buf, size_t count)
+{
+    return WriteApplication(appfd, buf, count, 0);
+}
+
+ssize_t Context::ReadApplication(int appfd, void* buf, size_t count, int flags)
+{
+    // Keeps the socket from being destroyed under us by the event loop
+    if (FdTable<AtpSocket>::Ref socket = mSockets.Acquire(appfd)) {
+        if (RingChannel* channel = socket->GetRingChannel())
+            return channel->ApplicationRead(buf, count);
+    }
+
+    ssize_t ret = ::recv(appfd, buf, count, flags);
+    // Linux has recv() on an unconnected AF_UNIX stream socket fail with EINVAL,
+    // where send() says ENOTCONN
+    if (ret >= 0 || (errno != ENOTCONN && errno != EINVAL))
+        return ret >= 0 ? ret : +ErrnoToErrorCode(errno);
+
+    // Still punching, like the ring there is just nothing to read yet
+    bool connecting = Execute([&]() -> bool {
+        AtpSocket* socket = mSockets.Get(appfd);
+        return socket != nullptr && socket->IsConnecting();
+    });
+    if (connecting)
+        return +Error::WOULDBLOCK;
+
+    // Established in the meantime
+    ret = ::recv(appfd, buf, count, flags);
+    return ret >= 0 ? ret : +ErrnoToErrorCode(errno);
+}
+
+ssize_t Context::WriteApplication(int appfd, const void* buf, size_t count, int flags)
+{
+    if (FdTable<AtpSocket>::Ref socket = mSockets.Acquire(appfd)) {
+        if (RingChannel* channel = socket->GetRingChannel())
+            return channel->ApplicationWrite(buf, count);
+    }
+
+    ssize_t ret = ::send(appfd, buf, count, flags | MSG_NOSIGNAL);
+    if (ret >= 0 || errno != ENOTCONN || count == 0)
+        return ret >= 0 ? ret : +ErrnoToErrorCode(errno);
+
+    // Still punching, the first segment goes out as early data
+    ret = Execute([&]() -> ssize_t {
+        AtpSocket* socket = mSockets.Get(appfd);
+        if (socket == nullptr)
+            return +Error::BADFD;
+
+        Result<size_t> taken = socket->WriteEarlyData(buf, count);
+        return taken ? static_cast<ssize_t>(*taken) : +taken.error();
+    });
+    if (ret != 0)
+        return ret;
+
+    // Established in the meantime
+    ret = ::send(appfd, buf, count, flags | MSG_NOSIGNAL);
+    return ret >= 0 ? ret : +ErrnoToErrorCode(errno);
+}
+
+void Context::Dispatch(IEventCore::Command&& command)
+{
+    if (mOptions.mMode == Mode::kInline || std::this_thread::get_id() == mEventLoopThread.get_id()) {
+        command();
+        return;
+    }
+
+    while (!mEventCore.Post(std::move(command)))
+        std::this_thread::yield();
+}
+
+int Context::GetEventFd()
+{
+    if (mOptions.mMode != Mode::kInline)
+        return +Error::INVAL;
+    return mEventCore.GetFd();
+}
+
+Result<mseconds_t> Context::NextTimeout()
+{
+    if (mOptions.mMode != Mode::kInline)
+        return std::unexpected(Error::INVAL);
+    return mEventCore.NextTimeout();
+}
+
+int Context::ProcessEvents(mseconds_t timeout)
+{
+    if (mOptions.mMode != Mode::kInline)
+        return +Error::INVAL;
+    if (mEventCore.ProcessEvents(timeout) < 0)
+        return +Error::EVENTCORE;
+    return +Error::SUCCESS;
+}
+
+void Context::TakeOwnership(std::unique_ptr<AtpSocket> socket)
+{
+    int fd = socket->GetApplicationFd();
+    mSockets.Insert(fd, std::move(socket));
 }
 
 }
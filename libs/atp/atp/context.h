@@ -24,19 +24,29 @@
 
 #pragma once
 
+#include "coroutine.h"
 #include "eventcore.h"
+#include "fd_table.h"
 #include "signalling.h"
 #include "types.h"
 #include "protocol.h"
 #include "common.h"
+#include "ring.h"
 #include "socket.h"
+#include "path_cache.h"
+#include "socket_pool.h"
 
 #include <stun/stun.h>
 
+#include <future>
 #include <map>
+#include <memory>
+#include <span>
+#include <string>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 
 namespace Atp {
@@ -50,12 +60,48 @@ namespace Atp {
 // as the interface b/w Context and Engine is a unix domain socket
 
 
-// BUG: Imagine context functions are being called from multiple application threads - 
-// we would need locking in all the ctx functions when modifying data structures etc.
+// NOTE: Context functions may be called from multiple application threads. None of
+// them touch the sockets or the EventCore directly - the actual work is packaged into
+// a command, posted to the EventCore's lock-free queue and the caller blocks on a
+// future for the result. So all socket/EventCore state is only ever touched by the
+// event loop thread.
 class Context final {
 public:
+    enum class Mode {
+        // Context spawns its own event loop thread
+        kThreaded,
+        // No thread is spawned. The application drives ATP from its own event loop
+        // using GetEventFd()/NextTimeout()/ProcessEvents(), and *must* call every
+        // Context function from that same thread.
+        kInline
+    };
+
+    struct Options {
+        Mode mMode { Mode::kThreaded };
+        // Data path between application and engine for new sockets
+        AtpSocket::DataPath mDataPath { AtpSocket::DataPath::kSocketpair };
+        // e.g the busy-polling low latency event loop
+        EventCore::Options mEventCore {};
+        // File keeping the NAT classification across restarts, empty to disable.
+        // Written after every full classification, see StunClient.
+        std::string mNatProfilePath {};
+        // Learns NAT mappings instead of the built-in StunClient, e.g a test
+        // double. Must outlive the Context, and complete on the event loop
+        // thread - in inline mode, the thread driving the Context.
+        INatResolver* mNatResolver {};
+        // UDP sockets kept bound and STUN-resolved ahead of Socket() calls, so
+        // that Connect() need not wait for the NAT mapping. 0 disables the pool.
+        size_t mSocketPoolSize {};
+        // Default ATP_RELAY of new sockets, sin_port 0 for none
+        struct sockaddr_in mRelayAddress {};
+        // How long the direct path of a closed connection is kept warm for the
+        // next Connect() to the same peer, see PathCache. 0 disables the cache.
+        mseconds_t mPathCacheIdleTimeout {};
+    };
+
     Context(ISignallingProvider* signallingProvider);
-    ~Context() = default; // TODO: Any cleanup required?
+    Context(ISignallingProvider* signallingProvider, Options options);
+    ~Context();
 
     int Socket(int domain, int type, int protocol); // Only supporting AF_INET rn
 
@@ -63,26 +109,67 @@ public:
     // Active sockets: Socket() -> (optional: Bind()) -> Connect()
     int Bind(int appfd, const struct sockaddr_atp* addr);
     int Listen(int appfd, int backlog);
-    // HACK: Always non-blocking, for now.
-    // Note that a listening socket becomes readable when a connection is available,
-    // so we can implement that with atpfd (the unix domain socket) somehow?
+    // Always non-blocking, returns +Error::WOULDBLOCK when no connection is available.
+    // The listening appfd becomes readable when a connection is available, so poll it
+    // (but don't read from it).
     int Accept(int appfd, struct sockaddr_atp* addr);
 
+    struct AcceptResult {
+        int mFd;
+        struct sockaddr_atp mAddress;
+    };
+    // Accepts up to connections.size() available connections in a single trip to the
+    // event loop, returns how many were accepted or +Error::WOULDBLOCK if none
+    int AcceptMany(int appfd, std::span<AcceptResult> connections);
+
     int Connect(int appfd, const struct sockaddr_atp* addr);
 
     int GetSockOpt(int appfd, int level, int optname, void* optval, socklen_t* optlen);
     int SetSockOpt(int appfd, int level, int optname, const void* optval, socklen_t optlen);
     // TODO: fcntl? (Stevens chapter 7)
 
+    /* Coroutine API, see coroutine.h */
+
+    // Same return values as the blocking counterparts, but they complete only once
+    // the operation does: ConnectAsync when punching finishes, AcceptAsync when a
+    // connection is available, ReadAsync/WriteAsync when data can be moved.
+    // The awaiting coroutine is resumed on the event loop thread.
+    // addr and buffer *must* stay valid until the operation completes.
+    CallbackAwaitable<int> ConnectAsync(int appfd, const struct sockaddr_atp* addr);
+    CallbackAwaitable<int> AcceptAsync(int appfd, struct sockaddr_atp* addr);
+    CallbackAwaitable<ssize_t> ReadAsync(int appfd, std::span<std::byte> buffer);
+    CallbackAwaitable<ssize_t> WriteAsync(int appfd, std::span<const std::byte> buffer);
+
+    /* Inline mode only, fail with Error::INVAL otherwise */
+
+    // Add this fd to your own epoll/poll set, it is readable when ATP has work to do
+    int GetEventFd();
+    // Timeout to use for your own poll call, -1 if ATP has no pending timers. Not an
+    // int like the others, so that the error can't be mistaken for "no timer".
+    Result<mseconds_t> NextTimeout();
+    // Runs ready callbacks and due timers, waiting at most timeout ms for them
+    int ProcessEvents(mseconds_t timeout);
+
     /* Deleted Functions */
 
     int GetAddrInfo(...) = delete;
     int GetNameInfo(...) = delete;
 
-    // Call the glibc functions directly on the fdYou should use Microsoft OFFICE 365  to view the powerpoint slides of the lectures. Each student can get access to an account on OFFICE 365. Please contact Computer Center for the formalities. 
-    ssize_t Read(...) = delete;
-    ssize_t Write(...) = delete;
-    int Close(...) = delete;
+    // Sockets on the socketpair data path can instead use the glibc functions directly
+    // on the fd. Sockets on the ring data path *must* use these; they never block,
+    // returning +Error::WOULDBLOCK instead - poll the fd for readability.
+    // Safe to call from any thread, they do not go through the event loop. The
+    // exception is the socketpair data path while the socket is still punching,
+    // the fd is not connected before ESTABLISHED: Write() hands the first segment
+    // to the loop as early data, Read() returns +Error::WOULDBLOCK like the ring
+    // (and ReadAsync waits for the connection).
+    ssize_t Read(int appfd, void* buf, size_t count);
+    ssize_t Write(int appfd, const void* buf, size_t count);
+
+    // Destroys the socket and closes appfd along with it. close(2) on appfd
+    // alone leaks the socket, its UDP socket and timers until the Context goes.
+    int Close(int appfd);
+    // Call the glibc function directly on the fd
     int Shutdown(...) = delete;
 
     /* For internal ATP use, should I instead make SocketImpl a friend class and make these private? */
@@ -119,12 +206,54 @@ private:
 
     mseconds_t NetworkRecvCallback(epoll_data_t data);
 
+    // Runs function on the event loop thread and returns its result
+    template <typename Function>
+    std::invoke_result_t<Function> Execute(Function&& function);
+    // Runs command on the event loop thread without waiting for it
+    void Dispatch(IEventCore::Command&& command);
+
+    ssize_t ReadApplication(int appfd, void* buf, size_t count, int flags);
+    ssize_t WriteApplication(int appfd, const void* buf, size_t count, int flags);
+
+    void AcceptWhenReady(int appfd, struct sockaddr_atp* addr,
+        CallbackAwaitable<int>::completion_t completion);
+    void ReadWhenReady(int appfd, std::span<std::byte> buffer,
+        CallbackAwaitable<ssize_t>::completion_t completion);
+    void WriteWhenReady(int appfd, std::span<const std::byte> buffer,
+        CallbackAwaitable<ssize_t>::completion_t completion);
+
+    Options mOptions;
     ISignallingProvider* mSignallingProvider;
+    PosixSocketFactory mSocketFactory;
     EventCore mEventCore;
+    StunClient mStunClient; // runs on mEventCore, and must outlive mSockets
+    INatResolver* mNatResolver; // mStunClient unless Options say otherwise
+    SocketPool mSocketPool; // resolved by mNatResolver
+    PathCache mPathCache; // filled as mSockets are destroyed, so declared before
     std::thread mEventLoopThread;
 
-    std::unordered_map<int, AtpSocket> mSockets; // application fd -> socket impl
-    std::set<int> mApplicationFds;
+    // application fd -> socket impl. Only modified on the event loop thread, but
+    // Read()/Write() Acquire() ring channels from it on application threads.
+    FdTable<AtpSocket> mSockets;
 };
 
+template <typename Function>
+std::invoke_result_t<Function> Context::Execute(Function&& function)
+{
+    // Callbacks running on the loop (e.g AtpSocket::Accept -> TakeOwnership) can
+    // re-enter the context, posting to ourselves would deadlock. In inline mode the
+    // caller is the loop thread.
+    if (mOptions.mMode == Mode::kInline || std::this_thread::get_id() == mEventLoopThread.get_id())
+        return function();
+
+    std::packaged_task<std::invoke_result_t<Function>()> task(std::forward<Function>(function));
+    auto result = task.get_future();
+
+    // The queue is bounded, back off while the loop catches up
+    while (!mEventCore.Post([&task]() { task(); }))
+        std::this_thread::yield();
+
+    return result.get();
+}
+
 }
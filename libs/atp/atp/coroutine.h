@@ -0,0 +1,225 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace Atp {
+
+// Minimal coroutine support for the Context *Async() functions.
+//
+// Task<T> is a lazily started coroutine which can be co_await'ed from another
+// Task, or started fire-and-forget with Detach(). Operations on ATP sockets
+// return a CallbackAwaitable, which is resumed by the event loop thread as soon
+// as the operation completes - so after the first co_await, a coroutine runs on
+// the event loop thread (or on the application thread driving an inline Context).
+//
+//     Atp::Task<void> Serve(Atp::Context& ctx, int listenfd) {
+//         for (;;) {
+//             int fd = co_await ctx.AcceptAsync(listenfd, nullptr);
+//             if (fd >= 0)
+//                 Echo(ctx, fd).Detach();
+//         }
+//     }
+
+template <typename T = void>
+class Task;
+
+namespace Detail {
+
+    struct TaskPromiseBase {
+        std::coroutine_handle<> mContinuation {};
+        std::exception_ptr mException {};
+        bool mDetached {};
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                TaskPromiseBase& promise = handle.promise();
+                if (promise.mDetached) {
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+                if (promise.mContinuation)
+                    return promise.mContinuation;
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept { }
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception()
+        {
+            // Nobody is around to observe it
+            if (mDetached)
+                std::terminate();
+            mException = std::current_exception();
+        }
+    };
+
+    template <typename T>
+    struct TaskPromise final : TaskPromiseBase {
+        std::optional<T> mValue {};
+
+        Task<T> get_return_object();
+
+        template <typename U>
+        void return_value(U&& value)
+        {
+            mValue.emplace(std::forward<U>(value));
+        }
+
+        T TakeResult()
+        {
+            if (mException)
+                std::rethrow_exception(mException);
+            return std::move(*mValue);
+        }
+    };
+
+    template <>
+    struct TaskPromise<void> final : TaskPromiseBase {
+        Task<void> get_return_object();
+
+        void return_void() { }
+
+        void TakeResult()
+        {
+            if (mException)
+                std::rethrow_exception(mException);
+        }
+    };
+
+}
+
+template <typename T>
+class Task final {
+public:
+    using promise_type = Detail::TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : mHandle { handle }
+    {
+    }
+
+    Task(Task&& other) noexcept
+        : mHandle { std::exchange(other.mHandle, {}) }
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other) {
+            if (mHandle)
+                mHandle.destroy();
+            mHandle = std::exchange(other.mHandle, {});
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (mHandle)
+            mHandle.destroy();
+    }
+
+    // Starts the coroutine, which frees itself once it runs to completion
+    void Detach()
+    {
+        std::coroutine_handle<promise_type> handle = std::exchange(mHandle, {});
+        handle.promise().mDetached = true;
+        handle.resume();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        mHandle.promise().mContinuation = continuation;
+        return mHandle; // symmetric transfer, start the awaited task
+    }
+
+    T await_resume()
+    {
+        return mHandle.promise().TakeResult();
+    }
+
+private:
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+namespace Detail {
+
+    template <typename T>
+    Task<T> TaskPromise<T>::get_return_object()
+    {
+        return Task<T> { std::coroutine_handle<TaskPromise<T>>::from_promise(*this) };
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object()
+    {
+        return Task<void> { std::coroutine_handle<TaskPromise<void>>::from_promise(*this) };
+    }
+
+}
+
+// Awaitable wrapping a callback-style asynchronous operation. start is invoked
+// on suspension with a completion which *must* eventually be called exactly
+// once, from any thread. If the completion runs before start returns, the
+// awaiting coroutine simply does not suspend.
+template <typename T>
+class CallbackAwaitable final {
+public:
+    using completion_t = std::move_only_function<void(T)>;
+    using start_t = std::move_only_function<void(completion_t)>;
+
+    explicit CallbackAwaitable(start_t start)
+        : mStart { std::move(start) }
+    {
+    }
+
+    CallbackAwaitable(const CallbackAwaitable&) = delete;
+    CallbackAwaitable& operator=(const CallbackAwaitable&) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        mHandle = handle;
+        mStart([this](T result) {
+            mResult.emplace(std::move(result));
+            if (mState.exchange(kDone, std::memory_order_acq_rel) == kSuspended)
+                mHandle.resume();
+        });
+        return mState.exchange(kSuspended, std::memory_order_acq_rel) != kDone;
+    }
+
+    T await_resume()
+    {
+        return std::move(*mResult);
+    }
+
+private:
+    static constexpr int kStarting = 0;
+    static constexpr int kSuspended = 1;
+    static constexpr int kDone = 2;
+
+    start_t mStart;
+    std::optional<T> mResult {};
+    std::coroutine_handle<> mHandle {};
+    std::atomic<int> mState { kStarting };
+};
+
+}
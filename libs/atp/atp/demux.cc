@@ -1 +1,242 @@
 #include "demux.h"
+#include "protocol.h"
+#include "relay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <plog/Log.h>
+#include <stun/stun.h>
+#include <sys/socket.h>
+
+namespace Atp {
+
+// Datagrams read per wakeup, the loop comes back for the rest after the other callbacks
+static constexpr int kRecvBatch = 64;
+
+DatagramClass ClassifyDatagram(const void* buffer, size_t length)
+{
+    // STUN has the two top bits of the first byte clear and the magic cookie,
+    // neither relay_hdr nor atp_hdr can look like that
+    if (Stun::IsStunMessage(buffer, length))
+        return DatagramClass::kStun;
+
+    // NOTE: An atp_hdr whose sequence number starts with these 4 bytes passes as
+    // relayed, 1 in 2^32. The Demux falls back to the source address when the
+    // token is not one of ours.
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    if (length >= sizeof(struct relay_hdr) && bytes[0] == kRelayMagic
+        && bytes[1] == kRelayVersion && bytes[2] == 0 && bytes[3] == 0)
+        return DatagramClass::kRelay;
+    if (IsAtpDatagram(buffer, length))
+        return DatagramClass::kAtp;
+    return DatagramClass::kUnknown;
+}
+
+Demux::Demux(IEventCore* eventCore, std::unique_ptr<ISocket> socket)
+    : mEventCore { eventCore }
+    , mSocket { std::move(socket) }
+    , mAlive { std::make_shared<bool>(true) }
+{
+    THROW_IF((mRecvCallback = mEventCore->RegisterCallback(mSocket.get(), 0,
+                  [this](void*) -> mseconds_t {
+                      return RecvCallback();
+                  },
+                  nullptr))
+        == 0);
+}
+
+Demux::~Demux()
+{
+    *mAlive = false;
+    if (mRecvCallback)
+        mEventCore->DeleteCallback(mRecvCallback);
+}
+
+ISocket* Demux::GetSocket() const
+{
+    return mSocket.get();
+}
+
+std::unique_ptr<ISocket> Demux::Release()
+{
+    if (mRecvCallback)
+        mEventCore->DeleteCallback(mRecvCallback);
+    mRecvCallback = 0;
+    return std::move(mSocket);
+}
+
+uint64_t Demux::SourceKey(const struct sockaddr_in* address)
+{
+    return (static_cast<uint64_t>(address->sin_addr.s_addr) << 16) | address->sin_port;
+}
+
+Demux::callback_ident_t Demux::RegisterCallback(const struct sockaddr_in* sourceAddress,
+    callback_t callback)
+{
+    uint64_t key = SourceKey(sourceAddress);
+    if (mSources.contains(key))
+        return 0;
+
+    callback_ident_t identifier = mEntries.Emplace(Entry {
+        .mKind = Kind::kSource, .mKey = key, .mCallback = std::move(callback), .mHostCallback = {} });
+    if (identifier != 0)
+        mSources.emplace(key, identifier);
+    return identifier;
+}
+
+Demux::callback_ident_t Demux::RegisterHostCallback(in_addr_t host, host_callback_t callback)
+{
+    callback_ident_t identifier = mEntries.Emplace(Entry {
+        .mKind = Kind::kHost, .mKey = host, .mCallback = {}, .mHostCallback = std::move(callback) });
+    if (identifier != 0)
+        mHosts[host].push_back(identifier);
+    return identifier;
+}
+
+Demux::callback_ident_t Demux::RegisterRelayCallback(uint64_t token, callback_t callback)
+{
+    if (mRelays.contains(token))
+        return 0;
+
+    callback_ident_t identifier = mEntries.Emplace(Entry {
+        .mKind = Kind::kRelay, .mKey = token, .mCallback = std::move(callback), .mHostCallback = {} });
+    if (identifier != 0)
+        mRelays.emplace(token, identifier);
+    return identifier;
+}
+
+Demux::callback_ident_t Demux::RegisterStunCallback(callback_t callback)
+{
+    if (mStun != 0)
+        return 0;
+
+    return mStun = mEntries.Emplace(Entry {
+               .mKind = Kind::kStun, .mKey = 0, .mCallback = std::move(callback), .mHostCallback = {} });
+}
+
+int Demux::DeleteCallback(callback_ident_t callbackIdentifier)
+{
+    Entry* entry = mEntries.Get(callbackIdentifier);
+    if (entry == nullptr)
+        return -1;
+
+    switch (entry->mKind) {
+    case Kind::kSource:
+        mSources.erase(entry->mKey);
+        break;
+    case Kind::kHost: {
+        auto it = mHosts.find(static_cast<in_addr_t>(entry->mKey));
+        std::erase(it->second, callbackIdentifier);
+        if (it->second.empty())
+            mHosts.erase(it);
+        break;
+    }
+    case Kind::kRelay:
+        mRelays.erase(entry->mKey);
+        break;
+    case Kind::kStun:
+        mStun = 0;
+        break;
+    }
+
+    mEntries.Erase(callbackIdentifier);
+    return 0;
+}
+
+int Demux::EvictCallback(const struct sockaddr_in* sourceAddress)
+{
+    auto it = mSources.find(SourceKey(sourceAddress));
+    if (it == mSources.end())
+        return -1;
+    return DeleteCallback(it->second);
+}
+
+mseconds_t Demux::RecvCallback()
+{
+    // Keeps the flag itself alive, whatever the callbacks do to us
+    std::shared_ptr<bool> alive = mAlive;
+
+    char buffer[2048];
+    for (int i = 0; i < kRecvBatch; i++) {
+        struct sockaddr_in source;
+        socklen_t sourceLength = sizeof(source);
+        ssize_t length = mSocket->RecvFrom(buffer, sizeof(buffer), MSG_DONTWAIT,
+            reinterpret_cast<struct sockaddr*>(&source), &sourceLength);
+        if (length < 0) {
+            // e.g ECONNREFUSED from an ICMP error of an earlier send, not fatal
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                PLOG_DEBUG << "Demux recvfrom failed - " << strerror(errno);
+            }
+            break;
+        }
+        if (sourceLength != sizeof(source) || source.sin_family != AF_INET)
+            continue;
+
+        if (!Dispatch(&source, buffer, static_cast<size_t>(length)) || !*alive)
+            break;
+    }
+    return -1;
+}
+
+bool Demux::Dispatch(const struct sockaddr_in* source, const void* buffer, size_t length)
+{
+    switch (ClassifyDatagram(buffer, length)) {
+    case DatagramClass::kStun:
+        if (mStun != 0)
+            return Invoke(mStun, source, buffer, length);
+        PLOG_DEBUG << "Demux dropped a STUN message, nothing is resolving";
+        return true;
+    case DatagramClass::kRelay: {
+        uint64_t token;
+        memcpy(&token, static_cast<const char*>(buffer) + offsetof(struct relay_hdr, token),
+            sizeof(token));
+        if (auto it = mRelays.find(token); it != mRelays.end())
+            return Invoke(it->second, source, buffer, length);
+        break;
+    }
+    case DatagramClass::kAtp:
+        break;
+    case DatagramClass::kUnknown:
+        PLOG_DEBUG << "Demux dropped an unrecognized datagram";
+        return true;
+    }
+
+    if (auto it = mSources.find(SourceKey(source)); it != mSources.end())
+        return Invoke(it->second, source, buffer, length);
+
+    if (auto it = mHosts.find(source->sin_addr.s_addr); it != mHosts.end()) {
+        // Callbacks may delete each other, walk a snapshot
+        std::vector<callback_ident_t> candidates = it->second;
+        std::shared_ptr<bool> alive = mAlive;
+        for (callback_ident_t identifier : candidates) {
+            Entry* entry = mEntries.Get(identifier);
+            if (entry == nullptr)
+                continue;
+            host_callback_t callback = entry->mHostCallback;
+            bool claimed = callback(source, buffer, length);
+            if (!*alive || mSocket == nullptr)
+                return false;
+            if (claimed)
+                return true;
+        }
+    }
+
+    PLOG_DEBUG << "Demux dropped a datagram from an unknown source";
+    return true;
+}
+
+bool Demux::Invoke(callback_ident_t identifier, const struct sockaddr_in* source,
+    const void* buffer, size_t length)
+{
+    Entry* entry = mEntries.Get(identifier);
+    if (entry == nullptr)
+        return true;
+
+    std::shared_ptr<bool> alive = mAlive;
+    callback_t callback = entry->mCallback;
+    callback(source, buffer, length);
+    return *alive && mSocket != nullptr;
+}
+
+}
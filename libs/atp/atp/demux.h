@@ -1,13 +1,32 @@
 #pragma once
 
 #include "eventcore.h"
+#include "posix_socket.h"
+#include "slab.h"
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <netinet/in.h>
+#include <unordered_map>
+#include <vector>
 
 namespace Atp {
 
-// TODO: Why do we even need demux? Why not just create a new udp socket for every 
-// atp socket? Contact the STUN server, get its port, and then send a signal with 
+// What a datagram read from an ATP UDP socket carries. STUN, relay and ATP traffic
+// all share the socket, so whoever reads it classifies with this and hands every
+// datagram to its owner instead of dropping what it did not expect.
+enum class DatagramClass {
+    kUnknown = 0,
+    kStun, // to the INatResolver, matched by transaction id
+    kRelay, // from the relay, see relay.h
+    kAtp
+};
+
+DatagramClass ClassifyDatagram(const void* buffer, size_t length);
+
+// TODO: Why do we even need demux? Why not just create a new udp socket for every
+// atp socket? Contact the STUN server, get its port, and then send a signal with
 // that port?
 
 // NOTE: Assumption is that no two sockets will Bind() the same atp address (sort
@@ -15,21 +34,96 @@ namespace Atp {
 // comes later).
 // This means that there is a 1:1 relationship b/w atp address <-> ip:port.
 // So, we can demultiplex solely based off ip:port.
-class Demux {
+//
+// The Demux is the only reader of its UDP socket. Every datagram is classified
+// first, then handed to the first of:
+//   (1) the STUN callback, for STUN messages whatever their source
+//   (2) the relay callback of the token in the relay_hdr
+//   (3) the callback of its exact source address
+//   (4) the host callbacks of its source IP, until one claims it
+// Anything else is dropped. Callbacks may register and delete callbacks, and may
+// destroy the Demux itself.
+//
+// Event loop thread only.
+class Demux final {
 public:
-    // Any messages received which do not match a registered callback are silently 
-    // dropped
-    Demux(EventCore* eventCore, int networkFd);
+    using callback_t = std::function<void(const struct sockaddr_in* source,
+        const void* buffer, size_t length)>;
+    // Returns whether the datagram was meant for it, the next one is tried otherwise
+    using host_callback_t = std::function<bool(const struct sockaddr_in* source,
+        const void* buffer, size_t length)>;
+
+    // Takes the socket over and starts reading it, throws on failure
+    Demux(IEventCore* eventCore, std::unique_ptr<ISocket> socket);
+    ~Demux();
+
+    Demux(const Demux&) = delete;
+    Demux& operator=(const Demux&) = delete;
+
+    ISocket* GetSocket() const;
+    // Stops reading and hands the socket back, e.g to keep its mapping warm.
+    // Registered callbacks are never invoked again.
+    std::unique_ptr<ISocket> Release();
 
     // Returns 0 on failure, all identifers should be positive
     using callback_ident_t = unsigned int;
-    callback_ident_t RegisterCallback(const struct sockaddr_in* sourceAddress,
-        std::function<void(const void* buffer, size_t length)> callback);
+
+    // Fails if sourceAddress already has a callback
+    callback_ident_t RegisterCallback(const struct sockaddr_in* sourceAddress, callback_t callback);
+    // Any port of host without a callback of its own, e.g a range of predicted ports
+    callback_ident_t RegisterHostCallback(in_addr_t host, host_callback_t callback);
+    // Relayed datagrams carrying token, whichever relay they come from. Fails if
+    // token already has a callback.
+    callback_ident_t RegisterRelayCallback(uint64_t token, callback_t callback);
+
+    // STUN messages go here whatever their source, ahead of the callbacks above.
+    // Returns 0 if one is already registered.
+    callback_ident_t RegisterStunCallback(callback_t callback);
 
 //    callback_ident_t RegisterWildcardCallback(
  //       std::function<void(const void* buffer, size_t length)> callback);
 
     int DeleteCallback(callback_ident_t callbackIdentifier);
+    // Deletes the callback of sourceAddress from under its owner, whose own
+    // DeleteCallback() of it then fails harmlessly. -1 if there is none.
+    int EvictCallback(const struct sockaddr_in* sourceAddress);
+
+private:
+    enum class Kind {
+        kSource,
+        kHost,
+        kRelay,
+        kStun
+    };
+
+    struct Entry {
+        Kind mKind;
+        uint64_t mKey; // source address, host or token
+        callback_t mCallback;
+        host_callback_t mHostCallback;
+    };
+
+    static uint64_t SourceKey(const struct sockaddr_in* address);
+
+    mseconds_t RecvCallback();
+    // false if the Demux was destroyed or released by a callback
+    bool Dispatch(const struct sockaddr_in* source, const void* buffer, size_t length);
+    // Copies the callback first, it may delete itself while running
+    bool Invoke(callback_ident_t identifier, const struct sockaddr_in* source,
+        const void* buffer, size_t length);
+
+    IEventCore* mEventCore;
+    std::unique_ptr<ISocket> mSocket;
+    IEventCore::callback_ident_t mRecvCallback {};
+    // Cleared when the Demux goes away, so a dispatch loop notices a callback
+    // destroying it
+    std::shared_ptr<bool> mAlive;
+
+    Slab<Entry> mEntries;
+    std::unordered_map<uint64_t, callback_ident_t> mSources;
+    std::unordered_map<in_addr_t, std::vector<callback_ident_t>> mHosts;
+    std::unordered_map<uint64_t, callback_ident_t> mRelays;
+    callback_ident_t mStun {};
 };
 
 }
@@ -0,0 +1,400 @@
+#include "eventcore.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <plog/Log.h>
+#include <pthread.h>
+#include <sched.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace Atp {
+
+// epoll_data.u32 of the command eventfd, callback identifiers are always > 0
+static constexpr uint32_t kCommandIdentifier = 0;
+static constexpr int kMaxEvents = 64;
+
+static uint32_t InterestEvents(int flags)
+{
+    return (flags & IEventCore::kWritable) ? EPOLLOUT : EPOLLIN;
+}
+
+EventCore::EventCore()
+    : EventCore(Options {})
+{
+}
+
+EventCore::EventCore(Options options)
+    : mOptions { options }
+{
+    THROW_IF(mOptions.mBusyPollUs < 0);
+
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    THROW_IF(mEpollFd < 0);
+
+    mCommandFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    THROW_IF(mCommandFd < 0);
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = kCommandIdentifier;
+    THROW_IF(epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mCommandFd, &event) != 0);
+}
+
+EventCore::~EventCore()
+{
+    close(mCommandFd);
+    close(mEpollFd);
+}
+
+void EventCore::Run()
+{
+    struct epoll_event events[kMaxEvents];
+
+    PinThread();
+
+    while (!mStopped.load(std::memory_order_acquire)) {
+        int count = Wait(events, kMaxEvents);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            THROW("EventCore::Run epoll_wait failed");
+        }
+
+        Dispatch(events, count);
+    }
+}
+
+int EventCore::GetFd() const
+{
+    return mEpollFd;
+}
+
+int EventCore::ProcessEvents(mseconds_t timeout)
+{
+    struct epoll_event events[kMaxEvents];
+
+    mseconds_t next = NextTimeout();
+    if (timeout < 0 || (next >= 0 && next < timeout))
+        timeout = next;
+
+    int count = epoll_wait(mEpollFd, events, kMaxEvents, timeout);
+    if (count == -1) {
+        if (errno != EINTR)
+            return -1;
+        count = 0;
+    }
+
+    Dispatch(events, count);
+    return count;
+}
+
+void EventCore::Dispatch(const struct epoll_event* events, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.u32 == kCommandIdentifier)
+            DrainCommands();
+        else
+            Invoke(events[i].data.u32);
+    }
+
+    DispatchTimers();
+}
+
+int EventCore::Wait(struct epoll_event* events, int maxEvents)
+{
+    mseconds_t timeout = NextTimeout();
+    if (mOptions.mBusyPollUs == 0 || timeout == 0)
+        return epoll_wait(mEpollFd, events, maxEvents, timeout);
+
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point spinEnd = start + microseconds(mOptions.mBusyPollUs);
+    if (timeout > 0)
+        spinEnd = std::min(spinEnd, start + milliseconds(timeout));
+
+    do {
+        int count = epoll_wait(mEpollFd, events, maxEvents, 0);
+        if (count != 0)
+            return count;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } while (steady_clock::now() < spinEnd);
+
+    // Budget exhausted, block for whatever is left until the next timer
+    return epoll_wait(mEpollFd, events, maxEvents, NextTimeout());
+}
+
+void EventCore::PinThread()
+{
+    if (mOptions.mCpu < 0)
+        return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(mOptions.mCpu, &cpus);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0)
+        PLOG_WARNING << "EventCore::PinThread failed to pin to cpu " << mOptions.mCpu
+                     << " - " << strerror(ret);
+}
+
+int EventCore::GetBusyPollUs() const
+{
+    return mOptions.mBusyPollUs;
+}
+
+void EventCore::Stop()
+{
+    mStopped.store(true, std::memory_order_release);
+
+    uint64_t value = 1;
+    THROW_IF(write(mCommandFd, &value, sizeof(value)) != sizeof(value));
+}
+
+bool EventCore::Post(Command&& command)
+{
+    if (!mCommands.TryPush(std::move(command)))
+        return false;
+
+    // Only the first producer since the last drain needs to wake the loop up
+    if (!mCommandsSignalled.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t value = 1;
+        THROW_IF(write(mCommandFd, &value, sizeof(value)) != sizeof(value));
+    }
+    return true;
+}
+
+void EventCore::DrainCommands()
+{
+    uint64_t value;
+    // EAGAIN is fine, Stop() and Post() share the eventfd
+    (void)!read(mCommandFd, &value, sizeof(value));
+
+    // acq_rel so that pushes which observed the flag as set are visible below
+    mCommandsSignalled.exchange(false, std::memory_order_acq_rel);
+
+    Command command;
+    while (mCommands.TryPop(command))
+        command();
+}
+
+IEventCore::callback_ident_t EventCore::RegisterCallback(ISocket* socket, int flags,
+    callback_t callback, void* callbackData)
+{
+    if (socket == nullptr)
+        return 0;
+    return AddCallback(socket->GetFd(), flags, std::move(callback), callbackData);
+}
+
+IEventCore::callback_ident_t EventCore::RegisterCallback(int flags,
+    callback_t callback, void* callbackData)
+{
+    if (!(flags & kInvokeImmediately))
+        return 0;
+    return AddCallback(-1, flags, std::move(callback), callbackData);
+}
+
+EventCore::Callback* EventCore::Find(callback_ident_t callbackIdentifier)
+{
+    Callback* callback = mCallbacks.Get(callbackIdentifier);
+    if (callback == nullptr || callback->mDeleted)
+        return nullptr;
+    return callback;
+}
+
+IEventCore::callback_ident_t EventCore::AddCallback(int fd, int flags,
+    callback_t callback, void* callbackData)
+{
+    bool suspended = flags & kSuspend;
+
+    callback_ident_t identifier = mCallbacks.Emplace(Callback {
+        .mFd = fd,
+        .mFlags = flags,
+        .mSuspended = suspended,
+        .mInvokePending = static_cast<bool>(flags & kInvokeImmediately),
+        .mInvoking = false,
+        .mDeleted = false,
+        .mDeadlineMs = 0,
+        .mFunction = std::move(callback),
+        .mCallbackData = callbackData });
+    if (identifier == 0) {
+        PLOG_WARNING << "EventCore::AddCallback callback table is full";
+        return 0;
+    }
+
+    if (fd != -1) {
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = suspended ? 0 : InterestEvents(flags);
+        event.data.u32 = identifier;
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            PLOG_WARNING << "EventCore::AddCallback epoll_ctl failed - " << strerror(errno);
+            mCallbacks.Erase(identifier);
+            return 0;
+        }
+    }
+
+    Callback* entry = mCallbacks.Get(identifier);
+    if (!suspended && entry->mInvokePending)
+        ArmTimer(identifier, *entry, 0);
+
+    return identifier;
+}
+
+int EventCore::SuspendCallback(callback_ident_t callbackIdentifier)
+{
+    Callback* callback = Find(callbackIdentifier);
+    if (callback == nullptr)
+        return -1;
+    if (callback->mSuspended)
+        return 0;
+
+    if (callback->mFd != -1) {
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = 0;
+        event.data.u32 = callbackIdentifier;
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, callback->mFd, &event) != 0)
+            return -1;
+    }
+
+    callback->mSuspended = true;
+    callback->mDeadlineMs = 0;
+    return 0;
+}
+
+int EventCore::ResumeCallback(callback_ident_t callbackIdentifier)
+{
+    Callback* callback = Find(callbackIdentifier);
+    if (callback == nullptr)
+        return -1;
+    if (!callback->mSuspended)
+        return 0;
+
+    if (callback->mFd != -1) {
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = InterestEvents(callback->mFlags);
+        event.data.u32 = callbackIdentifier;
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, callback->mFd, &event) != 0)
+            return -1;
+    }
+
+    callback->mSuspended = false;
+    if (callback->mInvokePending)
+        ArmTimer(callbackIdentifier, *callback, 0);
+    return 0;
+}
+
+int EventCore::DeleteCallback(callback_ident_t callbackIdentifier)
+{
+    Callback* callback = Find(callbackIdentifier);
+    if (callback == nullptr)
+        return -1;
+
+    if (callback->mFd != -1)
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, callback->mFd, nullptr);
+
+    if (callback->mInvoking) {
+        // Still on the stack, Invoke() frees the slot once the callback returns
+        callback->mDeleted = true;
+        return 0;
+    }
+
+    mCallbacks.Erase(callbackIdentifier);
+    return 0;
+}
+
+void EventCore::Invoke(callback_ident_t callbackIdentifier)
+{
+    // Slots never move, so callback stays valid even if the callback
+    // registers new callbacks
+    Callback* callback = Find(callbackIdentifier);
+    if (callback == nullptr || callback->mSuspended)
+        return;
+
+    callback->mInvokePending = false;
+    callback->mDeadlineMs = 0;
+
+    callback->mInvoking = true;
+    mseconds_t timeout = callback->mFunction(callback->mCallbackData);
+    callback->mInvoking = false;
+
+    if (callback->mDeleted) {
+        mCallbacks.Erase(callbackIdentifier);
+        return;
+    }
+
+    if (callback->mSuspended || timeout < 0)
+        return;
+
+    ArmTimer(callbackIdentifier, *callback, timeout);
+}
+
+void EventCore::ArmTimer(callback_ident_t callbackIdentifier, Callback& callback,
+    mseconds_t timeout)
+{
+    // + 1 so that a deadline is never 0, which stands for "not armed"
+    callback.mDeadlineMs = GetTimeMs() + timeout + 1;
+    mTimers.push({ .mDeadlineMs = callback.mDeadlineMs,
+        .mIdentifier = callbackIdentifier });
+}
+
+void EventCore::DispatchTimers()
+{
+    uint64_t now = GetTimeMs() + 1;
+
+    // Collect first, a callback returning 0 re-arms itself with an already
+    // expired deadline and would otherwise starve the loop
+    mExpiredTimers.clear();
+    while (!mTimers.empty() && mTimers.top().mDeadlineMs <= now) {
+        mExpiredTimers.push_back(mTimers.top());
+        mTimers.pop();
+    }
+
+    for (const Timer& timer : mExpiredTimers) {
+        Callback* callback = Find(timer.mIdentifier);
+        if (callback == nullptr || callback->mDeadlineMs != timer.mDeadlineMs)
+            continue; // stale
+
+        Invoke(timer.mIdentifier);
+    }
+}
+
+mseconds_t EventCore::NextTimeout()
+{
+    while (!mTimers.empty()) {
+        const Timer& timer = mTimers.top();
+        Callback* callback = Find(timer.mIdentifier);
+        if (callback != nullptr && callback->mDeadlineMs == timer.mDeadlineMs)
+            break;
+        mTimers.pop();
+    }
+
+    if (mTimers.empty())
+        return -1;
+
+    uint64_t now = GetTimeMs() + 1;
+    if (mTimers.top().mDeadlineMs <= now)
+        return 0;
+    return static_cast<mseconds_t>(mTimers.top().mDeadlineMs - now);
+}
+
+uint64_t EventCore::GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+}
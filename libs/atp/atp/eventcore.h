@@ -1,10 +1,17 @@
 #pragma once
 
+#include "command_queue.h"
 #include "common.h"
+#include "inline_function.h"
 #include "posix_socket.h"
+#include "slab.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <queue>
 #include <sys/epoll.h>
+#include <vector>
 
 namespace Atp {
 
@@ -19,50 +26,153 @@ public:
     // Start in suspended state
     static constexpr int kSuspend = 0x10;
 
+    // Wait for the socket to become writable instead of readable
+    static constexpr int kWritable = 0x20;
+
 
     /* Methods */
     virtual ~IEventCore() = default;
 
     virtual void Run() = 0;
 
-    // Always > 0
+    // Always > 0. Encodes a slot and a generation, so using an identifier after
+    // DeleteCallback() fails cleanly instead of hitting whoever reuses the slot.
     using callback_ident_t = unsigned int;
 
+    // Stored inline, no allocation per registration. Capture `this` (or a
+    // pointer) rather than large objects.
+    using callback_t = InlineFunction<mseconds_t(void*), Config::kInlineCallbackSize>;
+
     // returns 0 on failure, callbackData is passed to the callback as-is
     virtual callback_ident_t RegisterCallback(ISocket* socket, int flags,
-            std::function<mseconds_t(void*)> callback, void* callbackData) = 0;
+            callback_t callback, void* callbackData) = 0;
 
     // kInvokeImmediately *must* be set, returns 0 on failure
     virtual callback_ident_t RegisterCallback(int flags, 
-            std::function<mseconds_t(void*)> callback, void* callbackData) = 0;
+            callback_t callback, void* callbackData) = 0;
 
     virtual int SuspendCallback(callback_ident_t callbackIdentifier) = 0;
     virtual int ResumeCallback(callback_ident_t callbackIdentifier) = 0;
 
     virtual int DeleteCallback(callback_ident_t callbackIdentifier) = 0;
+
+    // Work handed over from application threads, run on the event loop thread
+    using Command = std::move_only_function<void()>;
+
+    // The only method which is safe to call from any thread. Returns false if
+    // the command queue is full, command is left untouched in that case.
+    virtual bool Post(Command&& command) = 0;
+
+    // Busy-poll budget of the loop in microseconds, 0 when the loop always blocks.
+    // Sockets served by a busy-polling loop should set SO_BUSY_POLL as well.
+    virtual int GetBusyPollUs() const = 0;
 };
 
-// EventCore will need locking - the main thread can call register (etc.) callback
-// functions, whereas the atp thread is the epoll() loop
+// Everything except Post() *must* be called from the event loop thread.
+// Application threads never touch registrations directly - they Post() a
+// command (see Context::Execute) which the loop drains every iteration, so
+// the hot path stays free of locks.
 class EventCore final : public IEventCore {
 public:
-    EventCore() = default;
+    struct Options {
+        // Low-latency mode: spin on non-blocking epoll_wait() for this long before
+        // falling back to a blocking wait. Burns a core to shave the wakeup latency
+        // of a blocking epoll_wait() off every packet. 0 = always block.
+        int mBusyPollUs { 0 };
+        // Pin the event loop thread to this CPU, -1 = no pinning
+        int mCpu { -1 };
+    };
+
+    EventCore();
+    explicit EventCore(Options options);
+    ~EventCore() override;
+
+    EventCore(const EventCore&) = delete;
+    EventCore& operator=(const EventCore&) = delete;
 
     void Run() override; // Houses the main epoll() loop
+    void Stop(); // Thread-safe, Run() returns after the current iteration
+
+    /* Embedding: drive the loop from an application-owned event loop instead of Run() */
+
+    // The epoll fd, readable whenever ProcessEvents() has something to do
+    int GetFd() const;
+    // Waits at most timeout ms (-1 = until the next timer/event), dispatches ready
+    // callbacks and expired timers. Returns number of fd events handled, -1 on error.
+    int ProcessEvents(mseconds_t timeout);
+    // ms until the next timer fires, 0 if one is already due, -1 if none is armed
+    mseconds_t NextTimeout();
 
     // Simply use ISocket.GetFd() and use that in the epoll() loop
     // When using a fake ISocket, we will have to use a fake IEventCore which does not 
     // truly use an fd
     callback_ident_t RegisterCallback(ISocket* socket, int flags,
-            std::function<mseconds_t(void*)> callback, void* callbackData) override;
+            callback_t callback, void* callbackData) override;
 
     callback_ident_t RegisterCallback(int flags, 
-            std::function<mseconds_t(void*)> callback, void* callbackData) override;
+            callback_t callback, void* callbackData) override;
 
     int SuspendCallback(callback_ident_t callbackIdentifier) override;
     int ResumeCallback(callback_ident_t callbackIdentifier) override;
 
     int DeleteCallback(callback_ident_t callbackIdentifier) override;
+
+    bool Post(Command&& command) override;
+
+    int GetBusyPollUs() const override;
+
+private:
+    struct Callback {
+        int mFd; // -1 for timer-only callbacks
+        int mFlags;
+        bool mSuspended;
+        bool mInvokePending; // kInvokeImmediately, deferred until resumed
+        bool mInvoking; // DeleteCallback() from within itself is deferred
+        bool mDeleted;
+        uint64_t mDeadlineMs; // 0 = no timer armed
+        callback_t mFunction;
+        void* mCallbackData;
+    };
+
+    struct Timer {
+        uint64_t mDeadlineMs;
+        callback_ident_t mIdentifier;
+
+        bool operator>(const Timer& other) const
+        {
+            return mDeadlineMs > other.mDeadlineMs;
+        }
+    };
+
+    static uint64_t GetTimeMs();
+
+    Callback* Find(callback_ident_t callbackIdentifier);
+    callback_ident_t AddCallback(int fd, int flags,
+        callback_t callback, void* callbackData);
+    void Invoke(callback_ident_t callbackIdentifier);
+    void ArmTimer(callback_ident_t callbackIdentifier, Callback& callback, mseconds_t timeout);
+
+    void PinThread();
+    int Wait(struct epoll_event* events, int maxEvents);
+    void Dispatch(const struct epoll_event* events, int count);
+    void DrainCommands();
+    void DispatchTimers();
+
+    Options mOptions;
+    int mEpollFd;
+    int mCommandFd; // eventfd, readable when commands are pending
+
+    MpscQueue<Command, Config::kCommandQueueSize> mCommands;
+    // Set by the first producer after the loop last drained the queue, so that
+    // a burst of Post() calls costs a single eventfd write
+    std::atomic<bool> mCommandsSignalled { false };
+    std::atomic<bool> mStopped { false };
+
+    Slab<Callback> mCallbacks;
+    // Lazily deleted, stale entries are skipped when their deadline does not
+    // match the callback's current mDeadlineMs
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> mTimers;
+    std::vector<Timer> mExpiredTimers;
 };
 
 }
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace Atp {
+
+// File descriptor indexed table owning one T per descriptor.
+//
+// Two-level radix: the fd's high bits pick a chunk, the low bits a slot in it.
+// Chunks are allocated the first time a descriptor in their range shows up and
+// are never freed or moved, so lookups are two loads and no hashing or tree walk.
+//
+// Single writer, many readers: Insert()/Erase()/Get() *must* all come from the
+// same thread (the event loop), while Acquire() may be called from any thread.
+// Every slot counts the readers holding a Ref to it, and the writer waits for
+// them to leave before it destroys or hands back what it took out of the slot.
+// The counts live in the chunks, which are never freed, so a reader can always
+// touch its count even when the T is already gone.
+// NOTE: Refs are for short, non-blocking work (a ring read say), the event loop
+// spins while one is held on a descriptor it erases.
+template <typename T>
+class FdTable final {
+public:
+    // Default nr_open, no process can hold a descriptor beyond it without
+    // raising /proc/sys/fs/nr_open
+    static constexpr int kMaxFds = 1 << 20;
+
+    FdTable() = default;
+    FdTable(const FdTable&) = delete;
+    FdTable& operator=(const FdTable&) = delete;
+
+    ~FdTable()
+    {
+        for (std::atomic<Chunk*>& entry : mChunks) {
+            Chunk* chunk = entry.load(std::memory_order_relaxed);
+            if (chunk == nullptr)
+                continue;
+            for (Slot& slot : chunk->mSlots)
+                delete slot.mValue.load(std::memory_order_relaxed);
+            delete chunk;
+        }
+    }
+
+    // Writer only. Replaces (and destroys) any previous value for fd.
+    void Insert(int fd, std::unique_ptr<T> value)
+    {
+        THROW_IF(fd < 0 || fd >= kMaxFds);
+
+        std::atomic<Chunk*>& entry = mChunks[fd >> kChunkBits];
+        Chunk* chunk = entry.load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new Chunk {};
+            entry.store(chunk, std::memory_order_release);
+        }
+
+        T* old = Exchange(chunk->mSlots[fd & kChunkMask], value.release());
+        if (old != nullptr)
+            mSize--;
+        delete old;
+        mSize++;
+    }
+
+    // Writer only, hands ownership back to the caller
+    std::unique_ptr<T> Erase(int fd)
+    {
+        Chunk* chunk = FindChunk(fd);
+        if (chunk == nullptr)
+            return nullptr;
+
+        T* old = Exchange(chunk->mSlots[fd & kChunkMask], nullptr);
+        if (old != nullptr)
+            mSize--;
+        return std::unique_ptr<T>(old);
+    }
+
+    // Writer only, O(1). nullptr if fd is not in the table.
+    T* Get(int fd) const
+    {
+        Chunk* chunk = FindChunk(fd);
+        if (chunk == nullptr)
+            return nullptr;
+        return chunk->mSlots[fd & kChunkMask].mValue.load(std::memory_order_relaxed);
+    }
+
+    class Ref;
+
+    // Any thread, O(1). The T stays alive while the Ref does, empty if fd is
+    // not in the table.
+    Ref Acquire(int fd) const
+    {
+        Chunk* chunk = FindChunk(fd);
+        if (chunk == nullptr)
+            return Ref {};
+
+        Slot& slot = chunk->mSlots[fd & kChunkMask];
+        // seq_cst pairs with Exchange(): either the writer sees us counted, or
+        // we see what it stored
+        slot.mReaders.fetch_add(1, std::memory_order_seq_cst);
+        T* value = slot.mValue.load(std::memory_order_seq_cst);
+        if (value == nullptr) {
+            slot.mReaders.fetch_sub(1, std::memory_order_release);
+            return Ref {};
+        }
+        return Ref { &slot, value };
+    }
+
+    // Writer only
+    size_t Size() const
+    {
+        return mSize;
+    }
+
+private:
+    static constexpr int kChunkBits = 12;
+    static constexpr int kChunkSize = 1 << kChunkBits;
+    static constexpr int kChunkMask = kChunkSize - 1;
+
+    struct Slot {
+        std::atomic<T*> mValue {};
+        std::atomic<uint32_t> mReaders {};
+    };
+
+    struct Chunk {
+        Slot mSlots[kChunkSize] {};
+    };
+
+    // Takes the old value out of slot, once no reader can still be using it
+    static T* Exchange(Slot& slot, T* value)
+    {
+        T* old = slot.mValue.exchange(value, std::memory_order_seq_cst);
+        if (old == nullptr)
+            return nullptr;
+        while (slot.mReaders.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+        return old;
+    }
+
+    Chunk* FindChunk(int fd) const
+    {
+        if (static_cast<unsigned>(fd) >= kMaxFds)
+            return nullptr;
+        return mChunks[fd >> kChunkBits].load(std::memory_order_acquire);
+    }
+
+public:
+    class Ref final {
+    public:
+        Ref() = default;
+        Ref(Ref&& other)
+            : mSlot { std::exchange(other.mSlot, nullptr) }
+            , mValue { std::exchange(other.mValue, nullptr) }
+        {
+        }
+        Ref& operator=(Ref&& other)
+        {
+            if (this != &other) {
+                Release();
+                mSlot = std::exchange(other.mSlot, nullptr);
+                mValue = std::exchange(other.mValue, nullptr);
+            }
+            return *this;
+        }
+        ~Ref()
+        {
+            Release();
+        }
+
+        T* Get() const { return mValue; }
+        T* operator->() const { return mValue; }
+        explicit operator bool() const { return mValue != nullptr; }
+
+    private:
+        friend class FdTable;
+
+        Ref(Slot* slot, T* value)
+            : mSlot { slot }
+            , mValue { value }
+        {
+        }
+
+        void Release()
+        {
+            if (mSlot != nullptr)
+                mSlot->mReaders.fetch_sub(1, std::memory_order_release);
+            mSlot = nullptr;
+            mValue = nullptr;
+        }
+
+        Slot* mSlot {};
+        T* mValue {};
+    };
+
+private:
+    // 256 pointers, a Context holding only a handful of sockets costs 2KiB + one chunk
+    std::atomic<Chunk*> mChunks[kMaxFds >> kChunkBits] {};
+    size_t mSize { 0 };
+};
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Atp {
+
+template <typename Signature, size_t Capacity>
+class InlineFunction;
+
+// Move-only std::function look-alike which never allocates: the callable is
+// stored in an inline buffer of Capacity bytes, and callables which do not fit
+// are rejected at compile time. Capture a pointer (usually `this`) instead of
+// capturing large objects by value.
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity> final {
+public:
+    InlineFunction() = default;
+
+    template <typename Function>
+        requires(!std::is_same_v<std::decay_t<Function>, InlineFunction>
+            && std::is_invocable_r_v<R, std::decay_t<Function>&, Args...>)
+    InlineFunction(Function&& function)
+    {
+        using T = std::decay_t<Function>;
+        static_assert(sizeof(T) <= Capacity, "Callable too large for InlineFunction");
+        static_assert(alignof(T) <= alignof(std::max_align_t));
+        static_assert(std::is_nothrow_move_constructible_v<T>);
+
+        ::new (static_cast<void*>(mStorage)) T(std::forward<Function>(function));
+        mInvoke = &InvokeImpl<T>;
+        mManage = &ManageImpl<T>;
+    }
+
+    InlineFunction(InlineFunction&& other) noexcept
+    {
+        MoveFrom(other);
+    }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept
+    {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction()
+    {
+        Reset();
+    }
+
+    R operator()(Args... args)
+    {
+        return mInvoke(mStorage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const
+    {
+        return mInvoke != nullptr;
+    }
+
+    void Reset()
+    {
+        if (mManage)
+            mManage(mStorage, nullptr);
+        mInvoke = nullptr;
+        mManage = nullptr;
+    }
+
+private:
+    template <typename T>
+    static R InvokeImpl(void* storage, Args&&... args)
+    {
+        return (*std::launder(static_cast<T*>(storage)))(std::forward<Args>(args)...);
+    }
+
+    // destination == nullptr destroys source, otherwise moves source into destination
+    template <typename T>
+    static void ManageImpl(void* source, void* destination)
+    {
+        T* object = std::launder(static_cast<T*>(source));
+        if (destination)
+            ::new (destination) T(std::move(*object));
+        object->~T();
+    }
+
+    void MoveFrom(InlineFunction& other)
+    {
+        if (other.mManage)
+            other.mManage(other.mStorage, mStorage);
+        mInvoke = other.mInvoke;
+        mManage = other.mManage;
+        other.mInvoke = nullptr;
+        other.mManage = nullptr;
+    }
+
+    alignas(std::max_align_t) std::byte mStorage[Capacity];
+    R (*mInvoke)(void*, Args&&...) {};
+    void (*mManage)(void*, void*) {};
+};
+
+}
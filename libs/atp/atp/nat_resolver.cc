@@ -1,37 +1,312 @@
 #include "nat_resolver.h"
+#include "demux.h"
 
-#include <stun/stun.h>
+#include <algorithm>
+#include <chrono>
 #include <netinet/in.h>
+#include <plog/Log.h>
+#include <stun/profile.h>
+#include <stun/stun.h>
+#include <sys/socket.h>
 
 namespace Atp {
 
-INatResolver::NatType StunClient::Resolve(int sockfd, struct sockaddr_in* reflexiveAddress)
+static uint64_t GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+StunClient::StunClient(IEventCore* eventCore, std::string profilePath)
+    : mEventCore { eventCore }
+    , mEndpoints { Stun::Client::kDefaultServers }
+    , mProfilePath { std::move(profilePath) }
+{
+    Stun::Profile profile;
+    if (mProfilePath.empty() || Stun::LoadProfile(mProfilePath, &profile) != 0)
+        return;
+
+    for (auto& server : profile.mServers)
+        mServers.push_back(server.mAddress);
+
+    if (profile.mNatType == Stun::NatType::kIndependent || profile.mNatType == Stun::NatType::kDependent) {
+        NatType type = profile.mNatType == Stun::NatType::kDependent ? NatType::kDependent
+                                                                     : NatType::kIndependent;
+        mCache[htonl(INADDR_ANY)] = CacheEntry { type, GetTimeMs() + Config::kNatCacheTtl,
+            profile.mPublicAddress };
+    }
+}
+
+StunClient::~StunClient()
+{
+    // Outstanding resolutions simply never complete
+    mResolutions.ForEach([this](resolution_ident_t, Resolution& resolution) {
+        mEventCore->DeleteCallback(resolution.mCallback);
+    });
+}
+
+INatResolver::resolution_ident_t StunClient::Resolve(ISocket* socket, completion_t completion)
+{
+    return Start(socket, std::move(completion), false);
+}
+
+INatResolver::resolution_ident_t StunClient::ResolveShared(ISocket* socket, completion_t completion)
+{
+    return Start(socket, std::move(completion), true);
+}
+
+void StunClient::OnStunDatagram(resolution_ident_t id, const struct sockaddr_in* source,
+    const void* buffer, size_t length)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    if (resolution == nullptr || !resolution->mShared)
+        return;
+
+    int64_t timeout = resolution->mClient->OnDatagram(source, buffer, length);
+    if (timeout >= 0)
+        return; // the timer is still due when the query is
+
+    // A next round needs its first retransmission timer, not the one the callback
+    // is currently waiting on
+    if (Settle(id, timeout) >= 0 && !Arm(id)) {
+        PLOG_WARNING << "Failed to re-arm the STUN timer, giving up on the resolution";
+        Finish(id);
+    }
+}
+
+INatResolver::resolution_ident_t StunClient::Start(ISocket* socket, completion_t completion,
+    bool shared)
+{
+    in_addr_t interface = GetInterface(socket);
+    resolution_ident_t id = mResolutions.Emplace(Resolution {
+        .mClient = std::make_unique<Stun::Client>(socket->GetFd()),
+        .mSocket = socket,
+        .mInterface = interface,
+        .mShared = shared,
+        .mCompletion = std::move(completion) });
+    if (id == 0)
+        return 0;
+
+    Resolution* resolution = mResolutions.Get(id);
+    if (const CacheEntry* entry = FindCacheEntry(interface)) {
+        resolution->mCachedType = entry->mType;
+        resolution->mCachedPublicAddress = entry->mPublicAddress;
+    }
+    if (!mServers.empty())
+        resolution->mClient->SetResolvedServers(mServers);
+    resolution->mClient->SetEndpointCache(&mEndpoints);
+
+    // Invoked right away to send the first requests, from the loop rather than here
+    if (!Arm(id)) {
+        mResolutions.Erase(id);
+        return 0;
+    }
+
+    return id;
+}
+
+bool StunClient::Arm(resolution_ident_t id)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    if (resolution->mCallback)
+        mEventCore->DeleteCallback(resolution->mCallback);
+
+    auto callback = [this, id](void*) -> mseconds_t {
+        return Step(id);
+    };
+    if (resolution->mShared)
+        resolution->mCallback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+            callback, nullptr);
+    else
+        resolution->mCallback = mEventCore->RegisterCallback(resolution->mSocket,
+            IEventCore::kInvokeImmediately, callback, nullptr);
+    return resolution->mCallback != 0;
+}
+
+void StunClient::Cancel(resolution_ident_t id)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    if (resolution == nullptr)
+        return;
+
+    mEventCore->DeleteCallback(resolution->mCallback);
+    mResolutions.Erase(id);
+}
+
+void StunClient::Invalidate(ISocket* socket)
 {
-    Stun::Client client(sockfd, {
-            .mTimeoutMs = 50,
-            .mMaxRetransmissions = 20,
-            .mFinalTimeoutMultiplier = 2
-            });
+    mCache.erase(GetInterface(socket));
+}
+
+mseconds_t StunClient::Step(resolution_ident_t id)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    if (resolution == nullptr)
+        return -1;
 
-    if (client.QueryAllServers() < 0) {
-        reflexiveAddress = nullptr;
-        return INatResolver::NatType::kUnknown;
+    Stun::Client& client = *resolution->mClient;
+    int64_t timeout;
+
+    if (client.GetQueryState() == Stun::Client::QueryState::kIdle) {
+        // Nothing to query before the first DNS answers, unless a profile had the servers
+        if (mServers.empty() && !mEndpoints.IsReady())
+            return Config::kStunDnsPollInterval;
+        timeout = StartRound(resolution);
+    } else {
+        // NOTE: A socket read here belongs to the resolver until it completes (e.g
+        // a SocketPool entry), nothing but STUN is expected on it
+        char buffer[1500];
+        struct sockaddr_in source;
+        socklen_t sourceLength = sizeof(source);
+        ssize_t length;
+        while (!resolution->mShared
+            && (length = recvfrom(resolution->mSocket->GetFd(), buffer, sizeof(buffer), MSG_DONTWAIT,
+                    reinterpret_cast<struct sockaddr*>(&source), &sourceLength))
+                >= 0) {
+            if (sourceLength == sizeof(source)
+                && ClassifyDatagram(buffer, static_cast<size_t>(length)) == DatagramClass::kStun)
+                client.OnDatagram(&source, buffer, static_cast<size_t>(length));
+            else
+                PLOG_DEBUG << "Dropped a non-STUN datagram on a socket being resolved";
+            sourceLength = sizeof(source);
+        }
+        timeout = client.OnTimer();
     }
 
-    socklen_t length = sizeof(struct sockaddr_in);
-    if (client.GetReflexiveAddress((struct sockaddr*)reflexiveAddress, &length) < 0)
-        reflexiveAddress = nullptr;
-    THROW_IF(reflexiveAddress->sin_family != AF_INET);
+    return Settle(id, timeout);
+}
 
-    Stun::NatType type = client.GetNatType();
-    INatResolver::NatType ret = INatResolver::NatType::kUnknown;
+mseconds_t StunClient::Settle(resolution_ident_t id, int64_t timeout)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    Stun::Client& client = *resolution->mClient;
+
+    if (timeout < 0 && resolution->mCachedType == NatType::kIndependent) {
+        // No answer to the single request, or a different public address: the
+        // network has changed under the cache entry. Start over with a full
+        // classification.
+        struct sockaddr_in reflexiveAddress;
+        socklen_t length = sizeof(reflexiveAddress);
+        bool changed = client.GetQueryState() == Stun::Client::QueryState::kFailed
+            || client.GetReflexiveAddress(reinterpret_cast<struct sockaddr*>(&reflexiveAddress), &length) != 0
+            || reflexiveAddress.sin_addr.s_addr != resolution->mCachedPublicAddress.s_addr;
+        if (changed) {
+            mCache.erase(resolution->mInterface);
+            resolution->mCachedType.reset();
+            resolution->mRounds = 0;
+            timeout = StartRound(resolution);
+        }
+    } else if (timeout < 0 && client.GetQueryState() == Stun::Client::QueryState::kSucceeded
+        && client.GetNatType() == Stun::NatType::kUnknown && resolution->mRounds < kMaxRounds) {
+        timeout = StartRound(resolution);
+    }
+
+    if (timeout >= 0)
+        return static_cast<mseconds_t>(timeout);
+
+    Finish(id);
+    return -1;
+}
+
+int64_t StunClient::StartRound(Resolution* resolution)
+{
+    resolution->mRounds++;
+    // Behind a dependent NAT the mapping of a single server says nothing about
+    // the next one, the port allocation pattern needs all of them
+    if (resolution->mCachedType == NatType::kIndependent)
+        return resolution->mClient->Start(1);
+    return resolution->mClient->Start();
+}
+
+void StunClient::Finish(resolution_ident_t id)
+{
+    Resolution* resolution = mResolutions.Get(id);
+    Stun::Client& client = *resolution->mClient;
+
+    NatType type = NatType::kUnknown;
+    struct sockaddr_in reflexiveAddress;
+    socklen_t length = sizeof(reflexiveAddress);
+    bool resolved = client.GetQueryState() == Stun::Client::QueryState::kSucceeded
+        && client.GetReflexiveAddress(reinterpret_cast<struct sockaddr*>(&reflexiveAddress), &length) == 0;
+
+    if (resolution->mCachedType) {
+        type = *resolution->mCachedType;
+    } else {
+        // With a single server answering, the mapping could not be compared against
+        // another one. Go with it, a dependent NAT shows up as failed punching anyway.
+        if (client.GetNatType() == Stun::NatType::kDependent)
+            type = NatType::kDependent;
+        else if (resolved)
+            type = NatType::kIndependent;
+
+        // Only a classification which actually compared mappings is worth caching
+        if (client.GetNatType() != Stun::NatType::kUnknown) {
+            mCache[resolution->mInterface] = CacheEntry { type, GetTimeMs() + Config::kNatCacheTtl,
+                resolved ? reflexiveAddress.sin_addr : in_addr {} };
+            if (resolution->mInterface == htonl(INADDR_ANY))
+                SaveProfile(client, type, resolved ? &reflexiveAddress : nullptr);
+        }
+    }
+
+    struct sockaddr_in predictedAddress;
+    int portDelta = 0;
+    bool predicted = type == NatType::kDependent
+        && client.PredictMapping(&predictedAddress, &portDelta) == 0;
+
+    // Deleting our own callback from within it is fine, EventCore defers it
+    mEventCore->DeleteCallback(resolution->mCallback);
+    completion_t completion = std::move(resolution->mCompletion);
+    mResolutions.Erase(id);
+
+    if (type == NatType::kIndependent && resolved)
+        completion(type, &reflexiveAddress, 0);
+    else if (predicted)
+        completion(type, &predictedAddress, portDelta);
+    else
+        completion(type == NatType::kDependent ? type : NatType::kUnknown, nullptr, 0);
+}
+
+in_addr_t StunClient::GetInterface(const ISocket* socket)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(socket->GetFd(), reinterpret_cast<struct sockaddr*>(&address), &length) != 0
+        || address.sin_family != AF_INET)
+        return htonl(INADDR_ANY);
+    return address.sin_addr.s_addr;
+}
+
+const StunClient::CacheEntry* StunClient::FindCacheEntry(in_addr_t interface) const
+{
+    auto it = mCache.find(interface);
+    if (it == mCache.end() || it->second.mExpiresMs <= GetTimeMs())
+        return nullptr;
+    return &it->second;
+}
+
+void StunClient::SaveProfile(const Stun::Client& client, NatType type,
+    const struct sockaddr_in* reflexiveAddress)
+{
+    Stun::Profile profile;
+    profile.mNatType = type == NatType::kDependent ? Stun::NatType::kDependent
+                                                   : Stun::NatType::kIndependent;
+    if (reflexiveAddress != nullptr)
+        profile.mPublicAddress = reflexiveAddress->sin_addr;
+    profile.mServers = client.GetServerResults();
 
-    if (type == Stun::NatType::kDependent)
-        ret = INatResolver::NatType::kDependent;
-    else if (type == Stun::NatType::kIndependent)
-        ret = INatResolver::NatType::kIndependent;
+    // Unanswered servers (negative RTT) go last, they are still worth a try
+    std::stable_sort(profile.mServers.begin(), profile.mServers.end(),
+        [](const Stun::Client::ServerResult& a, const Stun::Client::ServerResult& b) {
+            return static_cast<uint64_t>(a.mRttMs) < static_cast<uint64_t>(b.mRttMs);
+        });
+    mServers.clear();
+    for (auto& server : profile.mServers)
+        mServers.push_back(server.mAddress);
 
-    return ret;
+    // A cache file is an optimization, carry on without it
+    if (!mProfilePath.empty() && Stun::SaveProfile(mProfilePath, profile) != 0)
+        PLOG_WARNING << "Failed to save the STUN profile to " << mProfilePath;
 }
 
 }
@@ -1,8 +1,19 @@
 #pragma once
 
 #include "common.h"
+#include "eventcore.h"
+#include "posix_socket.h"
+#include "slab.h"
 
+#include <functional>
+#include <memory>
 #include <netinet/in.h>
+#include <optional>
+#include <string>
+#include <stun/endpoint_cache.h>
+#include <stun/stun.h>
+#include <unordered_map>
+#include <vector>
 
 namespace Atp {
 
@@ -14,16 +25,117 @@ public:
         kDependent
     };
 
+    // Always > 0, identifiers of finished resolutions are never reused
+    using resolution_ident_t = unsigned int;
+
+    // On failure, reflexiveAddress is nullptr and type is kUnknown. Behind a
+    // dependent NAT, reflexiveAddress is the mapping predicted for the next
+    // destination and portDelta the NAT's port allocation step - or nullptr and 0
+    // when allocation shows no pattern.
+    using completion_t = std::move_only_function<void(NatType type,
+        const struct sockaddr_in* reflexiveAddress, int portDelta)>;
+
     virtual ~INatResolver() = default;
 
-    // On failure, *both* reflexiveAddress is nullptr and returned type is Unknown
-    // *Must* be non-blocking, or not too long a call
-    virtual NatType Resolve(int sockfd, struct sockaddr_in* reflexiveAddress) = 0;
+    // Learns the NAT mapping of socket without blocking. completion is invoked
+    // exactly once (unless cancelled) on the event loop thread, never from within
+    // Resolve() itself. Until then the resolver does all reads from socket.
+    // Returns 0 if the resolution could not be started, completion is dropped then.
+    virtual resolution_ident_t Resolve(ISocket* socket, completion_t completion) = 0;
+
+    // Same, but for a socket someone else reads (e.g a Demux): the resolver never
+    // touches it, the reader hands over STUN datagrams with OnStunDatagram().
+    virtual resolution_ident_t ResolveShared(ISocket* socket, completion_t completion) = 0;
+    // No-op once the resolution finished, so every STUN datagram can go here.
+    // Datagrams whose source is not one of the queried servers are dropped.
+    virtual void OnStunDatagram(resolution_ident_t resolution, const struct sockaddr_in* source,
+        const void* buffer, size_t length)
+        = 0;
+
+    // completion will not be invoked, no-op if the resolution already finished
+    virtual void Cancel(resolution_ident_t resolution) = 0;
+
+    // Forget whatever is known about the NAT in front of socket's interface, e.g
+    // after the mapping of an established socket was seen to change
+    virtual void Invalidate(ISocket* socket) = 0;
 };
 
-class StunClient final : public INatResolver  {
+// Runs Stun::Client queries as state machines on the EventCore: readability of the
+// socket (or OnStunDatagram(), for shared sockets) feeds Stun::Client::OnDatagram,
+// the callback's timer drives OnTimer. Nothing blocks the loop.
+//
+// Every socket behind the same NAT sees the same NAT behaviour, so the type found
+// by a full multi-server classification is cached per local interface for
+// Config::kNatCacheTtl. Sockets resolved while the entry is fresh only need a
+// single request to a single server to learn their own port mapping - except
+// behind a dependent NAT, where every server is queried to predict the next port.
+//
+// With a profile path, the classification of the default interface also survives
+// restarts (see Stun::Profile): it is loaded at construction and trusted once the
+// first single-request query confirms the public address did not change.
+//
+// The STUN endpoints are looked up on a helper thread (see Stun::EndpointCache),
+// resolutions started before the first answers are in wait for them.
+class StunClient final : public INatResolver {
 public:
-    NatType Resolve(int sockfd, struct sockaddr_in* reflexiveAddress) override;
+    explicit StunClient(IEventCore* eventCore, std::string profilePath = {});
+    ~StunClient();
+
+    StunClient(const StunClient&) = delete;
+    StunClient& operator=(const StunClient&) = delete;
+
+    resolution_ident_t Resolve(ISocket* socket, completion_t completion) override;
+    resolution_ident_t ResolveShared(ISocket* socket, completion_t completion) override;
+    void OnStunDatagram(resolution_ident_t resolution, const struct sockaddr_in* source,
+        const void* buffer, size_t length) override;
+    void Cancel(resolution_ident_t resolution) override;
+    void Invalidate(ISocket* socket) override;
+
+private:
+    // A first query which can't yet tell the NAT type is repeated once, with a
+    // single responding server there was nothing to compare the mapping against
+    static constexpr int kMaxRounds = 2;
+
+    struct Resolution {
+        std::unique_ptr<Stun::Client> mClient;
+        ISocket* mSocket;
+        in_addr_t mInterface;
+        IEventCore::callback_ident_t mCallback {};
+        bool mShared {}; // a timer only, datagrams come from OnStunDatagram()
+        completion_t mCompletion;
+        int mRounds {};
+        // Set when the NAT type came from the cache, only the mapping is queried
+        std::optional<NatType> mCachedType {};
+        struct in_addr mCachedPublicAddress {};
+    };
+
+    struct CacheEntry {
+        NatType mType;
+        uint64_t mExpiresMs;
+        struct in_addr mPublicAddress;
+    };
+
+    resolution_ident_t Start(ISocket* socket, completion_t completion, bool shared);
+    bool Arm(resolution_ident_t resolution); // (re-)registers the callback, invoked right away
+    mseconds_t Step(resolution_ident_t resolution);
+    // Moves on from a query which returned timeout, to the next round or Finish()
+    mseconds_t Settle(resolution_ident_t resolution, int64_t timeout);
+    int64_t StartRound(Resolution* resolution);
+    void Finish(resolution_ident_t resolution);
+
+    // Local address of socket, INADDR_ANY when it is not bound to an interface
+    static in_addr_t GetInterface(const ISocket* socket);
+    const CacheEntry* FindCacheEntry(in_addr_t interface) const;
+    void SaveProfile(const Stun::Client& client, NatType type, const struct sockaddr_in* reflexiveAddress);
+
+    IEventCore* mEventCore;
+    Stun::EndpointCache mEndpoints; // outlives the Stun::Clients of mResolutions
+    Slab<Resolution> mResolutions;
+    std::unordered_map<in_addr_t, CacheEntry> mCache; // local interface -> NAT behaviour
+
+    std::string mProfilePath;
+    // STUN server addresses, fastest first. Spares every query the DNS lookups.
+    std::vector<struct sockaddr_in> mServers;
 };
 
 }
@@ -0,0 +1,113 @@
+#include "path_cache.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <plog/Log.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+namespace Atp {
+
+static uint64_t GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+PathCache::PathCache(IEventCore* eventCore, mseconds_t idleTimeout)
+    : mEventCore { eventCore }
+    , mIdleTimeout { idleTimeout }
+{
+}
+
+PathCache::~PathCache()
+{
+    if (mKeepAliveCallback)
+        mEventCore->DeleteCallback(mKeepAliveCallback);
+}
+
+void PathCache::Put(const struct sockaddr_atp* peer, WarmPath path)
+{
+    if (mIdleTimeout <= 0)
+        return;
+
+    if (auto it = Find(peer); it != mEntries.end())
+        mEntries.erase(it);
+    if (mEntries.size() >= Config::kPathCacheSize)
+        mEntries.erase(mEntries.begin());
+    mEntries.push_back(Entry { *peer, std::move(path), GetTimeMs() });
+
+    // Idle while the cache is empty, the first invocation sends the first keepalive
+    if (mKeepAliveCallback == 0)
+        THROW_IF((mKeepAliveCallback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+                      [this](void*) -> mseconds_t {
+                          return KeepAliveCallback();
+                      },
+                      nullptr))
+            == 0);
+}
+
+std::optional<WarmPath> PathCache::Take(const struct sockaddr_atp* peer)
+{
+    auto it = Find(peer);
+    if (it == mEntries.end())
+        return std::nullopt;
+    if (GetTimeMs() - it->mPutMs >= static_cast<uint64_t>(mIdleTimeout)) {
+        mEntries.erase(it); // the keepalive timer has not got to it yet
+        return std::nullopt;
+    }
+
+    WarmPath path = std::move(it->mPath);
+    mEntries.erase(it);
+    return path;
+}
+
+std::vector<PathCache::Entry>::iterator PathCache::Find(const struct sockaddr_atp* peer)
+{
+    return std::find_if(mEntries.begin(), mEntries.end(), [peer](const Entry& entry) {
+        return memcmp(&entry.mPeer, peer, sizeof(*peer)) == 0;
+    });
+}
+
+void PathCache::SendKeepAlive(const Entry& entry)
+{
+    struct atp_hdr header;
+    bzero(&header, sizeof(header));
+    header.c.kpalive = 1;
+    header.magic = kAtpMagic;
+
+    size_t datagramLength;
+    const void* datagram = BuildDatagram(&header, nullptr, 0, &datagramLength);
+    THROW_IF(datagram == nullptr);
+
+    // Best effort, a path which stopped working fails its validation on reuse
+    if (entry.mPath.mSocket->SendTo(datagram, datagramLength, MSG_DONTWAIT,
+            reinterpret_cast<const struct sockaddr*>(&entry.mPath.mPeerAddress),
+            sizeof(entry.mPath.mPeerAddress))
+        < 0) {
+        PLOG_DEBUG << "Path keepalive failed - " << strerror(errno);
+    }
+}
+
+mseconds_t PathCache::KeepAliveCallback()
+{
+    uint64_t now = GetTimeMs();
+    std::erase_if(mEntries, [this, now](const Entry& entry) {
+        return now - entry.mPutMs >= static_cast<uint64_t>(mIdleTimeout);
+    });
+
+    if (mEntries.empty()) {
+        mEventCore->DeleteCallback(mKeepAliveCallback);
+        mKeepAliveCallback = 0;
+        return -1;
+    }
+
+    for (const Entry& entry : mEntries)
+        SendKeepAlive(entry);
+    return Config::kPathKeepAliveInterval;
+}
+
+}
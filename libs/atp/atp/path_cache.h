@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "eventcore.h"
+#include "posix_socket.h"
+#include "types.h"
+
+#include <memory>
+#include <netinet/in.h>
+#include <optional>
+#include <vector>
+
+namespace Atp {
+
+// Direct path of a finished connection, the UDP socket still holding the NAT
+// mapping the peer was reached through
+struct WarmPath {
+    std::unique_ptr<ISocket> mSocket;
+    struct sockaddr_in mReflexiveAddress; // ours, as seen by the peer
+    struct sockaddr_in mPeerAddress; // the nominated one
+};
+
+// Paths of recently closed connections, by peer ATP address, so that the next
+// Connect() to the same peer can punch the address which worked last time
+// right away instead of first waiting for STUN and the signalling response.
+//
+// Every path gets an ATP keepalive every Config::kPathKeepAliveInterval, which
+// holds our mapping open and refreshes the peer's filter for it. Paths unused
+// for idleTimeout are dropped, as are the oldest ones beyond Config::kPathCacheSize.
+//
+// Event loop thread only.
+class PathCache final {
+public:
+    PathCache(IEventCore* eventCore, mseconds_t idleTimeout); // 0 disables the cache
+    ~PathCache();
+
+    PathCache(const PathCache&) = delete;
+    PathCache& operator=(const PathCache&) = delete;
+
+    // Replaces any path already cached for peer
+    void Put(const struct sockaddr_atp* peer, WarmPath path);
+    std::optional<WarmPath> Take(const struct sockaddr_atp* peer);
+
+private:
+    struct Entry {
+        struct sockaddr_atp mPeer;
+        WarmPath mPath;
+        uint64_t mPutMs;
+    };
+
+    std::vector<Entry>::iterator Find(const struct sockaddr_atp* peer);
+    void SendKeepAlive(const Entry& entry);
+    mseconds_t KeepAliveCallback();
+
+    IEventCore* mEventCore;
+    mseconds_t mIdleTimeout;
+
+    std::vector<Entry> mEntries {}; // oldest first
+    IEventCore::callback_ident_t mKeepAliveCallback {};
+};
+
+}
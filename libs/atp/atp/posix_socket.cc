@@ -1,7 +1,9 @@
 #include "posix_socket.h"
 #include "common.h"
+#include <fcntl.h>
 #include <memory>
 #include <sys/socket.h>
+#include <unistd.h>
 
 namespace Atp {
 
@@ -56,4 +58,12 @@ PosixSocketFactory::SocketPair(int domain, int type, int protocol)
     return std::make_pair(std::move(sock1), std::move(sock2));
 }
 
+std::unique_ptr<ISocket> PosixSocketFactory::Dup(const ISocket& socket)
+{
+    int fd = ::fcntl(socket.GetFd(), F_DUPFD_CLOEXEC, 0);
+    THROW_IF(fd < 0);
+
+    return std::make_unique<PosixSocket>(fd);
+}
+
 }
@@ -30,6 +30,9 @@ public:
 
     virtual std::pair<std::unique_ptr<ISocket>, std::unique_ptr<ISocket>>
     SocketPair(int domain, int type, int protocol) = 0;
+
+    // New descriptor for the same open socket, e.g to register it with epoll twice
+    virtual std::unique_ptr<ISocket> Dup(const ISocket& socket) = 0;
 };
 
 class PosixSocket final : public ISocket {
@@ -58,6 +61,8 @@ public:
 
     std::pair<std::unique_ptr<ISocket>, std::unique_ptr<ISocket>>
     SocketPair(int domain, int type, int protocol) override;
+
+    std::unique_ptr<ISocket> Dup(const ISocket& socket) override;
 };
 
 }
@@ -6,6 +6,13 @@
 
 namespace Atp {
 
+bool IsAtpDatagram(const void* datagram, size_t datagramLength)
+{
+    if (datagramLength < sizeof(struct atp_hdr))
+        return false;
+    return static_cast<const uint8_t*>(datagram)[offsetof(struct atp_hdr, magic)] == kAtpMagic;
+}
+
 int BuildDatagram(const struct atp_hdr* header, const void* payload, size_t payloadSize,
     void* datagram, size_t* datagramLength)
 {
@@ -23,7 +30,7 @@ int BuildDatagram(const struct atp_hdr* header, const void* payload, size_t payl
     hptr->ack_num = htonl(header->ack_num);
     hptr->c = header->c;
     hptr->magic = header->magic;
-    hptr->window = htons(header->magic);
+    hptr->window = htons(header->window);
 
     // PERF: memory copy :(
     memcpy(ptr + sizeof(atp_hdr), payload, payloadSize);
@@ -32,6 +39,16 @@ int BuildDatagram(const struct atp_hdr* header, const void* payload, size_t payl
     return 0;
 }
 
+const void* BuildDatagram(const struct atp_hdr* header, const void* payload, size_t payloadSize,
+    size_t* datagramLength)
+{
+    static char buffer[sizeof(struct atp_hdr) + kAtpPayloadMaxLimit];
+    *datagramLength = sizeof(buffer);
+    if (BuildDatagram(header, payload, payloadSize, buffer, datagramLength) < 0)
+        return nullptr;
+    return buffer;
+}
+
 int ReadDatagram(const void* datagram, size_t datagramLength, struct atp_hdr* header,
     void* payload, size_t* payloadSize)
 {
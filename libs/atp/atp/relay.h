@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Atp {
+
+// Relay fallback, a much simplified TURN (RFC 8656).
+//
+// When punching does not get through, both ends send their datagrams to a relay
+// prefixed with a relay_hdr. The token is picked by the connecting socket and
+// handed to the listener in the connect request, it is the allocation: the first
+// two source addresses sending a token are paired up, and from then on everything
+// one of them sends with that token is forwarded, header included, to the other.
+// Allocations idle for kRelayIdleTimeoutMs are dropped.
+//
+// Self-contained, the relay server (atp_relay/) includes nothing else of ATP.
+
+inline constexpr uint8_t kRelayMagic = 0xA7;
+inline constexpr uint8_t kRelayVersion = 1;
+inline constexpr uint16_t kRelayDefaultPort = 3479;
+inline constexpr uint64_t kRelayIdleTimeoutMs = 60 * 1000;
+
+struct __attribute__((packed)) relay_hdr {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t zero;
+    uint64_t token; // opaque, never 0
+};
+
+static_assert(sizeof(relay_hdr) == 12);
+
+}
@@ -0,0 +1,203 @@
+#include "ring.h"
+#include "common.h"
+#include "types.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Atp {
+
+static constexpr size_t kControlLength = 4096;
+
+SpscRing::SpscRing(size_t capacity)
+    : mCapacity { capacity }
+    , mMappingLength { kControlLength + capacity }
+{
+    THROW_IF(capacity == 0 || (capacity & (capacity - 1)) != 0);
+
+    // MAP_SHARED, so the rings stay shared with a fork()ed child as well
+    void* mapping = mmap(nullptr, mMappingLength, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    THROW_IF(mapping == MAP_FAILED);
+
+    mControl = new (mapping) Control {};
+    mData = static_cast<std::byte*>(mapping) + kControlLength;
+
+    int dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    THROW_IF(dataFd < 0);
+    mDataEvent = std::make_unique<PosixSocket>(dataFd);
+
+    int spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    THROW_IF(spaceFd < 0);
+    mSpaceEvent = std::make_unique<PosixSocket>(spaceFd);
+}
+
+SpscRing::~SpscRing()
+{
+    munmap(mControl, mMappingLength);
+}
+
+size_t SpscRing::Write(const void* buffer, size_t length)
+{
+    uint64_t head = mControl->mHead.load(std::memory_order_relaxed);
+    uint64_t tail = mControl->mTail.load(std::memory_order_acquire);
+
+    if (head - tail == mCapacity) {
+        // Full. Consume stale wakeups, then look again: either we now see the
+        // consumer's progress, or the consumer sees us full and signals.
+        Drain(mSpaceEvent.get());
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        tail = mControl->mTail.load(std::memory_order_acquire);
+        if (head - tail == mCapacity)
+            return 0;
+    }
+
+    size_t count = std::min(length, static_cast<size_t>(mCapacity - (head - tail)));
+    size_t offset = head & (mCapacity - 1);
+    size_t first = std::min(count, mCapacity - offset);
+
+    memcpy(mData + offset, buffer, first);
+    memcpy(mData, static_cast<const std::byte*>(buffer) + first, count - first);
+
+    mControl->mHead.store(head + count, std::memory_order_release);
+
+    // Pairs with the fence in Read(), so a consumer going to sleep on an empty
+    // ring either sees this write or gets signalled
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mControl->mTail.load(std::memory_order_relaxed) == head)
+        Signal(mDataEvent.get());
+
+    return count;
+}
+
+size_t SpscRing::Read(void* buffer, size_t length)
+{
+    uint64_t tail = mControl->mTail.load(std::memory_order_relaxed);
+    uint64_t head = mControl->mHead.load(std::memory_order_acquire);
+
+    if (head == tail) {
+        Drain(mDataEvent.get());
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        head = mControl->mHead.load(std::memory_order_acquire);
+        if (head == tail)
+            return 0;
+    }
+
+    size_t count = std::min(length, static_cast<size_t>(head - tail));
+    size_t offset = tail & (mCapacity - 1);
+    size_t first = std::min(count, mCapacity - offset);
+
+    memcpy(buffer, mData + offset, first);
+    memcpy(static_cast<std::byte*>(buffer) + first, mData, count - first);
+
+    mControl->mTail.store(tail + count, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mControl->mHead.load(std::memory_order_relaxed) - tail == mCapacity)
+        Signal(mSpaceEvent.get());
+
+    return count;
+}
+
+size_t SpscRing::Size() const
+{
+    uint64_t tail = mControl->mTail.load(std::memory_order_acquire);
+    uint64_t head = mControl->mHead.load(std::memory_order_acquire);
+    return static_cast<size_t>(head - tail);
+}
+
+ISocket* SpscRing::GetDataEvent() const
+{
+    return mDataEvent.get();
+}
+
+ISocket* SpscRing::GetSpaceEvent() const
+{
+    return mSpaceEvent.get();
+}
+
+void SpscRing::Signal(const ISocket* event)
+{
+    uint64_t value = 1;
+    THROW_IF(write(event->GetFd(), &value, sizeof(value)) != sizeof(value));
+}
+
+void SpscRing::Drain(const ISocket* event)
+{
+    uint64_t value;
+    (void)!read(event->GetFd(), &value, sizeof(value)); // EAGAIN is fine
+}
+
+RingChannel::RingChannel(size_t toEngineCapacity, size_t toApplicationCapacity)
+    : mToEngine(toEngineCapacity)
+    , mToApplication(toApplicationCapacity)
+{
+}
+
+ISocket* RingChannel::GetApplicationEvent() const
+{
+    return mToApplication.GetDataEvent();
+}
+
+ISocket* RingChannel::GetApplicationSpaceEvent() const
+{
+    return mToEngine.GetSpaceEvent();
+}
+
+ssize_t RingChannel::ApplicationRead(void* buffer, size_t length)
+{
+    if (length == 0)
+        return 0;
+
+    size_t count = mToApplication.Read(buffer, length);
+    if (count == 0)
+        return +Error::WOULDBLOCK;
+    return static_cast<ssize_t>(count);
+}
+
+ssize_t RingChannel::ApplicationWrite(const void* buffer, size_t length)
+{
+    if (length == 0)
+        return 0;
+
+    size_t count = mToEngine.Write(buffer, length);
+    if (count == 0)
+        return +Error::WOULDBLOCK;
+    return static_cast<ssize_t>(count);
+}
+
+size_t RingChannel::EngineQueued() const
+{
+    return mToEngine.Size();
+}
+
+size_t RingChannel::ApplicationQueued() const
+{
+    return mToApplication.Size();
+}
+
+ISocket* RingChannel::GetEngineEvent() const
+{
+    return mToEngine.GetDataEvent();
+}
+
+ISocket* RingChannel::GetEngineSpaceEvent() const
+{
+    return mToApplication.GetSpaceEvent();
+}
+
+size_t RingChannel::EngineRead(void* buffer, size_t length)
+{
+    return mToEngine.Read(buffer, length);
+}
+
+size_t RingChannel::EngineWrite(const void* buffer, size_t length)
+{
+    return mToApplication.Write(buffer, length);
+}
+
+}
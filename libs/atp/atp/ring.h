@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.h"
+#include "posix_socket.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sys/types.h>
+
+namespace Atp {
+
+// Single-producer single-consumer byte ring living in a shared memory mapping.
+//
+// Alternative to the unix socketpair between application and ATP engine: moving
+// a byte costs one memcpy on each side instead of a syscall + kernel copy each.
+// Sleeping sides are woken through eventfds, but only on transitions:
+//   - GetDataEvent() is signalled when the ring goes from empty to non-empty
+//   - GetSpaceEvent() is signalled when the ring goes from full to non-full
+// Read() returning 0 (or Write() returning 0) guarantees that the respective
+// eventfd will be signalled once progress is possible, so it is safe to go
+// to sleep on it.
+class SpscRing final {
+public:
+    // capacity *must* be a power of two, throws on failure
+    explicit SpscRing(size_t capacity);
+    ~SpscRing();
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer only, returns number of bytes written, 0 if full
+    size_t Write(const void* buffer, size_t length);
+    // Consumer only, returns number of bytes read, 0 if empty
+    size_t Read(void* buffer, size_t length);
+
+    ISocket* GetDataEvent() const;
+    ISocket* GetSpaceEvent() const;
+
+    // Bytes currently in the ring, a snapshot when called from neither side
+    size_t Size() const;
+
+private:
+    struct Control {
+        alignas(64) std::atomic<uint64_t> mHead; // next byte to be written
+        alignas(64) std::atomic<uint64_t> mTail; // next byte to be read
+    };
+
+    static void Signal(const ISocket* event);
+    static void Drain(const ISocket* event);
+
+    size_t mCapacity;
+    size_t mMappingLength;
+    Control* mControl;
+    std::byte* mData;
+
+    std::unique_ptr<ISocket> mDataEvent;
+    std::unique_ptr<ISocket> mSpaceEvent;
+};
+
+// The pair of rings backing one ATP connection
+class RingChannel final {
+public:
+    // Both capacities *must* be powers of two
+    RingChannel(size_t toEngineCapacity, size_t toApplicationCapacity);
+
+    /* Application thread */
+
+    // Readable when ApplicationRead() can make progress, this is what the
+    // application polls on (and is used as the application fd)
+    ISocket* GetApplicationEvent() const;
+    // Readable when ApplicationWrite() can make progress
+    ISocket* GetApplicationSpaceEvent() const;
+
+    // Return +Error::WOULDBLOCK instead of 0 when no progress can be made
+    ssize_t ApplicationRead(void* buffer, size_t length);
+    ssize_t ApplicationWrite(const void* buffer, size_t length);
+
+    /* Event loop thread */
+
+    ISocket* GetEngineEvent() const;
+    ISocket* GetEngineSpaceEvent() const;
+
+    size_t EngineRead(void* buffer, size_t length);
+    size_t EngineWrite(const void* buffer, size_t length);
+
+    // Bytes written by one side and not yet read by the other
+    size_t EngineQueued() const;
+    size_t ApplicationQueued() const;
+
+private:
+    SpscRing mToEngine;
+    SpscRing mToApplication;
+};
+
+}
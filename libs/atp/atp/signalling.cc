@@ -0,0 +1,157 @@
+#include "signalling.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+namespace Atp {
+
+int IsSignal(const void* buffer, size_t bufferLength)
+{
+    if (bufferLength < kSignalHeaderSize)
+        return 0;
+
+    uint16_t magic;
+    memcpy(&magic, buffer, sizeof(magic));
+    return ntohs(magic) == kSignalMagic;
+}
+
+int ReadSignal(const void* buffer, size_t bufferLength, struct signal* sig)
+{
+    if (!IsSignal(buffer, bufferLength))
+        return -1;
+
+    const char* ptr = static_cast<const char*>(buffer);
+    memset(sig, 0, sizeof(*sig));
+    memcpy(sig, ptr, kSignalHeaderSize);
+    sig->magic = ntohs(sig->magic);
+    sig->addr_family = ntohs(sig->addr_family);
+
+    // Sent by a peer without candidates
+    if (bufferLength == kSignalHeaderSize)
+        return 0;
+
+    size_t offset = offsetof(struct signal, candidates);
+    if (bufferLength < offset)
+        return -1;
+    memcpy(reinterpret_cast<char*>(sig) + kSignalHeaderSize, ptr + kSignalHeaderSize,
+        offset - kSignalHeaderSize);
+    if (sig->candidate_count > kMaxSignalCandidates
+        || bufferLength < offset + sig->candidate_count * sizeof(struct signal_candidate))
+        return -1;
+
+    memcpy(sig->candidates, ptr + offset, sig->candidate_count * sizeof(struct signal_candidate));
+    for (size_t i = 0; i < sig->candidate_count; i++)
+        sig->candidates[i].priority = ntohl(sig->candidates[i].priority);
+
+    return 0;
+}
+
+int BuildSignal(const struct signal* sig, void* buffer, size_t* bufferLength)
+{
+    THROW_IF(sig->magic != kSignalMagic);
+    THROW_IF(sig->candidate_count > kMaxSignalCandidates);
+
+    size_t length = kSignalHeaderSize;
+    if (sig->candidate_count > 0 || sig->relay_token != 0)
+        length = offsetof(struct signal, candidates)
+            + sig->candidate_count * sizeof(struct signal_candidate);
+    if (*bufferLength < length)
+        return -1;
+
+    struct signal wire;
+    memcpy(&wire, sig, length);
+    wire.magic = htons(sig->magic);
+    wire.addr_family = htons(sig->addr_family);
+    for (size_t i = 0; i < sig->candidate_count; i++)
+        wire.candidates[i].priority = htonl(sig->candidates[i].priority);
+
+    memcpy(buffer, &wire, length);
+    *bufferLength = length;
+    return 0;
+}
+
+const void* BuildSignal(const struct signal* sig, size_t* bufferLength)
+{
+    static char buffer[sizeof(struct signal)];
+    *bufferLength = sizeof(buffer);
+    if (BuildSignal(sig, buffer, bufferLength) < 0)
+        return nullptr;
+    return buffer;
+}
+
+static uint32_t CandidatePriority(uint32_t typePreference, uint32_t localPreference)
+{
+    // Single component, RTP-style component 1
+    return (typePreference << 24) + (localPreference << 8) + (256 - 1);
+}
+
+size_t GatherCandidates(int udpFd, const struct sockaddr_in* reflexiveAddress,
+    int portDelta, struct signal_candidate* candidates, size_t count)
+{
+    size_t found = 0;
+
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    if (getsockname(udpFd, reinterpret_cast<struct sockaddr*>(&local), &length) == 0
+        && local.sin_family == AF_INET && local.sin_port != 0) {
+        auto addHost = [&](in_addr_t address) {
+            if (found == count)
+                return;
+            // Earlier interfaces are preferred, as ifaddrs lists them in index order
+            candidates[found++] = signal_candidate {
+                .type = kCandidateHost,
+                .port_delta = 0,
+                .port = local.sin_port,
+                .ipv4 = address,
+                .priority = CandidatePriority(kCandidateHostPreference,
+                    65535 - static_cast<uint32_t>(found)),
+            };
+        };
+
+        struct ifaddrs* interfaces;
+        if (local.sin_addr.s_addr != htonl(INADDR_ANY)) {
+            addHost(local.sin_addr.s_addr);
+        } else if (getifaddrs(&interfaces) == 0) {
+            for (struct ifaddrs* it = interfaces; it != nullptr; it = it->ifa_next) {
+                if (it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET
+                    || !(it->ifa_flags & IFF_UP) || (it->ifa_flags & IFF_LOOPBACK))
+                    continue;
+                addHost(reinterpret_cast<struct sockaddr_in*>(it->ifa_addr)->sin_addr.s_addr);
+            }
+            freeifaddrs(interfaces);
+        }
+    }
+
+    // Without a NAT the reflexive address is one of the host addresses already
+    if (reflexiveAddress != nullptr && found < count
+        && std::none_of(candidates, candidates + found, [&](const signal_candidate& candidate) {
+               return candidate.ipv4 == reflexiveAddress->sin_addr.s_addr
+                   && candidate.port == reflexiveAddress->sin_port;
+           })) {
+        THROW_IF(portDelta < INT8_MIN || portDelta > INT8_MAX);
+        candidates[found++] = signal_candidate {
+            .type = portDelta == 0 ? kCandidateServerReflexive : kCandidatePredicted,
+            .port_delta = static_cast<int8_t>(portDelta),
+            .port = reflexiveAddress->sin_port,
+            .ipv4 = reflexiveAddress->sin_addr.s_addr,
+            .priority = CandidatePriority(portDelta == 0 ? kCandidateServerReflexivePreference
+                                                         : kCandidatePredictedPreference,
+                65535),
+        };
+    }
+
+    return found;
+}
+
+uint64_t CandidatePairPriority(uint32_t controlling, uint32_t controlled)
+{
+    uint64_t low = std::min(controlling, controlled);
+    uint64_t high = std::max(controlling, controlled);
+    return (low << 32) + 2 * high + (controlling > controlled ? 1 : 0);
+}
+
+}
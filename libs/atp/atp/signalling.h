@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <netdb.h>
 #include <string>
 #include <sys/socket.h>
@@ -50,12 +51,42 @@ protected:
 
 inline constexpr uint16_t kSignalMagic = 0xF6F9;
 
+// Candidate types, in decreasing order of preference
+enum : uint8_t {
+    // Address of a local interface, reachable directly on the same LAN
+    kCandidateHost = 1,
+    // Mapping learnt from STUN, reachable through the NAT
+    kCandidateServerReflexive = 2,
+    // Behind a dependent NAT: the port the next mapping is expected to get.
+    // The peer also punches the ports port_delta, 2 * port_delta... after it.
+    kCandidatePredicted = 3,
+};
+
+// RFC 8445 section 5.1.2: (2^24)*type preference + (2^8)*local preference + (256 - component)
+inline constexpr uint32_t kCandidateHostPreference = 126;
+inline constexpr uint32_t kCandidateServerReflexivePreference = 100;
+inline constexpr uint32_t kCandidatePredictedPreference = 50;
+
+struct __attribute__((packed)) signal_candidate {
+    uint8_t type;
+    int8_t port_delta; // kCandidatePredicted only, the NAT's port allocation step
+    uint16_t port; // network byte order
+    uint32_t ipv4; // network byte order
+    uint32_t priority;
+};
+
+static_assert(sizeof(signal_candidate) == 12);
+
+inline constexpr size_t kMaxSignalCandidates = 8;
+
 // NOTE: If both hosts are behind the same NAT (without hairpin support),
-// connecting through the public IP will fail. Without knowing the network 
-// topology, the solution for this is to initiate a connection for the private 
-// IP and the public IP both, and use whatever succeeds. The server running 
-// listen() must respond with the private IP if the signal received has a private 
-// IP.
+// connecting through the public IP will fail. So every signal carries all of the
+// sender's candidates (see RFC 8445, ICE): its host addresses and its server
+// reflexive address. Both ends run connectivity checks against every candidate
+// of the other in parallel and keep the first one that answers.
+//
+// addr_* is the server reflexive address, as it was before candidates were
+// added. A signal without candidates is treated as carrying just that one.
 struct __attribute__((packed)) signal {
     uint16_t magic;
     uint8_t zero;
@@ -75,9 +106,24 @@ struct __attribute__((packed)) signal {
     uint16_t addr_family;
     uint16_t addr_port;
     uint32_t addr_ipv4;
+
+    uint8_t candidate_count;
+    uint8_t res[3];
+
+    // Relay to fall back to if punching fails (see relay.h), chosen by the
+    // connecting side. All zero if it has none.
+    uint32_t relay_ipv4; // network byte order
+    uint16_t relay_port; // network byte order
+    uint16_t relay_res;
+    uint64_t relay_token;
+
+    // Highest priority first, only the first candidate_count are sent
+    struct signal_candidate candidates[kMaxSignalCandidates];
 };
 
-static_assert(sizeof(signal) == 12);
+// Without candidates or relay, what older peers send
+inline constexpr size_t kSignalHeaderSize = 12;
+static_assert(offsetof(signal, candidate_count) == kSignalHeaderSize);
 
 int IsSignal(const void* buffer, size_t bufferLength);
 int ReadSignal(const void* buffer, size_t bufferLength, struct signal* sig);
@@ -85,4 +131,13 @@ int BuildSignal(const struct signal* sig, void* buffer, size_t* bufferLength);
 // Uses a static buffer, not safe to reuse after repeated calls
 const void* BuildSignal(const struct signal* sig, size_t* bufferLength);
 
+// Fills candidates with the host addresses udpFd is reachable on and, if not
+// nullptr, the server reflexive address - a predicted one if portDelta != 0.
+// Returns how many were written, highest priority first.
+size_t GatherCandidates(int udpFd, const struct sockaddr_in* reflexiveAddress,
+    int portDelta, struct signal_candidate* candidates, size_t count);
+
+// RFC 8445 section 6.1.2.3, the controlling agent is the one which sent the request
+uint64_t CandidatePairPriority(uint32_t controlling, uint32_t controlled);
+
 }
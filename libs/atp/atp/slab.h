@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace Atp {
+
+// Fixed-slot object pool handing out generation-tagged identifiers.
+//
+// An identifier is (generation << kIndexBits) | slot index. Every time a slot
+// is freed its generation is bumped, so an identifier kept around after
+// Erase() (a stale callback_ident_t, say) simply fails to resolve instead of
+// aliasing whatever object reuses the slot. Identifiers are never 0.
+//
+// Slots are allocated in chunks which never move, so pointers returned by
+// Get() stay valid across Emplace() calls until that very slot is erased.
+template <typename T, size_t ChunkSize = 256>
+class Slab final {
+public:
+    using ident_t = uint32_t;
+
+    static constexpr unsigned kIndexBits = 20;
+    static constexpr ident_t kIndexMask = (ident_t { 1 } << kIndexBits) - 1;
+    static constexpr ident_t kMaxGeneration = (ident_t { 1 } << (32 - kIndexBits)) - 1;
+    static constexpr size_t kMaxSlots = size_t { kIndexMask } + 1;
+
+    Slab() = default;
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    // Returns 0 if every slot is in use
+    template <typename... Args>
+    ident_t Emplace(Args&&... args)
+    {
+        if (mFreeHead == kNoSlot && !Grow())
+            return 0;
+
+        uint32_t index = mFreeHead;
+        Slot& slot = At(index);
+        mFreeHead = slot.mNextFree;
+
+        slot.mValue.emplace(std::forward<Args>(args)...);
+        mSize++;
+        return (slot.mGeneration << kIndexBits) | index;
+    }
+
+    // O(1), nullptr if the identifier is stale or was never handed out
+    T* Get(ident_t identifier)
+    {
+        uint32_t index = identifier & kIndexMask;
+        if (index >= mCapacity)
+            return nullptr;
+
+        Slot& slot = At(index);
+        if (!slot.mValue || slot.mGeneration != (identifier >> kIndexBits))
+            return nullptr;
+        return &*slot.mValue;
+    }
+
+    bool Erase(ident_t identifier)
+    {
+        if (Get(identifier) == nullptr)
+            return false;
+
+        uint32_t index = identifier & kIndexMask;
+        Slot& slot = At(index);
+        slot.mValue.reset();
+        slot.mGeneration = slot.mGeneration == kMaxGeneration ? 1 : slot.mGeneration + 1;
+        slot.mNextFree = mFreeHead;
+        mFreeHead = index;
+        mSize--;
+        return true;
+    }
+
+    size_t Size() const
+    {
+        return mSize;
+    }
+
+    // function(ident_t, T&) for every live value. *Must* not Emplace() or Erase().
+    template <typename Function>
+    void ForEach(Function&& function)
+    {
+        for (uint32_t index = 0; index < mCapacity; index++) {
+            Slot& slot = At(index);
+            if (slot.mValue)
+                function((slot.mGeneration << kIndexBits) | index, *slot.mValue);
+        }
+    }
+
+private:
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+    struct Slot {
+        uint32_t mGeneration { 1 };
+        uint32_t mNextFree { kNoSlot };
+        std::optional<T> mValue {};
+    };
+
+    Slot& At(uint32_t index)
+    {
+        return mChunks[index / ChunkSize][index % ChunkSize];
+    }
+
+    bool Grow()
+    {
+        if (mCapacity + ChunkSize > kMaxSlots)
+            return false;
+
+        mChunks.push_back(std::make_unique<Slot[]>(ChunkSize));
+        // Thread the new slots onto the free list in ascending order
+        for (size_t i = ChunkSize; i-- > 0;) {
+            uint32_t index = static_cast<uint32_t>(mCapacity + i);
+            At(index).mNextFree = mFreeHead;
+            mFreeHead = index;
+        }
+        mCapacity += ChunkSize;
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> mChunks;
+    uint32_t mFreeHead { kNoSlot };
+    uint32_t mCapacity { 0 };
+    size_t mSize { 0 };
+};
+
+}
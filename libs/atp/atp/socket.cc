@@ -4,25 +4,81 @@
 #include "eventcore.h"
 #include "nat_resolver.h"
 #include "protocol.h"
+#include "relay.h"
 #include "signalling.h"
 #include "types.h"
 
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
 #include <expected>
 #include <fmt/format.h>
 #include <memory>
 #include <netinet/in.h>
 #include <plog/Log.h>
 #include <strings.h>
-#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
 
 namespace Atp {
 
+// atp_control { .thru = 1 } leaves the other bits to -Wmissing-field-initializers
+static union atp_control ThruControl()
+{
+    union atp_control control {};
+    control.thru = 1;
+    return control;
+}
+
+static uint64_t GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// RTT samples over a LAN or loopback are well below a millisecond
+static uint64_t GetTimeUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Knowing the token is all it takes to join an allocation, so not std::rand()
+static uint64_t NewRelayToken()
+{
+    uint64_t token = 0;
+    while (token == 0)
+        THROW_IF(getrandom(&token, sizeof(token), 0) != sizeof(token));
+    return token;
+}
+
+// RFC 6528: an off-path attacker who can guess the ISN can inject data, so it
+// comes from the kernel's CSPRNG like the relay token. Peers see every ISN we
+// pick, a seeded generator would give its state away to them.
+static uint32_t NewInitialSequenceNumber()
+{
+    uint32_t sequence;
+    THROW_IF(getrandom(&sequence, sizeof(sequence), 0) != sizeof(sequence));
+    return sequence;
+}
+
 Result<std::unique_ptr<AtpSocket>> AtpSocket::Create(
     IEventCore* eventCore,
     ISignallingProvider* signallingProvider,
     INatResolver* natResolver,
-    ISocketFactory* socketFactory)
+    ISocketFactory* socketFactory,
+    PathCache* pathCache,
+    DataPath dataPath,
+    std::optional<ResolvedSocket> networkSocket)
 {
     Error returnCode = Error::UNKNOWN;
 
@@ -36,39 +92,63 @@ Result<std::unique_ptr<AtpSocket>> AtpSocket::Create(
     newsock->mEventCore = eventCore;
     newsock->mNatResolver = natResolver;
     newsock->mSocketFactory = socketFactory;
+    newsock->mPathCache = pathCache;
 
-    newsock->mApplicationSocket = socketFactory->Socket(AF_UNIX, SOCK_STREAM, 0);
+    newsock->mDataPath = dataPath;
+    if (dataPath == DataPath::kRing)
+        newsock->mRingChannel = newsock->MakeRingChannel();
+    else
+        newsock->mApplicationSocket = socketFactory->Socket(AF_UNIX, SOCK_STREAM, 0);
 
     newsock->mAtpSocket = nullptr;
-    newsock->mNetworkSocket = socketFactory->Socket(AF_INET, SOCK_DGRAM, 0);
-
-    newsock->mDemux = std::make_shared<Demux>(newsock->mEventCore, newsock->mNetworkFd);
-
-    newsock->mStunClient = std::make_shared<Stun::Client>(networkFd);
+    std::unique_ptr<ISocket> udpSocket;
+    if (networkSocket) {
+        udpSocket = std::move(networkSocket->mSocket);
+        newsock->mNatResolved = true;
+        newsock->mNatResolvedMs = GetTimeMs();
+        newsock->mReflexiveAddress = networkSocket->mReflexiveAddress;
+    } else {
+        udpSocket = socketFactory->Socket(AF_INET, SOCK_DGRAM, 0);
+    }
 
-    // Lets run queryall twice to be a bit extra sure about NAT type
-    for (int i = 0; i < 2; i++) {
-        if (newsock->mStunClient->QueryAllServers() == -1) {
-            returnCode = Error::NATQUERYFAILURE;
-            goto clean;
-        }
+    // Lets the kernel busy-poll the NIC queue on recv when the loop itself spins.
+    // Raising it above net.core.busy_read needs CAP_NET_ADMIN, carry on without it.
+    if (int busyPollUs = eventCore->GetBusyPollUs(); busyPollUs > 0) {
+        if (setsockopt(udpSocket->GetFd(), SOL_SOCKET, SO_BUSY_POLL,
+                &busyPollUs, sizeof(busyPollUs))
+            != 0)
+            PLOG_INFO << "SO_BUSY_POLL not permitted, continuing without it - "
+                      << strerror(errno);
     }
 
-    if (newsock->mStunClient->GetNatType() == Stun::NatType::kDependent) {
-        returnCode = Error::NATDEPENDENT;
+    newsock->mDemux = std::make_shared<Demux>(newsock->mEventCore, std::move(udpSocket));
+
+    // STUN shares the socket with everything else, the Demux hands it over
+    THROW_IF(newsock->mDemux->RegisterStunCallback(
+                 [socket = newsock.get()](const struct sockaddr_in* source, const void* buffer, size_t length) -> void {
+                     if (socket->mNatResolution)
+                         socket->mNatResolver->OnStunDatagram(socket->mNatResolution, source, buffer, length);
+                 })
+        == 0);
+
+    // Socket() must not wait on STUN, the mapping is learnt in the background
+    if (!newsock->mNatResolved
+        && (newsock->mNatResolution = natResolver->ResolveShared(newsock->mDemux->GetSocket(),
+             [socket = newsock.get()](INatResolver::NatType type,
+                 const struct sockaddr_in* address, int portDelta) {
+                 socket->NatResolved(type, address, portDelta);
+             }))
+        == 0) {
+        returnCode = Error::NATQUERYFAILURE;
         goto clean;
     }
 
-    struct epoll_event epollNat;
-    bzero(&epollNat, sizeof(epollNat));
-    // TODO: can use epoll_event.data to maintain RTO timer between calls?
-    epollNat.events = 0;
-
-    if ((newsock->mNatKeepAliveCallback = newsock->mEventCore->RegisterCallback(-1,
-             &epollNat, EventCore::kInvokeImmediately | EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return newsock->NatKeepAliveCallback(data);
-             }))
+    if ((newsock->mNatKeepAliveCallback = newsock->mEventCore->RegisterCallback(
+             IEventCore::kInvokeImmediately | IEventCore::kSuspend,
+             [socket = newsock.get()](void*) -> mseconds_t {
+                 return socket->NatKeepAliveCallback();
+             },
+             nullptr))
         == 0) {
         returnCode = Error::EVENTCORE;
         goto clean;
@@ -81,7 +161,9 @@ Result<std::unique_ptr<AtpSocket>> AtpSocket::Create(
     bzero(&newsock->mPeerAddressIn, sizeof(newsock->mPeerAddressIn));
 
     newsock->mSignallingProvider = signallingProvider;
-    if ((newsock->mSignallingSocket = newsock->mSignallingProvider->Socket()) < 0) {
+    if (int signallingFd = newsock->mSignallingProvider->Socket(); signallingFd >= 0) {
+        newsock->mSignallingSocket = std::make_unique<PosixSocket>(signallingFd);
+    } else {
         returnCode = Error::SIGNALLINGPROVIDER;
         goto clean;
     }
@@ -91,9 +173,11 @@ Result<std::unique_ptr<AtpSocket>> AtpSocket::Create(
 
     newsock->mBacklog = 0;
 
+    newsock->mSequenceNumber = NewInitialSequenceNumber();
+
     THROW_IF(newsock->mEventCore->ResumeCallback(newsock->mNatKeepAliveCallback) != 0);
 
-    return std::move(newsock);
+    return newsock;
 
 clean:
     if (newsock->mNatKeepAliveCallback)
@@ -108,44 +192,43 @@ clean:
     if (newsock->mPunchThroughCallback)
         newsock->mEventCore->DeleteCallback(newsock->mPunchThroughCallback);
 
-    close(newsock->mApplicationFd);
-    close(newsock->mAtpFd);
-    close(newsock->mNetworkFd);
+    // The sockets are closed along with newsock
     return std::unexpected(returnCode);
 }
 
 Result<std::unique_ptr<AtpSocket>> AtpSocket::CloneForConnection(
     const struct sockaddr_atp* peerAddressAtp,
-    const struct sockaddr_in* peerAddressIn)
+    const struct signal* request)
 {
     Error returnCode = Error::SUCCESS;
 
     std::unique_ptr<AtpSocket> newsock { new AtpSocket() };
-    newsock->mState = State::PUNCH;
     newsock->mEventCore = mEventCore;
     newsock->mNatResolver = mNatResolver;
     newsock->mSocketFactory = mSocketFactory;
+    newsock->mOptions = mOptions;
+    newsock->StartPunching(); // paced by mOptions
 
-    newsock->mApplicationFd = -1;
-    newsock->mAtpFd = -1;
-    newsock->mNetworkFd = mNetworkFd;
+    // Rings are set up once the connection is established
+    newsock->mDataPath = mDataPath;
 
     newsock->mDemux = mDemux;
 
-    newsock->mStunClient = mStunClient;
-
-    struct epoll_event epollNetwork;
-    bzero(&epollNetwork, sizeof(epollNetwork));
-    epollNetwork.events = 0;
+    // Same UDP socket, so same mapping
+    newsock->mNatResolved = mNatResolved;
+    newsock->mNatResolvedMs = mNatResolvedMs;
+    newsock->mReflexiveAddress = mReflexiveAddress;
+    newsock->mPortDelta = mPortDelta;
 
     // Even though "child" sockets use the same UDP socket as the listen()ing "parent",
     // it is possible for the listening socket to be closed before a connection gets
     // established, hence the usually redundant keepalive in the "child" socket as well.
-    if ((newsock->mNatKeepAliveCallback = newsock->mEventCore->RegisterCallback(-1,
-             &epollNetwork, EventCore::kInvokeImmediately | EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return newsock->NatKeepAliveCallback(data);
-             }))
+    if ((newsock->mNatKeepAliveCallback = newsock->mEventCore->RegisterCallback(
+             IEventCore::kInvokeImmediately | IEventCore::kSuspend,
+             [socket = newsock.get()](void*) -> mseconds_t {
+                 return socket->NatKeepAliveCallback();
+             },
+             nullptr))
         == 0) {
         returnCode = Error::EVENTCORE;
         goto clean;
@@ -153,74 +236,108 @@ Result<std::unique_ptr<AtpSocket>> AtpSocket::CloneForConnection(
 
     newsock->mPassiveOwner = this;
 
-    struct epoll_event epollPunch;
-    bzero(&epollPunch, sizeof(epollPunch));
-    epollPunch.events = 0;
-    if ((newsock->mPunchThroughCallback = newsock->mEventCore->RegisterCallback(-1,
-             &epollPunch, EventCore::kInvokeImmediately | EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return newsock->PunchThroughCallback(data);
-             }))
+    if ((newsock->mPunchThroughCallback = newsock->mEventCore->RegisterCallback(
+             IEventCore::kInvokeImmediately | IEventCore::kSuspend,
+             [socket = newsock.get()](void*) -> mseconds_t {
+                 return socket->PunchThroughCallback();
+             },
+             nullptr))
         == 0) {
         returnCode = Error::EVENTCORE;
         goto clean;
     }
 
-    if ((newsock->mNetworkRecvCallback = newsock->mDemux->RegisterCallback(peerAddressIn,
-             [&](const void* buffer, size_t length) -> void {
-                 NetworkRecvCallback(buffer, length);
-             }))
-        == 0) {
-        returnCode = Error::DEMUX;
-        goto clean;
+    if (request->relay_token != 0) {
+        newsock->mRelayToken = request->relay_token;
+        newsock->mRelayAddress.sin_family = AF_INET;
+        newsock->mRelayAddress.sin_port = request->relay_port;
+        newsock->mRelayAddress.sin_addr.s_addr = request->relay_ipv4;
+    }
+
+    {
+        // Same UDP socket, so the candidates of the listener
+        struct signal_candidate candidates[kMaxSignalCandidates];
+        size_t count = GatherLocalCandidates(candidates);
+        if ((returnCode = newsock->StartChecks(request, std::span(candidates, count), false))
+            != Error::SUCCESS)
+            goto clean;
+    }
+
+    {
+        // A connection still registered for the peer's mapping is over: the peer
+        // reconnects from the same UDP socket, e.g a warm path (see PathCache).
+        // Its datagrams belong to the checks of this one from now on.
+        struct sockaddr_in reflexive {};
+        reflexive.sin_family = AF_INET;
+        reflexive.sin_port = request->addr_port;
+        reflexive.sin_addr.s_addr = request->addr_ipv4;
+        if (mDemux->EvictCallback(&reflexive) == 0)
+            PLOG_INFO << "Peer reconnected from the mapping of an earlier connection";
     }
 
     newsock->mApplicationRecvCallback = 0;
 
     newsock->mPeerAddressAtp = *peerAddressAtp;
-    newsock->mPeerAddressIn = *peerAddressIn;
 
     newsock->mSignallingRecvCallback = 0;
     newsock->mSignallingProvider = nullptr;
 
-    newsock->mSequenceNumber = std::rand() % UINT32_MAX;
+    newsock->mSequenceNumber = NewInitialSequenceNumber();
 
     THROW_IF(newsock->mEventCore->ResumeCallback(newsock->mNatKeepAliveCallback) != 0);
     THROW_IF(newsock->mEventCore->ResumeCallback(newsock->mPunchThroughCallback) != 0);
 
-    return std::move(newsock);
+    return newsock;
 
 clean:
-    // BUG: Shouldn't I set the callback_ident_t vars to zero after deleting the callback?
+    // NOTE: The destructor deletes these again, so zero them out. A stale
+    // callback_ident_t is harmless for the EventCore (the generation no longer
+    // matches), but a zero makes the intent obvious.
     if (newsock->mNatKeepAliveCallback)
         newsock->mEventCore->DeleteCallback(newsock->mNatKeepAliveCallback);
+    newsock->mNatKeepAliveCallback = 0;
     if (newsock->mPunchThroughCallback)
         newsock->mEventCore->DeleteCallback(newsock->mPunchThroughCallback);
+    newsock->mPunchThroughCallback = 0;
     if (newsock->mNetworkRecvCallback)
         newsock->mDemux->DeleteCallback(newsock->mNetworkRecvCallback);
+    newsock->mNetworkRecvCallback = 0;
+    newsock->ClearCheckPairs();
 
     return std::unexpected(returnCode);
 }
 
-// BUG: Locking required here, modifying data common to both threads
 Result<AtpSocket*> AtpSocket::Accept(Context* context)
+{
+    AtpSocket* socket;
+    Result<size_t> count = AcceptMany(context, std::span(&socket, 1));
+    if (!count)
+        return std::unexpected(count.error());
+    return socket;
+}
+
+// NOTE: Only ever called on the event loop thread, like everything touching
+// mCompletedConnections. The returned pointers stay valid until the application
+// closes the sockets, which is again handled on the event loop thread.
+Result<size_t> AtpSocket::AcceptMany(Context* context, std::span<AtpSocket*> sockets)
 {
     if (mState != State::LISTEN)
         return std::unexpected(Error::INVAL);
     if (mCompletedConnections.empty())
         return std::unexpected(Error::WOULDBLOCK);
 
-    std::unique_ptr<AtpSocket> socket = std::move(mCompletedConnections.front());
-    mCompletedConnections.pop();
+    size_t count = 0;
+    while (count < sockets.size() && !mCompletedConnections.empty()) {
+        std::unique_ptr<AtpSocket> socket = std::move(mCompletedConnections.front());
+        mCompletedConnections.pop();
 
-    // BUG: Isn't there a race condition here?
-    // Context takes ownership of the ptr -> say the socket gets closed
-    // and gets destroyed before the return -> the returned pointer is dangling
-    // Possible solution: Hold master lock from Context before calling SocketImpl::Accept
-    AtpSocket* sockptr = socket.get();
-    context->TakeOwnership(std::move(socket));
+        sockets[count++] = socket.get();
+        context->TakeOwnership(std::move(socket));
+    }
+    mStats.mSocketsAccepted += count;
 
-    return sockptr;
+    UpdateListenEvent();
+    return count;
 }
 
 Error AtpSocket::Connect(const struct sockaddr_atp* addr)
@@ -230,69 +347,289 @@ Error AtpSocket::Connect(const struct sockaddr_atp* addr)
 
     Error returnCode = Error::UNKNOWN;
 
-    struct epoll_event epollSignalling;
-    bzero(&epollSignalling, sizeof(epollSignalling));
-    epollSignalling.data.fd = mSignallingSocket;
-    epollSignalling.events = EPOLLIN;
-    if ((mSignallingRecvCallback = mEventCore->RegisterCallback(mSignallingSocket,
-             &epollSignalling, EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return SignallingRecvCallback(data);
-             }))
+    if ((mSignallingRecvCallback = mEventCore->RegisterCallback(mSignallingSocket.get(),
+             0, // the response can arrive any time after the request went out
+             [this](void*) -> mseconds_t {
+                 return SignallingRecvCallback();
+             },
+             nullptr))
         == 0) {
         return Error::EVENTCORE;
     }
 
-    struct sockaddr_in reflexiveAddress;
-    socklen_t reflexiveLength = sizeof(reflexiveAddress);
-    THROW_IF(mStunClient->GetReflexiveAddress((struct sockaddr*)&reflexiveAddress,
-                 &reflexiveLength)
-        != 0);
-    THROW_IF(reflexiveAddress.sin_family != AF_INET);
+    // A warm path needs neither STUN nor the candidate checks
+    if (std::optional<WarmPath> path = mPathCache ? mPathCache->Take(addr) : std::nullopt) {
+        UseWarmPath(std::move(*path));
+        mPeerAddressAtp = *addr;
+    }
+
+    if (mNatError != Error::SUCCESS) {
+        returnCode = mNatError;
+        goto clean;
+    }
+
+    if (!mNatResolved) {
+        // Sent by NatResolved(), AwaitConnected() reports any failure
+        mPendingConnect = std::make_unique<struct sockaddr_atp>(*addr);
+        return Error::SUCCESS;
+    }
+
+    if ((returnCode = SendConnectRequest(addr)) != Error::SUCCESS)
+        goto clean;
+    if (mWarm && (returnCode = StartWarmPunching()) != Error::SUCCESS)
+        goto clean;
+
+    return Error::SUCCESS;
+
+clean:
+    if (mSignallingRecvCallback)
+        mEventCore->DeleteCallback(mSignallingRecvCallback);
+    mSignallingRecvCallback = 0;
+    return returnCode;
+}
+
+Error AtpSocket::SendConnectRequest(const struct sockaddr_atp* addr)
+{
+    THROW_IF(!mNatResolved);
 
     struct signal request;
     bzero(&request, sizeof(request));
     request.magic = kSignalMagic;
     request.request = 1;
     request.addr_family = AF_INET;
-    request.addr_port = reflexiveAddress.sin_port;
-    request.addr_ipv4 = reflexiveAddress.sin_addr.s_addr;
+    request.addr_port = mReflexiveAddress.sin_port;
+    request.addr_ipv4 = mReflexiveAddress.sin_addr.s_addr;
+    request.candidate_count = static_cast<uint8_t>(GatherLocalCandidates(request.candidates));
+
+    // The listener uses whatever relay the connecting side asks for
+    if (mOptions.mRelayAddress.sin_port != 0) {
+        if (mRelayToken == 0)
+            mRelayToken = NewRelayToken();
+        mRelayAddress = mOptions.mRelayAddress;
+        request.relay_ipv4 = mRelayAddress.sin_addr.s_addr;
+        request.relay_port = mRelayAddress.sin_port;
+        request.relay_token = mRelayToken;
+    }
 
     size_t bufferLength;
     const void* buffer = BuildSignal(&request, &bufferLength);
-    if (mSignallingProvider->Send(mSignallingSocket, buffer, bufferLength,
+    if (mSignallingProvider->Send(mSignallingSocket->GetFd(), buffer, bufferLength,
             addr)
-        < 0) {
-        returnCode = Error::SIGNALLINGPROVIDER;
-        goto clean;
-    }
+        < 0)
+        return Error::SIGNALLINGPROVIDER;
+    mStats.mSignallingSentMs = GetTimeMs();
 
     return Error::SUCCESS;
+}
 
-clean:
-    if (mSignallingRecvCallback)
-        mEventCore->DeleteCallback(mSignallingRecvCallback);
-    return returnCode;
+void AtpSocket::UseWarmPath(WarmPath path)
+{
+    if (mNatResolution)
+        mNatResolver->Cancel(mNatResolution);
+    mNatResolution = 0;
+
+    // In place of the socket Socket() made, which was never used. Its mapping is
+    // known, so the new Demux needs no STUN callback.
+    mDemux = std::make_shared<Demux>(mEventCore, std::move(path.mSocket));
+    mNatResolved = true;
+    mNatResolvedMs = GetTimeMs();
+    mNatError = Error::SUCCESS;
+    mReflexiveAddress = path.mReflexiveAddress;
+    mPortDelta = 0; // the mapping towards this peer is already open, nothing to predict
+    mPeerAddressIn = path.mPeerAddress;
+    mWarm = true;
 }
 
-AtpSocket::~AtpSocket()
+Error AtpSocket::StartWarmPunching()
 {
-    close(mApplicationFd);
-    close(mAtpFd);
-    close(mNetworkFd);
+    // No check pairs, SendControlDatagram() goes straight to mPeerAddressIn
+    if ((mNetworkRecvCallback = mDemux->RegisterCallback(&mPeerAddressIn,
+             [this](const struct sockaddr_in*, const void* buffer, size_t length) -> void {
+                 NetworkRecvCallback(buffer, length);
+             }))
+        == 0)
+        return Error::DEMUX;
+
+    StartPunching();
+    if ((mPunchThroughCallback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+             [this](void*) -> mseconds_t {
+                 return PunchThroughCallback();
+             },
+             nullptr))
+        == 0) {
+        mDemux->DeleteCallback(mNetworkRecvCallback);
+        mNetworkRecvCallback = 0;
+        return Error::EVENTCORE;
+    }
+    return Error::SUCCESS;
+}
+
+void AtpSocket::NatResolved(INatResolver::NatType type, const struct sockaddr_in* reflexiveAddress,
+    int portDelta)
+{
+    mNatResolution = 0;
+
+    // Behind a dependent NAT the peer punches the predicted port sequence, only
+    // a NAT allocating ports at random is hopeless
+    if (reflexiveAddress != nullptr) {
+        THROW_IF(reflexiveAddress->sin_family != AF_INET);
+        mNatResolved = true;
+        mNatResolvedMs = GetTimeMs();
+        mReflexiveAddress = *reflexiveAddress;
+        mPortDelta = portDelta;
+    } else {
+        mNatError = type == INatResolver::NatType::kDependent ? Error::NATDEPENDENT
+                                                                : Error::NATQUERYFAILURE;
+    }
+
+    if (mPendingConnect) {
+        std::unique_ptr<struct sockaddr_atp> addr = std::move(mPendingConnect);
+        Error error = mNatError;
+        if (error == Error::SUCCESS)
+            error = SendConnectRequest(addr.get());
+        if (error != Error::SUCCESS) {
+            mEventCore->DeleteCallback(mSignallingRecvCallback);
+            mSignallingRecvCallback = 0;
+            NotifyWaiters(mConnectedWaiters, error);
+        }
+    }
 
+    if (mState == State::LISTEN) {
+        if (mNatError == Error::SUCCESS) {
+            THROW_IF(mEventCore->ResumeCallback(mSignallingRecvCallback) < 0);
+        } else {
+            mState = State::CLOSED;
+            NotifyWaiters(mConnectionWaiters, mNatError);
+        }
+    }
+}
+
+AtpSocket::~AtpSocket()
+{
+    if (mNatResolution)
+        mNatResolver->Cancel(mNatResolution);
     if (mNatKeepAliveCallback)
         mEventCore->DeleteCallback(mNatKeepAliveCallback);
     if (mPunchThroughCallback)
         mEventCore->DeleteCallback(mPunchThroughCallback);
     if (mNetworkRecvCallback)
         mDemux->DeleteCallback(mNetworkRecvCallback);
+    ClearCheckPairs();
+    StopRelay();
+    // The next connection to this peer can start from this path, unless the
+    // listener or its other connections still read the same socket
+    if (mPathCache && mState == State::ESTABLISHED && !mRelayed && mDemux && mDemux.use_count() == 1)
+        mPathCache->Put(&mPeerAddressAtp,
+            WarmPath { mDemux->Release(), mReflexiveAddress, mPeerAddressIn });
     if (mApplicationRecvCallback)
         mEventCore->DeleteCallback(mApplicationRecvCallback);
+    if (mRetransmitCallback)
+        mEventCore->DeleteCallback(mRetransmitCallback);
     if (mSignallingRecvCallback)
         mEventCore->DeleteCallback(mSignallingRecvCallback);
     // if (mWildcardRecvCallback)
     //    mEventCore->DeleteCallback(mWildcardRecvCallback);
+    if (mApplicationReadWait)
+        mEventCore->DeleteCallback(mApplicationReadWait);
+    if (mApplicationWriteWait)
+        mEventCore->DeleteCallback(mApplicationWriteWait);
+
+    // Don't leave any awaiting coroutines hanging
+    NotifyWaiters(mConnectedWaiters, Error::BADFD);
+    NotifyWaiters(mConnectionWaiters, Error::BADFD);
+    if (mApplicationReadWaiter)
+        std::exchange(mApplicationReadWaiter, {})(Error::BADFD);
+    if (mApplicationWriteWaiter)
+        std::exchange(mApplicationWriteWaiter, {})(Error::BADFD);
+}
+
+bool AtpSocket::IsConnecting() const
+{
+    // Waiting on the signalling response, or on the NAT resolution before the
+    // request. A connection which failed punching is back to CLOSED as well.
+    if (mState == State::CLOSED)
+        return mSignallingRecvCallback != 0 && mStats.mPunchStartMs == 0;
+    return mState == State::PUNCH || mState == State::THRU;
+}
+
+void AtpSocket::AwaitConnected(completion_t completion)
+{
+    if (mState == State::ESTABLISHED) {
+        completion(Error::SUCCESS);
+        return;
+    }
+    mConnectedWaiters.push_back(std::move(completion));
+}
+
+void AtpSocket::AwaitConnection(completion_t completion)
+{
+    if (mState != State::LISTEN) {
+        completion(Error::INVAL);
+        return;
+    }
+    if (!mCompletedConnections.empty()) {
+        completion(Error::SUCCESS);
+        return;
+    }
+    mConnectionWaiters.push_back(std::move(completion));
+}
+
+void AtpSocket::AwaitApplicationReady(int flags, completion_t completion)
+{
+    bool writable = flags & IEventCore::kWritable;
+    completion_t& waiter = writable ? mApplicationWriteWaiter : mApplicationReadWaiter;
+    EventCore::callback_ident_t& wait = writable ? mApplicationWriteWait : mApplicationReadWait;
+
+    if (mApplicationSocket == nullptr && mRingChannel == nullptr) {
+        completion(Error::BADFD);
+        return;
+    }
+    if (waiter) {
+        completion(Error::ALREADYSET);
+        return;
+    }
+
+    ISocket* socket = mApplicationSocket.get();
+    if (mRingChannel) {
+        socket = writable ? mRingChannel->GetApplicationSpaceEvent()
+                          : mRingChannel->GetApplicationEvent();
+    } else if (writable) {
+        if (mApplicationWriteWatch == nullptr)
+            mApplicationWriteWatch = mSocketFactory->Dup(*mApplicationSocket);
+        socket = mApplicationWriteWatch.get();
+    }
+
+    if ((wait = mEventCore->RegisterCallback(socket, flags & IEventCore::kWritable,
+             [this, writable](void*) -> mseconds_t {
+                 return ApplicationReadyCallback(writable);
+             },
+             nullptr))
+        == 0) {
+        completion(Error::EVENTCORE);
+        return;
+    }
+    waiter = std::move(completion);
+}
+
+mseconds_t AtpSocket::ApplicationReadyCallback(bool writable)
+{
+    // One-shot
+    EventCore::callback_ident_t& wait = writable ? mApplicationWriteWait : mApplicationReadWait;
+    mEventCore->DeleteCallback(wait);
+    wait = 0;
+
+    completion_t waiter = std::move(writable ? mApplicationWriteWaiter : mApplicationReadWaiter);
+    waiter(Error::SUCCESS);
+    return -1;
+}
+
+void AtpSocket::NotifyWaiters(std::vector<completion_t>& waiters, Error error)
+{
+    // A completion may well queue up a new waiter (e.g the next accept)
+    std::vector<completion_t> pending = std::move(waiters);
+    waiters.clear();
+    for (completion_t& completion : pending)
+        completion(error);
 }
 
 Error AtpSocket::Bind(const struct sockaddr_atp* addr)
@@ -300,7 +637,7 @@ Error AtpSocket::Bind(const struct sockaddr_atp* addr)
     if (mSignallingAddress != nullptr)
         return Error::ALREADYSET;
 
-    if (!mSignallingProvider->Bind(mSignallingSocket, addr))
+    if (!mSignallingProvider->Bind(mSignallingSocket->GetFd(), addr))
         return Error::SIGNALLINGPROVIDER;
     mSignallingAddress = std::make_unique<struct sockaddr_atp>(*addr);
 
@@ -313,21 +650,20 @@ Error AtpSocket::Listen(int backlog)
         return Error::ALREADYSET;
     if (mSignallingAddress == nullptr)
         return Error::NOTBOUND;
-    if (backlog <= 0 || backlog > Config::kMaxBacklog)
+    if (mNatError != Error::SUCCESS)
+        return mNatError;
+    if (backlog <= 0 || static_cast<size_t>(backlog) > Config::kMaxBacklog)
         return Error::INVAL;
     THROW_IF(mSignallingRecvCallback != 0);
 
     Error returnCode = Error::UNKNOWN;
 
-    struct epoll_event epollSignalling;
-    bzero(&epollSignalling, sizeof(epollSignalling));
-    epollSignalling.data.fd = mSignallingSocket;
-    epollSignalling.events = EPOLLIN;
-    if ((mSignallingRecvCallback = mEventCore->RegisterCallback(mSignallingSocket,
-             &epollSignalling, EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return SignallingRecvCallback(data);
-             }))
+    if ((mSignallingRecvCallback = mEventCore->RegisterCallback(mSignallingSocket.get(),
+             IEventCore::kSuspend,
+             [this](void*) -> mseconds_t {
+                 return SignallingRecvCallback();
+             },
+             nullptr))
         == 0) {
         returnCode = Error::EVENTCORE;
         goto clean;
@@ -346,12 +682,16 @@ Error AtpSocket::Listen(int backlog)
     mBacklog = backlog;
 
     // Lets flush any pending messages
-    while (mSignallingProvider->Recv(mSignallingSocket, nullptr, nullptr, nullptr) >= 0)
+    while (mSignallingProvider->Recv(mSignallingSocket->GetFd(), nullptr, nullptr, nullptr) >= 0)
         ;
 
     mState = State::LISTEN;
+    SetupListenEvent();
 
-    THROW_IF(mEventCore->ResumeCallback(mSignallingRecvCallback) < 0);
+    // Requests can't be answered without our reflexive address, they wait in the
+    // signalling provider until NatResolved() resumes the callback
+    if (mNatResolved)
+        THROW_IF(mEventCore->ResumeCallback(mSignallingRecvCallback) < 0);
 
     return Error::SUCCESS;
 
@@ -365,53 +705,552 @@ clean:
     return returnCode;
 }
 
+Result<SocketOptions> SocketOptions::FromProfile(int profile)
+{
+    SocketOptions options {};
+    options.mProfile = profile;
+
+    switch (profile) {
+    case ATP_PROFILE_DEFAULT:
+        break;
+    case ATP_PROFILE_LOW_LATENCY:
+        options.mSendBuffer = 64 * 1024;
+        options.mReceiveBuffer = 64 * 1024;
+        options.mPunchInterval = 250;
+        options.mPunchTimeout = 30 * 1000;
+        break;
+    case ATP_PROFILE_BULK:
+        options.mSendBuffer = 4 * 1024 * 1024;
+        options.mReceiveBuffer = 4 * 1024 * 1024;
+        break;
+    default:
+        return std::unexpected(Error::INVAL);
+    }
+
+    return options;
+}
+
+Error AtpSocket::GetSockOpt(int level, int optname, void* optval, socklen_t* optlen)
+{
+    if (level != SOL_ATP || optval == nullptr || optlen == nullptr)
+        return Error::INVAL;
+
+    if (optname == ATP_INFO) {
+        // Like TCP_INFO, a short buffer gets a truncated struct
+        struct atp_info info;
+        THROW_IF(GetInfo(&info) != Error::SUCCESS);
+        *optlen = std::min<socklen_t>(*optlen, sizeof(info));
+        memcpy(optval, &info, *optlen);
+        return Error::SUCCESS;
+    }
+    if (optname == ATP_RELAY) {
+        if (*optlen < sizeof(struct sockaddr_in))
+            return Error::INVAL;
+        memcpy(optval, &mOptions.mRelayAddress, sizeof(struct sockaddr_in));
+        *optlen = sizeof(struct sockaddr_in);
+        return Error::SUCCESS;
+    }
+    if (*optlen < sizeof(int))
+        return Error::INVAL;
+
+    int value;
+    switch (optname) {
+    case ATP_SNDBUF:
+        value = mOptions.mSendBuffer;
+        break;
+    case ATP_RCVBUF:
+        value = mOptions.mReceiveBuffer;
+        break;
+    case ATP_KEEPALIVE_INTERVAL:
+        value = mOptions.mKeepAliveInterval;
+        break;
+    case ATP_PUNCH_INTERVAL:
+        value = mOptions.mPunchInterval;
+        break;
+    case ATP_PUNCH_TIMEOUT:
+        value = mOptions.mPunchTimeout;
+        break;
+    case ATP_NAT_REFRESH_INTERVAL:
+        value = mOptions.mNatRefreshInterval;
+        break;
+    case ATP_PROFILE:
+        value = mOptions.mProfile;
+        break;
+    default:
+        return Error::INVAL;
+    }
+
+    memcpy(optval, &value, sizeof(value));
+    *optlen = sizeof(value);
+    return Error::SUCCESS;
+}
+
+// Buffer sizes are picked up when the data path is set up, i.e at connection
+// establishment. The one exception is the ring of an active socket, which has to
+// exist from Socket() on, as its eventfd is the application fd.
+Error AtpSocket::SetSockOpt(int level, int optname, const void* optval, socklen_t optlen)
+{
+    if (level == SOL_ATP && optname == ATP_RELAY) {
+        struct sockaddr_in relay;
+        if (optval == nullptr || optlen != sizeof(relay))
+            return Error::INVAL;
+        memcpy(&relay, optval, sizeof(relay));
+        if (relay.sin_port != 0 && relay.sin_family != AF_INET)
+            return Error::INVAL;
+        mOptions.mRelayAddress = relay;
+        return Error::SUCCESS;
+    }
+    if (level != SOL_ATP || optval == nullptr || optlen != sizeof(int))
+        return Error::INVAL;
+
+    int value;
+    memcpy(&value, optval, sizeof(value));
+
+    SocketOptions options = mOptions;
+    switch (optname) {
+    case ATP_SNDBUF:
+        options.mSendBuffer = value;
+        break;
+    case ATP_RCVBUF:
+        options.mReceiveBuffer = value;
+        break;
+    case ATP_KEEPALIVE_INTERVAL:
+        options.mKeepAliveInterval = value;
+        break;
+    case ATP_PUNCH_INTERVAL:
+        options.mPunchInterval = value;
+        break;
+    case ATP_PUNCH_TIMEOUT:
+        options.mPunchTimeout = value;
+        break;
+    case ATP_NAT_REFRESH_INTERVAL:
+        options.mNatRefreshInterval = value;
+        break;
+    case ATP_PROFILE: {
+        Result<SocketOptions> profile = SocketOptions::FromProfile(value);
+        if (!profile)
+            return profile.error();
+        profile->mRelayAddress = options.mRelayAddress; // not a tunable
+        options = *profile;
+        break;
+    }
+    default:
+        return Error::INVAL;
+    }
+
+    // Validate the combination, not just the one value
+    if (options.mSendBuffer < Config::kMinBufferSize || options.mSendBuffer > Config::kMaxBufferSize
+        || options.mReceiveBuffer < Config::kMinBufferSize || options.mReceiveBuffer > Config::kMaxBufferSize
+        || options.mKeepAliveInterval <= 0 || options.mNatRefreshInterval <= 0
+        || options.mPunchInterval <= 0 || options.mPunchTimeout < options.mPunchInterval)
+        return Error::INVAL;
+
+    mOptions = options;
+    return Error::SUCCESS;
+}
+
+Error AtpSocket::GetInfo(struct atp_info* info)
+{
+    bzero(info, sizeof(*info));
+    info->atpi_state = static_cast<uint8_t>(mState);
+    info->atpi_relayed = mRelayed;
+
+    // As SendControlDatagram() advertises it
+    info->atpi_rcv_wnd = std::min(mOptions.mReceiveBuffer, UINT16_MAX);
+
+    if (mRingChannel) {
+        info->atpi_rcv_queued = mRingChannel->ApplicationQueued();
+        info->atpi_snd_queued = mRingChannel->EngineQueued();
+    } else if (mAtpSocket) {
+        // Engine end of the socketpair: its input queue is what the application sent
+        int queued;
+        if (ioctl(mAtpSocket->GetFd(), FIONREAD, &queued) == 0)
+            info->atpi_snd_queued = queued;
+        if (ioctl(mAtpSocket->GetFd(), TIOCOUTQ, &queued) == 0)
+            info->atpi_rcv_queued = queued;
+    }
+
+    info->atpi_punch_duration_ms = mStats.mPunchDurationMs;
+    info->atpi_punch_packets_sent = mStats.mPunchPacketsSent;
+    info->atpi_keepalives_sent = mStats.mKeepAlivesSent;
+
+    info->atpi_rtt = static_cast<uint32_t>(std::min<uint64_t>(mSmoothedRttUs, UINT32_MAX));
+    info->atpi_rttvar = static_cast<uint32_t>(std::min<uint64_t>(mRttVarianceUs, UINT32_MAX));
+    info->atpi_rto = static_cast<uint32_t>(mRto);
+    // As SendApplicationData() limits it
+    info->atpi_snd_cwnd = std::min(mPeerWindow, static_cast<uint32_t>(mOptions.mSendBuffer));
+    if (!mSendQueue.empty())
+        info->atpi_unacked = mSequenceNumber - mSendQueue.front().mSequence;
+    info->atpi_unacked_segs = static_cast<uint32_t>(mSendQueue.size());
+    info->atpi_retransmits = mStats.mRetransmits;
+    info->atpi_dup_acks = mStats.mDupAcks;
+    info->atpi_reordering = mStats.mReordered;
+
+    info->atpi_sockets_accepted = mStats.mSocketsAccepted;
+    info->atpi_connections_refused = mStats.mConnectionsRefused;
+    info->atpi_connections_established = mStats.mConnectionsEstablished;
+    return Error::SUCCESS;
+}
+
+std::unique_ptr<RingChannel> AtpSocket::MakeRingChannel() const
+{
+    return std::make_unique<RingChannel>(
+        std::bit_ceil(static_cast<size_t>(mOptions.mSendBuffer)),
+        std::bit_ceil(static_cast<size_t>(mOptions.mReceiveBuffer)));
+}
+
+int AtpSocket::GetApplicationFd()
+{
+    if (mRingChannel)
+        return mRingChannel->GetApplicationEvent()->GetFd();
+    if (mApplicationSocket)
+        return mApplicationSocket->GetFd();
+    return -1;
+}
+
+const struct sockaddr_atp* AtpSocket::GetPeerAddress()
+{
+    return &mPeerAddressAtp;
+}
+
+RingChannel* AtpSocket::GetRingChannel()
+{
+    return mRingChannel.get();
+}
+
+void AtpSocket::SetupDataPath(AtpSocket* socket)
+{
+    if (socket->mDataPath == DataPath::kRing)
+        SetupRing(socket);
+    else
+        SetupSocketpair(socket);
+}
+
+void AtpSocket::SetupRing(AtpSocket* socket)
+{
+    if (socket->mRingChannel == nullptr)
+        socket->mRingChannel = socket->MakeRingChannel();
+
+    // Woken only when the application->engine ring goes from empty to non-empty
+    THROW_IF((socket->mApplicationRecvCallback = socket->mEventCore->RegisterCallback(
+                  socket->mRingChannel->GetEngineEvent(), 0,
+                  [socket](void*) -> mseconds_t {
+                      return socket->ApplicationRecvCallback();
+                  },
+                  nullptr))
+        == 0);
+}
+
+size_t AtpSocket::ReadFromApplication(void* buffer, size_t length)
+{
+    if (mRingChannel)
+        return mRingChannel->EngineRead(buffer, length);
+
+    ssize_t ret = recv(mAtpSocket->GetFd(), buffer, length, MSG_DONTWAIT);
+    return ret > 0 ? static_cast<size_t>(ret) : 0;
+}
+
+size_t AtpSocket::WriteToApplication(const void* buffer, size_t length)
+{
+    if (mRingChannel)
+        return mRingChannel->EngineWrite(buffer, length);
+
+    ssize_t ret = send(mAtpSocket->GetFd(), buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return ret > 0 ? static_cast<size_t>(ret) : 0;
+}
+
 void AtpSocket::SetupSocketpair(AtpSocket* socket)
 {
-    int fds[2];
-    THROW_IF(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+    auto [application, atp] = socket->mSocketFactory->SocketPair(AF_UNIX, SOCK_STREAM, 0);
+    THROW_IF(application == nullptr || atp == nullptr);
 
-    if (socket->mApplicationFd == -1) {
-        socket->mApplicationFd = fds[0];
-        socket->mAtpFd = fds[1];
+    if (socket->mApplicationSocket == nullptr) {
+        socket->mApplicationSocket = std::move(application);
     } else {
+        // The application already holds the descriptor Socket() handed out
         // BUG: If errno is EINTR we should retry, not throw, but this would be pretty rare
-        THROW_IF(dup2(fds[0], socket->mApplicationFd) < 0);
-        close(fds[0]);
-        socket->mAtpFd = fds[1];
+        THROW_IF(socket->mApplicationSocket->Dup2(*application) < 0);
     }
+    socket->mAtpSocket = std::move(atp);
 
-    struct epoll_event epollApplication;
-    bzero(&epollApplication, sizeof(epollApplication));
-    epollApplication.events = EPOLLIN;
-    // Not needed, when even is epoll_data_t needed ffs?
-    // epollApplication.data.fd = socket->mAtpFd;
+    // Engine end: its receive queue holds what the application sent and vice versa.
+    // The kernel clamps these to net.core.{r,w}mem_max, which is fine.
+    setsockopt(socket->mAtpSocket->GetFd(), SOL_SOCKET, SO_RCVBUF,
+        &socket->mOptions.mSendBuffer, sizeof(socket->mOptions.mSendBuffer));
+    setsockopt(socket->mAtpSocket->GetFd(), SOL_SOCKET, SO_SNDBUF,
+        &socket->mOptions.mReceiveBuffer, sizeof(socket->mOptions.mReceiveBuffer));
 
     THROW_IF((socket->mApplicationRecvCallback = socket->mEventCore->RegisterCallback(
-                  socket->mAtpFd, &epollApplication, 0,
-                  [&](epoll_data_t data) -> mseconds_t {
-                      return socket->ApplicationRecvCallback(data);
-                  }))
-        != 0);
-    //   return Error::EVENTCORE;
+                  socket->mAtpSocket.get(), 0,
+                  [socket](void*) -> mseconds_t {
+                      return socket->ApplicationRecvCallback();
+                  },
+                  nullptr))
+        == 0);
+}
+
+mseconds_t AtpSocket::ApplicationRecvCallback()
+{
+    SendApplicationData();
+    return -1;
+}
+
+void AtpSocket::SendApplicationData()
+{
+    // Both sequence spaces start where early data ended, see AckEarlyData()
+    if (!mEarlyData.empty()) {
+        SuspendApplicationRecv();
+        return;
+    }
+
+    uint32_t window = std::min(mPeerWindow, static_cast<uint32_t>(mOptions.mSendBuffer));
+    uint32_t unacked = mSendQueue.empty() ? mSequenceNumber : mSendQueue.front().mSequence;
+    for (;;) {
+        uint32_t inFlight = mSequenceNumber - unacked;
+        if (inFlight >= window) {
+            // Level-triggered, the loop would spin on the unread data
+            SuspendApplicationRecv();
+            return;
+        }
+
+        std::byte payload[kAtpPayloadMaxLimit];
+        size_t length = ReadFromApplication(payload,
+            std::min<size_t>(sizeof(payload), window - inFlight));
+        if (length == 0)
+            return;
+
+        struct atp_hdr header;
+        bzero(&header, sizeof(header));
+        header.seq_num = mSequenceNumber;
+        header.ack_num = mAckNumber;
+        header.c.data = 1;
+        header.c.ack = 1;
+        header.magic = kAtpMagic;
+        header.window = static_cast<uint16_t>(std::min(mOptions.mReceiveBuffer, UINT16_MAX));
+        SendSegment(&header, payload, length);
+
+        uint64_t now = GetTimeUs();
+        mSendQueue.push_back(SentSegment {
+            .mSequence = mSequenceNumber,
+            .mPayload = std::vector<std::byte>(payload, payload + length),
+            .mSentUs = now,
+            .mRetransmitted = false,
+        });
+        mSequenceNumber += static_cast<uint32_t>(length);
+
+        if (mRetransmitCallback == 0) {
+            mRetransmitDeadlineMs = now / 1000 + mRto;
+            // Runs right away and finds its deadline still ahead, see RetransmitCallback()
+            THROW_IF((mRetransmitCallback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+                          [this](void*) -> mseconds_t {
+                              return RetransmitCallback();
+                          },
+                          nullptr))
+                == 0);
+        }
+    }
+}
+
+void AtpSocket::SuspendApplicationRecv()
+{
+    if (mApplicationRecvSuspended || mApplicationRecvCallback == 0)
+        return;
+    THROW_IF(mEventCore->SuspendCallback(mApplicationRecvCallback) < 0);
+    mApplicationRecvSuspended = true;
+}
+
+void AtpSocket::ReceiveData(const struct atp_hdr* header, const void* payload, size_t length)
+{
+    // Only the next segment in sequence is taken, or the part of a retransmission
+    // which is new. A segment beyond a gap is dropped, the duplicate ack below
+    // tells the sender where the gap starts.
+    uint32_t offset = mAckNumber - header->seq_num;
+    if (offset > UINT32_MAX / 2)
+        mStats.mReordered++;
+    else if (offset < length) {
+        size_t written = WriteToApplication(static_cast<const std::byte*>(payload) + offset,
+            length - offset);
+        // What the application had no room for is sent again
+        mAckNumber += static_cast<uint32_t>(written);
+    }
+
+    union atp_control control {};
+    control.ack = 1;
+    SendControlDatagram(control);
+}
+
+void AtpSocket::ReceiveAck(const struct atp_hdr* header)
+{
+    if (mSendQueue.empty())
+        return;
+
+    uint32_t unacked = mSendQueue.front().mSequence;
+    uint32_t acked = header->ack_num - unacked;
+    if (acked == 0) {
+        // Only a pure ack repeating itself hints at a loss. The rest of the
+        // duplicates were sent before the retransmission arrived, so they don't
+        // trigger another one.
+        if (header->c.ack && !header->c.data) {
+            mStats.mDupAcks++;
+            if (++mDupAcks == Config::kDupAckThreshold)
+                Retransmit();
+        }
+        return;
+    }
+    if (acked > mSequenceNumber - unacked)
+        return; // stale, or not ours
+    mDupAcks = 0;
+
+    uint64_t now = GetTimeUs();
+    uint64_t sampleSentUs = 0;
+    while (acked > 0) {
+        SentSegment& segment = mSendQueue.front();
+        if (acked < segment.mPayload.size()) {
+            // The receiver took only part of it
+            segment.mPayload.erase(segment.mPayload.begin(), segment.mPayload.begin() + acked);
+            segment.mSequence += acked;
+            break;
+        }
+        if (!segment.mRetransmitted)
+            sampleSentUs = segment.mSentUs;
+        acked -= static_cast<uint32_t>(segment.mPayload.size());
+        mSendQueue.pop_front();
+    }
+    if (sampleSentUs != 0)
+        SampleRtt(now - sampleSentUs);
+
+    // RFC 6298 5.2 and 5.3
+    if (mSendQueue.empty()) {
+        mEventCore->DeleteCallback(mRetransmitCallback);
+        mRetransmitCallback = 0;
+    } else {
+        mRetransmitDeadlineMs = now / 1000 + mRto;
+    }
+
+    if (mApplicationRecvSuspended) {
+        THROW_IF(mEventCore->ResumeCallback(mApplicationRecvCallback) < 0);
+        mApplicationRecvSuspended = false;
+    }
 }
 
-mseconds_t AtpSocket::SignallingRecvCallback(epoll_data_t data)
+void AtpSocket::SampleRtt(uint64_t rttUs)
 {
-    THROW_IF(mState != State::LISTEN);
+    // RFC 6298 2.2 and 2.3, alpha = 1/8, beta = 1/4
+    if (mSmoothedRttUs == 0) {
+        mSmoothedRttUs = std::max<uint64_t>(rttUs, 1);
+        mRttVarianceUs = rttUs / 2;
+    } else {
+        uint64_t delta = rttUs > mSmoothedRttUs ? rttUs - mSmoothedRttUs : mSmoothedRttUs - rttUs;
+        mRttVarianceUs = (3 * mRttVarianceUs + delta) / 4;
+        mSmoothedRttUs = std::max<uint64_t>((7 * mSmoothedRttUs + rttUs) / 8, 1);
+    }
 
+    // The clock granularity G is the 1ms of the EventCore timers
+    uint64_t rtoUs = mSmoothedRttUs + std::max<uint64_t>(1000, 4 * mRttVarianceUs);
+    mRto = static_cast<mseconds_t>(std::clamp<uint64_t>(rtoUs / 1000, Config::kRtoMin, Config::kRtoMax));
+}
+
+void AtpSocket::Retransmit()
+{
+    uint64_t now = GetTimeUs();
+    for (SentSegment& segment : mSendQueue) {
+        struct atp_hdr header;
+        bzero(&header, sizeof(header));
+        header.seq_num = segment.mSequence;
+        header.ack_num = mAckNumber;
+        header.c.data = 1;
+        header.c.ack = 1;
+        header.magic = kAtpMagic;
+        header.window = static_cast<uint16_t>(std::min(mOptions.mReceiveBuffer, UINT16_MAX));
+        SendSegment(&header, segment.mPayload.data(), segment.mPayload.size());
+        segment.mSentUs = now;
+        segment.mRetransmitted = true;
+        mStats.mRetransmits++;
+    }
+}
+
+mseconds_t AtpSocket::RetransmitCallback()
+{
+    // Acks push the deadline back instead of re-arming the timer
+    uint64_t now = GetTimeMs();
+    if (now < mRetransmitDeadlineMs)
+        return static_cast<mseconds_t>(mRetransmitDeadlineMs - now);
+
+    // RFC 6298 5.5 to 5.7
+    mRto = std::min(mRto * 2, Config::kRtoMax);
+    mDupAcks = 0;
+    Retransmit();
+    mRetransmitDeadlineMs = now + mRto;
+    return mRto;
+}
+
+mseconds_t AtpSocket::NatKeepAliveCallback()
+{
+    // Established, the peer keeps our mapping open by answering. Before that
+    // punching does the job, and the relay is kept alive by the relay traffic.
+    if (mState == State::ESTABLISHED && !mRelayed) {
+        union atp_control control {};
+        control.kpalive = 1;
+        SendControlDatagram(control);
+        mStats.mKeepAlivesSent++;
+    }
+
+    // Listening or idle, nobody tells whether the NAT moved the mapping in the
+    // meantime: once it is as old as the NAT type cache, a binding request
+    // confirms it. Behind a dependent NAT every query moves it, there is nothing
+    // to compare against.
+    bool idle = mState == State::CLOSED && mSignallingRecvCallback == 0 && mPassiveOwner == nullptr;
+    if ((mState == State::LISTEN || idle) && mNatResolved && mNatResolution == 0 && mPortDelta == 0
+        && GetTimeMs() - mNatResolvedMs >= static_cast<uint64_t>(mOptions.mNatRefreshInterval)) {
+        mNatResolution = mNatResolver->ResolveShared(mDemux->GetSocket(),
+            [this](INatResolver::NatType, const struct sockaddr_in* reflexiveAddress, int portDelta) {
+                NatRefreshed(reflexiveAddress, portDelta);
+            });
+    }
+    return mOptions.mKeepAliveInterval;
+}
+
+void AtpSocket::NatRefreshed(const struct sockaddr_in* reflexiveAddress, int portDelta)
+{
+    mNatResolution = 0;
+
+    // A failed query says nothing about the mapping, the next keepalive retries
+    if (reflexiveAddress == nullptr)
+        return;
+    mNatResolvedMs = GetTimeMs();
+    if (reflexiveAddress->sin_addr.s_addr == mReflexiveAddress.sin_addr.s_addr
+        && reflexiveAddress->sin_port == mReflexiveAddress.sin_port)
+        return;
+
+    PLOG_INFO << fmt::format("NAT mapping moved from port {} to {}", ntohs(mReflexiveAddress.sin_port),
+        ntohs(reflexiveAddress->sin_port));
+    mReflexiveAddress = *reflexiveAddress;
+    mPortDelta = portDelta;
+    // Whatever else was learnt about this NAT may be just as stale
+    mNatResolver->Invalidate(mDemux->GetSocket());
+}
+
+mseconds_t AtpSocket::SignallingRecvCallback()
+{
     struct sockaddr_atp peerAddressAtp;
 
     size_t length = 1024;
     char buffer[length];
-    if (mSignallingProvider->Recv(mSignallingSocket, buffer, &length, &peerAddressAtp) < 0)
+    if (mSignallingProvider->Recv(mSignallingSocket->GetFd(), buffer, &length, &peerAddressAtp) < 0)
         return -1;
-    THROW_IF(length > sizeof(buffer)); // Signal was truncated
-    THROW_IF(!IsSignal(buffer, length));
 
+    // Whatever the peer sends, it must not take the engine down
     struct signal sig;
-    THROW_IF(ReadSignal(buffer, length, &sig) < 0);
-    THROW_IF(sig.request == 0);
-    THROW_IF(sig.addr_family != AF_INET);
+    if (length > sizeof(buffer) || !IsSignal(buffer, length)
+        || ReadSignal(buffer, length, &sig) < 0) {
+        PLOG_WARNING << "Ignoring malformed signal";
+        return -1;
+    }
+    if (sig.addr_family != AF_INET) {
+        PLOG_WARNING << fmt::format("Ignoring signal, address family {} is not AF_INET",
+            static_cast<uint16_t>(sig.addr_family));
+        return -1;
+    }
 
     if (sig.request)
         SignallingRecvRequest(&sig, &peerAddressAtp);
@@ -431,20 +1270,14 @@ void AtpSocket::SignallingRecvRequest(const struct signal* request,
         return;
     }
 
-    struct sockaddr_in peerAddressIn;
-    bzero(&peerAddressIn, sizeof(peerAddressIn));
-    peerAddressIn.sin_family = request->addr_family;
-    peerAddressIn.sin_port = request->addr_port;
-    peerAddressIn.sin_addr.s_addr = request->addr_ipv4;
-
-    if (mCompletedConnections.size() + mIncompleteConnections.size() > mBacklog) {
+    if (mCompletedConnections.size() + mIncompleteConnections.size() >= static_cast<size_t>(mBacklog)) {
         PLOG_WARNING << fmt::format("Cannot accept more connections, backlog={}",
             mBacklog);
+        mStats.mConnectionsRefused++;
         return;
     }
 
-    Result<std::unique_ptr<AtpSocket>> newsock = CloneForConnection(source,
-        &peerAddressIn);
+    Result<std::unique_ptr<AtpSocket>> newsock = CloneForConnection(source, request);
     if (!newsock) {
         PLOG_ERROR << Strerror(newsock.error());
         return;
@@ -456,24 +1289,20 @@ void AtpSocket::SignallingRecvRequest(const struct signal* request,
     struct signal response;
     bzero(&response, sizeof(response));
 
-    struct sockaddr_in reflexiveAddress;
-    socklen_t reflexiveLength = sizeof(struct sockaddr_in);
-    THROW_IF(mStunClient->GetReflexiveAddress((struct sockaddr*)&reflexiveAddress,
-                 &reflexiveLength)
-        != 0);
-    THROW_IF(reflexiveAddress.sin_family != AF_INET);
+    THROW_IF(!mNatResolved);
 
     response.magic = kSignalMagic;
     response.response = 1;
     response.addr_family = AF_INET;
-    response.addr_port = reflexiveAddress.sin_port;
-    response.addr_ipv4 = reflexiveAddress.sin_addr.s_addr;
+    response.addr_port = mReflexiveAddress.sin_port;
+    response.addr_ipv4 = mReflexiveAddress.sin_addr.s_addr;
+    response.candidate_count = static_cast<uint8_t>(GatherLocalCandidates(response.candidates));
 
     size_t sendbufLength;
     const void* sendbuf = BuildSignal(&response, &sendbufLength);
     THROW_IF(sendbuf == nullptr);
 
-    if (mSignallingProvider->Send(mSignallingSocket, sendbuf, sendbufLength,
+    if (mSignallingProvider->Send(mSignallingSocket->GetFd(), sendbuf, sendbufLength,
             source)
         != 0) {
         PLOG_ERROR << "Failed to sending signalling response";
@@ -485,39 +1314,49 @@ void AtpSocket::SignallingRecvRequest(const struct signal* request,
 void AtpSocket::SignallingRecvResponse(const struct signal* response,
     const struct sockaddr_atp* source)
 {
+    if (mWarm) {
+        mWarm = false;
+        mStats.mSignallingRttMs = static_cast<mseconds_t>(GetTimeMs() - mStats.mSignallingSentMs);
+        if (mState != State::PUNCH)
+            return; // the warm path got through first
+
+        // Nothing heard over the warm path yet, the peer may have moved since.
+        // Its candidates are checked as usual, most likely including the cached one.
+        mDemux->DeleteCallback(mNetworkRecvCallback);
+        mNetworkRecvCallback = 0;
+        struct signal_candidate candidates[kMaxSignalCandidates];
+        size_t count = GatherLocalCandidates(candidates);
+        if (StartChecks(response, std::span(candidates, count), true) != Error::SUCCESS)
+            PLOG_WARNING << "Failed to start checks after the warm path, punching it on";
+        return;
+    }
+
     if (mState != State::CLOSED) {
         PLOG_WARNING << "Received signalling response when state is not CLOSED, ignoring";
         return;
     }
 
     mPeerAddressAtp = *source;
-
-    THROW_IF(response->addr_family != AF_INET);
-    mPeerAddressIn.sin_family = response->addr_family;
-    mPeerAddressIn.sin_port = response->addr_port;
-    mPeerAddressIn.sin_addr.s_addr = response->addr_ipv4;
-
-    struct epoll_event epollPunch;
-    bzero(&epollPunch, sizeof(epollPunch));
-    epollPunch.events = 0;
-    if ((mPunchThroughCallback = mEventCore->RegisterCallback(-1,
-             &epollPunch, EventCore::kInvokeImmediately | EventCore::kSuspend,
-             [&](epoll_data_t data) -> mseconds_t {
-                 return PunchThroughCallback(data);
-             }))
+    mStats.mSignallingRttMs = static_cast<mseconds_t>(GetTimeMs() - mStats.mSignallingSentMs);
+
+    if ((mPunchThroughCallback = mEventCore->RegisterCallback(
+             IEventCore::kInvokeImmediately | IEventCore::kSuspend,
+             [this](void*) -> mseconds_t {
+                 return PunchThroughCallback();
+             },
+             nullptr))
         == 0) {
         goto clean;
     }
 
-    if ((mNetworkRecvCallback = mDemux->RegisterCallback(&mPeerAddressIn,
-             [&](const void* buffer, size_t length) -> void {
-                 NetworkRecvCallback(buffer, length);
-             }))
-        == 0) {
-        goto clean;
+    {
+        struct signal_candidate candidates[kMaxSignalCandidates];
+        size_t count = GatherLocalCandidates(candidates);
+        if (StartChecks(response, std::span(candidates, count), true) != Error::SUCCESS)
+            goto clean;
     }
 
-    mState = State::PUNCH;
+    StartPunching();
 
     THROW_IF(mEventCore->ResumeCallback(mPunchThroughCallback) != 0);
     return;
@@ -525,8 +1364,19 @@ void AtpSocket::SignallingRecvResponse(const struct signal* response,
 clean:
     if (mPunchThroughCallback)
         mEventCore->DeleteCallback(mPunchThroughCallback);
-    if (mNetworkRecvCallback)
-        mDemux->DeleteCallback(mNetworkRecvCallback);
+    mPunchThroughCallback = 0;
+    ClearCheckPairs();
+}
+
+void AtpSocket::SendDatagram(const void* datagram, size_t length,
+    const struct sockaddr_in* destination)
+{
+    // Lost like any other datagram, e.g ECONNREFUSED from an earlier ICMP error
+    if (mDemux->GetSocket()->SendTo(datagram, length, MSG_DONTWAIT,
+            reinterpret_cast<const struct sockaddr*>(destination), sizeof(*destination))
+        < 0) {
+        PLOG_DEBUG << "sendto failed - " << strerror(errno);
+    }
 }
 
 void AtpSocket::SendControlDatagram(union atp_control control)
@@ -537,35 +1387,294 @@ void AtpSocket::SendControlDatagram(union atp_control control)
     header.ack_num = mAckNumber;
     header.c = control;
     header.magic = kAtpMagic;
-    header.window = Config::kConstantWindow;
+    // HACK: Constant window size, for now. Need to implement properly later
+    header.window = static_cast<uint16_t>(std::min(mOptions.mReceiveBuffer, UINT16_MAX));
+
+    const void* payload = nullptr;
+    size_t payloadSize = 0;
+    if (control.thru) {
+        TakeEarlyData();
+        if (!mEarlyData.empty()) {
+            header.c.data = 1;
+            payload = mEarlyData.data();
+            payloadSize = mEarlyData.size();
+        }
+    }
 
+    SendSegment(&header, payload, payloadSize);
+}
+
+void AtpSocket::SendSegment(const struct atp_hdr* header, const void* payload, size_t length)
+{
     size_t datagramLength;
-    const void* datagram = BuildDatagram(&header, nullptr, 0, &datagramLength);
+    const void* datagram = BuildDatagram(header, payload, length, &datagramLength);
     THROW_IF(datagram == nullptr);
-    SendDatagram(datagram, datagramLength);
+
+    // Over the relay, except for punches still probing the direct pairs
+    if (mRelayed && !header->c.punch) {
+        SendRelayDatagram(datagram, datagramLength);
+        return;
+    }
+
+    if (mCheckPairs.empty()) {
+        if (!mRelayed)
+            SendDatagram(datagram, datagramLength, &mPeerAddressIn);
+        return;
+    }
+
+    // Until a pair is nominated, punching goes out on all of them at once,
+    // and on the relay alongside once the fallback kicked in
+    SprayCheckPairs(datagram, datagramLength);
+    if (mRelayRecvCallback && !mRelayed)
+        SendRelayDatagram(datagram, datagramLength);
+}
+
+void AtpSocket::SprayCheckPairs(const void* datagram, size_t length)
+{
+    size_t burst = std::min(mCheckPairs.size(), Config::kPunchSprayBurst);
+    for (size_t i = 0; i < burst; i++) {
+        SendDatagram(datagram, length, &mCheckPairs[mCheckCursor].mRemote);
+        mCheckCursor = (mCheckCursor + 1) % mCheckPairs.size();
+    }
+}
+
+size_t AtpSocket::GatherLocalCandidates(struct signal_candidate* candidates) const
+{
+    THROW_IF(!mNatResolved);
+    return GatherCandidates(mDemux->GetSocket()->GetFd(), &mReflexiveAddress, mPortDelta,
+        candidates, kMaxSignalCandidates);
+}
+
+Error AtpSocket::StartChecks(const struct signal* remote,
+    std::span<const struct signal_candidate> local, bool controlling)
+{
+    THROW_IF(!mCheckPairs.empty());
+
+    // Peers without candidates only send their reflexive address
+    std::span<const struct signal_candidate> candidates(remote->candidates, remote->candidate_count);
+    struct signal_candidate reflexive {
+        .type = kCandidateServerReflexive,
+        .port_delta = 0,
+        .port = remote->addr_port,
+        .ipv4 = remote->addr_ipv4,
+        .priority = kCandidateServerReflexivePreference << 24,
+    };
+    if (candidates.empty())
+        candidates = std::span(&reflexive, 1);
+
+    for (const struct signal_candidate& candidate : candidates) {
+        // Our side of the pair is the best local candidate the peer's datagrams
+        // would arrive on: a host one over the LAN, the NAT mapping otherwise
+        bool host = candidate.type == kCandidateHost;
+        uint32_t localPriority = 0;
+        for (const struct signal_candidate& ours : local)
+            if ((ours.type == kCandidateHost) == host)
+                localPriority = std::max(localPriority, ours.priority);
+        uint64_t priority = controlling ? CandidatePairPriority(localPriority, candidate.priority)
+                                        : CandidatePairPriority(candidate.priority, localPriority);
+
+        // A predicted candidate stands for a sequence of ports, the closest first
+        int ports = candidate.type == kCandidatePredicted && candidate.port_delta != 0
+            ? Config::kMaxPredictedPorts
+            : 1;
+        for (int k = 0; k < ports; k++) {
+            int port = ntohs(candidate.port) + k * candidate.port_delta;
+            if (port <= 0 || port > UINT16_MAX)
+                break;
+
+            struct sockaddr_in address;
+            bzero(&address, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(port));
+            address.sin_addr.s_addr = candidate.ipv4;
+
+            mCheckPairs.push_back(CheckPair {
+                .mRemote = address,
+                .mPriority = priority - k,
+            });
+        }
+    }
+    std::stable_sort(mCheckPairs.begin(), mCheckPairs.end(),
+        [](const CheckPair& a, const CheckPair& b) { return a.mPriority > b.mPriority; });
+
+    std::vector<in_addr_t> hosts;
+    for (const CheckPair& pair : mCheckPairs)
+        if (std::find(hosts.begin(), hosts.end(), pair.mRemote.sin_addr.s_addr) == hosts.end())
+            hosts.push_back(pair.mRemote.sin_addr.s_addr);
+
+    for (in_addr_t host : hosts) {
+        Demux::callback_ident_t callback = mDemux->RegisterHostCallback(host,
+            [this](const struct sockaddr_in* source, const void* buffer, size_t length) -> bool {
+                return CheckRecvCallback(source, buffer, length);
+            });
+        if (callback == 0) {
+            ClearCheckPairs();
+            return Error::DEMUX;
+        }
+        mCheckCallbacks.push_back(callback);
+    }
+
+    // Until nominated, the highest priority pair
+    mPeerAddressIn = mCheckPairs.front().mRemote;
+    return Error::SUCCESS;
+}
+
+bool AtpSocket::CheckRecvCallback(const struct sockaddr_in* source, const void* buffer, size_t length)
+{
+    auto pair = std::find_if(mCheckPairs.begin(), mCheckPairs.end(), [source](const CheckPair& pair) {
+        return pair.mRemote.sin_addr.s_addr == source->sin_addr.s_addr
+            && pair.mRemote.sin_port == source->sin_port;
+    });
+    if (pair == mCheckPairs.end())
+        return false;
+
+    // Nominate the first pair to answer, it gets a callback of its own.
+    // Also how a connection established over the relay moves to the direct path.
+    Demux::callback_ident_t callback = mDemux->RegisterCallback(source,
+        [this](const struct sockaddr_in*, const void* buffer, size_t length) -> void {
+            NetworkRecvCallback(buffer, length);
+        });
+    if (callback == 0) {
+        PLOG_WARNING << "Nominated pair is taken by another connection, checking on";
+        return true;
+    }
+    mPeerAddressIn = *source;
+    mNetworkRecvCallback = callback;
+    ClearCheckPairs();
+    StopRelay();
+    MaybeStopPunching();
+
+    NetworkRecvCallback(buffer, length);
+    return true;
+}
+
+void AtpSocket::ClearCheckPairs()
+{
+    for (Demux::callback_ident_t callback : mCheckCallbacks)
+        mDemux->DeleteCallback(callback);
+    mCheckCallbacks.clear();
+    mCheckPairs.clear();
+    mCheckCursor = 0;
+}
+
+Error AtpSocket::StartRelay()
+{
+    THROW_IF(mRelayToken == 0 || mRelayRecvCallback != 0);
+
+    if ((mRelayRecvCallback = mDemux->RegisterRelayCallback(mRelayToken,
+             [this](const struct sockaddr_in* source, const void* buffer, size_t length) -> void {
+                 RelayRecvCallback(source, buffer, length);
+             }))
+        == 0)
+        return Error::DEMUX;
+    return Error::SUCCESS;
+}
+
+void AtpSocket::StopRelay()
+{
+    if (mRelayRecvCallback)
+        mDemux->DeleteCallback(mRelayRecvCallback);
+    mRelayRecvCallback = 0;
+    mRelayed = false;
+}
+
+void AtpSocket::RelayRecvCallback(const struct sockaddr_in* source, const void* buffer, size_t length)
+{
+    // Anyone can send our token, only the relay we picked is trusted with it
+    if (source->sin_addr.s_addr != mRelayAddress.sin_addr.s_addr
+        || source->sin_port != mRelayAddress.sin_port)
+        return;
+
+    struct relay_hdr header;
+    if (length < sizeof(header))
+        return;
+    memcpy(&header, buffer, sizeof(header));
+    if (header.magic != kRelayMagic || header.version != kRelayVersion || header.token != mRelayToken)
+        return;
+
+    // The relay got through before any direct pair did, use it until one does
+    mRelayed = true;
+    NetworkRecvCallback(static_cast<const char*>(buffer) + sizeof(header), length - sizeof(header));
+}
+
+void AtpSocket::SendRelayDatagram(const void* datagram, size_t length)
+{
+    char buffer[sizeof(struct relay_hdr) + sizeof(struct atp_hdr) + kAtpPayloadMaxLimit];
+    THROW_IF(length > sizeof(buffer) - sizeof(struct relay_hdr));
+
+    struct relay_hdr header {
+        .magic = kRelayMagic,
+        .version = kRelayVersion,
+        .zero = 0,
+        .token = mRelayToken,
+    };
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), datagram, length);
+    SendDatagram(buffer, sizeof(header) + length, &mRelayAddress);
 }
 
-mseconds_t AtpSocket::PunchThroughCallback(epoll_data_t data)
+mseconds_t AtpSocket::PunchThroughCallback()
 {
-    if (mState != State::PUNCH || mState != State::THRU)
+    // Established over the relay, the direct pairs are still punched to upgrade.
+    // Unacknowledged early data keeps the THRUs going, see mEarlyData.
+    bool established = mState == State::ESTABLISHED;
+    bool upgrading = established && mRelayed;
+    bool unacked = established && !mEarlyData.empty();
+    if (mState != State::PUNCH && mState != State::THRU && !upgrading && !unacked)
         return -1;
 
-    if (++mPunchPacketCounter > (Config::kPunchTimeout / Config::kPunchInterval)) {
+    uint64_t elapsed = GetTimeMs() - mStats.mPunchStartMs;
+    if (elapsed >= static_cast<uint64_t>(mOptions.mPunchTimeout) && established) {
+        // Stuck with the relay for the rest of the connection, if on it
+        if (upgrading)
+            ClearCheckPairs();
+        if (unacked)
+            PLOG_WARNING << "Early data never acknowledged, dropping it";
+        mEarlyData.clear();
+        mEventCore->DeleteCallback(mPunchThroughCallback);
+        mPunchThroughCallback = 0;
+        return -1;
+    }
+    if (elapsed >= static_cast<uint64_t>(mOptions.mPunchTimeout)) {
         // too many tries already, failed to establish connection
+        StopRelay();
         mState = State::CLOSED;
+        NotifyWaiters(mConnectedWaiters, Error::TIMEDOUT);
         if (mPassiveOwner)
             mPassiveOwner->ConnectionClosed(this);
         return -1;
     }
 
+    if (mRelayToken != 0 && mRelayRecvCallback == 0 && !upgrading
+        && elapsed >= static_cast<uint64_t>(Config::kRelayFallbackTimeout)) {
+        if (StartRelay() != Error::SUCCESS) {
+            PLOG_WARNING << "Failed to fall back to the relay, punching on";
+            mRelayToken = 0;
+        } else {
+            // A new path, punched from the start of the backoff again. The peer
+            // gets there within an interval of us, not kPunchInterval later.
+            mPunchBackoff = Config::kPunchInitialInterval;
+        }
+    }
+
     union atp_control control {};
-    if (mState == State::PUNCH)
-        control.punch = 1;
-    else if (mState == State::THRU)
+    if (mState == State::THRU || unacked)
         control.thru = 1;
+    else
+        control.punch = 1;
 
     SendControlDatagram(control);
-    return Config::kPunchInterval;
+    mStats.mPunchPacketsSent++;
+
+    // A lost packet early on costs one short interval rather than a full
+    // kPunchInterval, while a peer which is slow to show up is not flooded
+    mseconds_t interval = mPunchBackoff;
+    mPunchBackoff = std::min(mPunchBackoff * 2, mOptions.mPunchInterval);
+    // Fall back on time, not on whichever backed off tick comes after
+    if (mRelayToken != 0 && mRelayRecvCallback == 0 && !upgrading
+        && elapsed < static_cast<uint64_t>(Config::kRelayFallbackTimeout))
+        interval = std::min(interval, static_cast<mseconds_t>(Config::kRelayFallbackTimeout - elapsed));
+    return interval;
 }
 
 void AtpSocket::NetworkRecvCallback(const void* buffer, size_t length)
@@ -583,6 +1692,14 @@ void AtpSocket::NetworkRecvCallback(const void* buffer, size_t length)
         return;
     }
 
+    // Nothing else tells us the peer's initial sequence number
+    if (!mPeerSequenceKnown) {
+        mAckNumber = header.seq_num;
+        mPeerSequenceKnown = true;
+    }
+    mPeerWindow = header.window;
+    AckEarlyData(&header);
+
     switch (mState) {
     case State::PUNCH:
         NetworkRecvPunch(&header, payload, payloadSize);
@@ -599,19 +1716,95 @@ void AtpSocket::NetworkRecvCallback(const void* buffer, size_t length)
     }
 }
 
+void AtpSocket::TakeEarlyData()
+{
+    // Once ESTABLISHED the ring belongs to ApplicationRecvCallback
+    if (mEarlyDataTaken || mRingChannel == nullptr
+        || (mState != State::PUNCH && mState != State::THRU))
+        return;
+
+    std::byte buffer[kAtpPayloadMaxLimit];
+    size_t length = ReadFromApplication(buffer, sizeof(buffer));
+    if (length == 0)
+        return; // the application may still write before the next THRU
+
+    mEarlyData.assign(buffer, buffer + length);
+    mEarlyDataTaken = true;
+}
+
+Result<size_t> AtpSocket::WriteEarlyData(const void* buffer, size_t length)
+{
+    if (mDataPath != DataPath::kSocketpair)
+        return std::unexpected(Error::INVAL);
+    if (mState == State::ESTABLISHED)
+        return 0;
+    if (!IsConnecting())
+        return std::unexpected(Error::INVAL);
+    if (mEarlyDataTaken)
+        return std::unexpected(Error::WOULDBLOCK);
+
+    length = std::min(length, kAtpPayloadMaxLimit);
+    const std::byte* bytes = static_cast<const std::byte*>(buffer);
+    mEarlyData.assign(bytes, bytes + length);
+    mEarlyDataTaken = true;
+    return length;
+}
+
+void AtpSocket::ReceiveEarlyData(const struct atp_hdr* header,
+    const void* payload, size_t length)
+{
+    // Every THRU of the peer carries the same segment until it sees our ack, a
+    // part of it may have been delivered already
+    uint32_t offset = mAckNumber - header->seq_num;
+    if (!header->c.data || offset >= length)
+        return;
+
+    const std::byte* bytes = static_cast<const std::byte*>(payload);
+    if (mState != State::ESTABLISHED) {
+        // Nothing delivered yet, so offset is 0
+        mEarlyDataReceived.assign(bytes, bytes + length);
+        return;
+    }
+    DeliverEarlyData(bytes + offset, length - offset);
+}
+
+void AtpSocket::DeliverEarlyData(const std::byte* bytes, size_t length)
+{
+    // The application may not have drained the data path, what does not fit is
+    // left unacked for the peer to send again
+    size_t written = WriteToApplication(bytes, length);
+    mAckNumber += static_cast<uint32_t>(written);
+}
+
+void AtpSocket::AckEarlyData(const struct atp_hdr* header)
+{
+    if (mEarlyData.empty() || header->ack_num != mSequenceNumber + mEarlyData.size())
+        return;
+    mSequenceNumber += static_cast<uint32_t>(mEarlyData.size());
+    mEarlyData.clear();
+    MaybeStopPunching();
+
+    // What the application wrote since waited on this
+    if (mApplicationRecvSuspended) {
+        THROW_IF(mEventCore->ResumeCallback(mApplicationRecvCallback) < 0);
+        mApplicationRecvSuspended = false;
+    }
+}
+
 void AtpSocket::NetworkRecvPunch(const struct atp_hdr* header,
     const void* payload, size_t length)
 {
     if (header->c.punch) {
+        // Answer right away, the peer is waiting on our THRU to finish
         mState = State::THRU;
+        SendControlDatagram(ThruControl());
+        mStats.mPunchPacketsSent++;
     } else if (header->c.thru) {
         // In this case the socket never entered the THRU state
         // However, the socket will still transmit a THRU packet
         // for every THRU it receives, even in the established state
-        mState = State::ESTABLISHED;
-        SetupSocketpair(this);
-        if (mPassiveOwner)
-            mPassiveOwner->ConnectionEstablished(this);
+        ReceiveEarlyData(header, payload, length);
+        Established();
     } else {
         PLOG_WARNING << fmt::format("Received a non punch/thru packet while in State::PUNCH,"
                                     "header.control={}",
@@ -627,12 +1820,9 @@ void AtpSocket::NetworkRecvThru(const struct atp_hdr* header,
         ; // No change
     } else if (header->c.thru || header->c.data) {
         // It is possible for the peer to be in an established state while we are still
-        // in State::THRU.
-        // In such a scenario we simply ignore the payload and let it get re-transmitted.
-        mState = State::ESTABLISHED;
-        SetupSocketpair(this);
-        if (mPassiveOwner)
-            mPassiveOwner->ConnectionEstablished(this);
+        // in State::THRU. Its early data is kept either way, see mEarlyData.
+        ReceiveEarlyData(header, payload, length);
+        Established();
     } else {
         PLOG_WARNING << fmt::format("Received unhandled packet type while in State::THRU,"
                                     "header.control={}",
@@ -644,13 +1834,61 @@ void AtpSocket::NetworkRecvThru(const struct atp_hdr* header,
 void AtpSocket::NetworkRecvEstablished(const struct atp_hdr* header,
     const void* payload, size_t length)
 {
+    ReceiveAck(header);
+
     if (header->c.punch) {
-        PLOG_WARNING << "Received PUNCH packet while in State::ESTABLISHED";
+        // The peer probing a direct path while we talk over the relay, or a
+        // late duplicate. Either way a THRU lets it finish.
+        SendControlDatagram(ThruControl());
         return;
     } else if (header->c.thru) {
-        SendControlDatagram(atp_control { .thru = 1 });
+        // Early data we missed before establishing, the reply acks it
+        ReceiveEarlyData(header, payload, length);
+        SendControlDatagram(ThruControl());
         return;
+    } else if (header->c.data) {
+        ReceiveData(header, payload, length);
+    }
+}
+
+void AtpSocket::StartPunching()
+{
+    mState = State::PUNCH;
+    mStats.mPunchStartMs = GetTimeMs();
+
+    // The direct path is usually no slower than the signalling one, so a packet
+    // unanswered for half the signalling RTT is likely lost. Passive sockets
+    // have no such measurement and start at the floor.
+    mPunchBackoff = Config::kPunchInitialInterval;
+    if (mStats.mSignallingRttMs > 0)
+        mPunchBackoff = std::max(mPunchBackoff, mStats.mSignallingRttMs / 2);
+    mPunchBackoff = std::min(mPunchBackoff, mOptions.mPunchInterval);
+}
+
+void AtpSocket::Established()
+{
+    mState = State::ESTABLISHED;
+    // No more punching, THRUs from the peer are answered one by one
+    MaybeStopPunching();
+    mStats.mPunchDurationMs = static_cast<uint32_t>(GetTimeMs() - mStats.mPunchStartMs);
+    SetupDataPath(this);
+    if (!mEarlyDataReceived.empty()) {
+        DeliverEarlyData(mEarlyDataReceived.data(), mEarlyDataReceived.size());
+        mEarlyDataReceived.clear();
     }
+    NotifyWaiters(mConnectedWaiters, Error::SUCCESS);
+    if (mPassiveOwner)
+        mPassiveOwner->ConnectionEstablished(this);
+}
+
+void AtpSocket::MaybeStopPunching()
+{
+    // Over the relay the direct pairs keep being punched, and unacknowledged
+    // early data keeps being sent, see PunchThroughCallback
+    if (mState != State::ESTABLISHED || mRelayed || !mEarlyData.empty() || !mPunchThroughCallback)
+        return;
+    mEventCore->DeleteCallback(mPunchThroughCallback);
+    mPunchThroughCallback = 0;
 }
 
 void AtpSocket::ConnectionEstablished(AtpSocket* socket)
@@ -662,9 +1900,39 @@ void AtpSocket::ConnectionEstablished(AtpSocket* socket)
     if (it != mIncompleteConnections.end()) {
         mCompletedConnections.push(std::move(*it));
         mIncompleteConnections.erase(it);
+        mStats.mConnectionsEstablished++;
+        UpdateListenEvent();
+        NotifyWaiters(mConnectionWaiters, Error::SUCCESS);
     }
 }
 
+void AtpSocket::SetupListenEvent()
+{
+    // The ring's application eventfd can be used as is, a listening socket
+    // never moves data through it
+    if (mRingChannel)
+        return;
+
+    // Swap the unix socket for an eventfd under the same descriptor number,
+    // the application may already have it in its epoll set
+    int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    THROW_IF(eventFd < 0);
+    PosixSocket event { eventFd };
+    THROW_IF(mApplicationSocket->Dup2(event) < 0);
+}
+
+void AtpSocket::UpdateListenEvent()
+{
+    int fd = GetApplicationFd();
+    uint64_t value = 1;
+
+    // Only transitions touch the eventfd, an accept storm costs one write and one read
+    if (mCompletedConnections.empty())
+        (void)!read(fd, &value, sizeof(value)); // EAGAIN is fine
+    else if (mCompletedConnections.size() == 1)
+        THROW_IF(write(fd, &value, sizeof(value)) != sizeof(value));
+}
+
 void AtpSocket::ConnectionClosed(AtpSocket* socket)
 {
     auto it = mIncompleteConnections.begin();
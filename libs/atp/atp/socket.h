@@ -5,40 +5,71 @@
 #include "eventcore.h"
 #include "posix_socket.h"
 #include "protocol.h"
+#include "ring.h"
 #include "signalling.h"
 #include "types.h"
 #include "nat_resolver.h"
+#include "path_cache.h"
+#include "socket_pool.h"
 
 #include <queue>
 #include <stun/stun.h>
 
+#include <deque>
 #include <expected>
+#include <functional>
 #include <memory>
 #include <netinet/in.h>
-#include <sys/epoll.h>
+#include <optional>
+#include <span>
 #include <sys/socket.h>
+#include <vector>
 
 namespace Atp {
 
 class Context;
 
+// Runtime tunables of a single socket, see the SOL_ATP options in types.h
+struct SocketOptions {
+    int mSendBuffer { static_cast<int>(Config::kRingSize) };
+    int mReceiveBuffer { static_cast<int>(Config::kRingSize) };
+    mseconds_t mKeepAliveInterval { Config::kNatKeepAliveTimeout };
+    mseconds_t mPunchInterval { Config::kPunchInterval };
+    mseconds_t mPunchTimeout { Config::kPunchTimeout };
+    mseconds_t mNatRefreshInterval { Config::kNatCacheTtl };
+    int mProfile { ATP_PROFILE_DEFAULT };
+    struct sockaddr_in mRelayAddress {}; // sin_port 0 for no relay fallback
+
+    static Result<SocketOptions> FromProfile(int profile);
+};
+
 // I don't like the SocketImpl name, but I've spent 30 mins trying to cum up with
 // a better name :skull:
 // HACK: Keep thinking about locking.
-// BUG: stun.QueryAllServers is blocking
 class AtpSocket final {
 private:
     AtpSocket() = default;
     Result<std::unique_ptr<AtpSocket>> CloneForConnection(
         const struct sockaddr_atp* peerAddressAtp,
-        const struct sockaddr_in* peerAddrIn);
+        const struct signal* request);
 
 public:
+    // How bytes move between the application and the engine
+    enum class DataPath {
+        // Unix domain socketpair, the application can use plain read()/write()
+        kSocketpair,
+        // Shared memory SPSC rings (see ring.h), application uses Context::Read/Write
+        kRing
+    };
+
     static Result<std::unique_ptr<AtpSocket>> Create(
         IEventCore* EventCore,
         ISignallingProvider* signallingProvider,
         INatResolver* natResolver,
-        ISocketFactory* socketFactory);
+        ISocketFactory* socketFactory,
+        PathCache* pathCache,
+        DataPath dataPath,
+        std::optional<ResolvedSocket> networkSocket = std::nullopt); // e.g from a SocketPool
 
     AtpSocket(const AtpSocket&) = delete;
     AtpSocket& operator=(const AtpSocket&) = delete;
@@ -50,21 +81,75 @@ public:
 
     int GetApplicationFd();
     const struct sockaddr_atp* GetPeerAddress();
+    RingChannel* GetRingChannel(); // nullptr on the socketpair data path
 
     Error Bind(const struct sockaddr_atp* addr);
     Error Listen(int backlog);
     Result<AtpSocket*> Accept(Context* context);
+    // Accepts up to sockets.size() completed connections at once,
+    // returns how many were accepted (WOULDBLOCK if none)
+    Result<size_t> AcceptMany(Context* context, std::span<AtpSocket*> sockets);
     Error Connect(const struct sockaddr_atp* addr);
 
     Error GetSockOpt(int level, int optname, void* optval, socklen_t* optlen);
     Error SetSockOpt(int level, int optname, const void* optval, socklen_t optlen);
 
+    // DataPath::kSocketpair only, whose application fd is not connected before
+    // ESTABLISHED: takes the early data segment (see mEarlyData) from a write
+    // while punching. WOULDBLOCK once a segment is taken, 0 if the connection
+    // is established already and the fd can be written instead.
+    Result<size_t> WriteEarlyData(const void* buffer, size_t length);
+
+    /* Completion notifications, used by the coroutine API */
+
+    // Completions are invoked exactly once, on the event loop thread
+    using completion_t = std::move_only_function<void(Error)>;
+
+    // Connect() was called, and the connection is neither established nor failed yet
+    bool IsConnecting() const;
+
+    // SUCCESS once the connection is established, an error if punching fails
+    void AwaitConnected(completion_t completion);
+    // Listening sockets: SUCCESS once Accept() has a completed connection to return
+    void AwaitConnection(completion_t completion);
+    // SUCCESS once the application end of the socket is readable (or writable,
+    // with IEventCore::kWritable). At most one read and one write wait at a time.
+    void AwaitApplicationReady(int flags, completion_t completion);
+
 private:
     State mState { State::CLOSED };
+    SocketOptions mOptions {};
     IEventCore* mEventCore {};
     INatResolver* mNatResolver {};
+
+    // The reflexive address is learnt asynchronously, Connect()/Listen() called
+    // before that complete their work from NatResolved()
+    void NatResolved(INatResolver::NatType type, const struct sockaddr_in* reflexiveAddress,
+        int portDelta);
+    // Same, for the re-resolutions NatKeepAliveCallback() runs to catch a moved
+    // mapping, once it is mOptions.mNatRefreshInterval old
+    void NatRefreshed(const struct sockaddr_in* reflexiveAddress, int portDelta);
+    INatResolver::resolution_ident_t mNatResolution {};
+    bool mNatResolved {};
+    uint64_t mNatResolvedMs {}; // when mReflexiveAddress was last confirmed
+    Error mNatError { Error::SUCCESS };
+    struct sockaddr_in mReflexiveAddress {}; // predicted, if mPortDelta != 0
+    int mPortDelta {}; // behind a dependent NAT, see INatResolver
+    std::unique_ptr<struct sockaddr_atp> mPendingConnect {};
     ISocketFactory* mSocketFactory {};
 
+    /* Warm paths, see PathCache */
+
+    // A Connect() to a peer with a cached path adopts its UDP socket and punches
+    // the cached peer address right away. The connect request still goes out, the
+    // listener needs it to create the connection, and if the response beats the
+    // warm path the regular checks take over from it.
+    PathCache* mPathCache {};
+    bool mWarm {};
+
+    void UseWarmPath(WarmPath path);
+    Error StartWarmPunching();
+
     // NOTE: Layering:
     // (1) Application
     // =    (Application socket) -- |
@@ -74,7 +159,14 @@ private:
     // (3) UDP/Kernel
     std::unique_ptr<ISocket> mApplicationSocket {};
     std::unique_ptr<ISocket> mAtpSocket {};
-    std::unique_ptr<ISocket> mNetworkSocket {};
+    // Reads the network socket, which it owns. Shared by a listener with the
+    // connections it accepts, they all use the same UDP socket.
+    std::shared_ptr<Demux> mDemux {};
+
+    // With DataPath::kRing, the rings replace the socketpair above and the
+    // application fd is the ring's application eventfd
+    DataPath mDataPath { DataPath::kSocketpair };
+    std::unique_ptr<RingChannel> mRingChannel {};
 
     /* Active sockets */
 
@@ -82,15 +174,98 @@ private:
 
     // Punching from the server side is done in the new cloned socket object,
     // so not in the passive listening socket object
-    mseconds_t PunchThroughCallback(epoll_data_t data);
+    mseconds_t PunchThroughCallback();
     EventCore::callback_ident_t mPunchThroughCallback {};
-    int mPunchPacketCounter {};
+    // Current gap between punch packets, doubles after every packet
+    mseconds_t mPunchBackoff {};
 
+    std::unique_ptr<RingChannel> MakeRingChannel() const; // sized by mOptions
+    void SetupDataPath(AtpSocket* socket);
     void SetupSocketpair(AtpSocket* socket);
+    void SetupRing(AtpSocket* socket);
+
+    // Engine side of the data path, independent of the DataPath in use.
+    // Both are non-blocking, returning the number of bytes moved.
+    size_t ReadFromApplication(void* buffer, size_t length);
+    size_t WriteToApplication(const void* buffer, size_t length);
 
     void NetworkRecvCallback(const void* buffer, size_t length);
     Demux::callback_ident_t mNetworkRecvCallback {};
 
+    /* Connectivity checks, a stripped down RFC 8445 */
+
+    // Every candidate of the peer is punched at once, the first one to get a
+    // datagram through is nominated as mPeerAddressIn and the others dropped.
+    // Checks go out in pair priority order, but whichever path has the lowest RTT
+    // answers first and wins, e.g the LAN for peers behind the same NAT.
+    //
+    // Behind a dependent NAT the peer sprays the predicted port sequence, always
+    // from our one UDP socket. Birthday-style spraying from many local sockets
+    // (e.g taken from the SocketPool) was dropped:
+    // - A connection lives on the single Demux it was created with, which a
+    //   listener shares with every connection it accepts. Adopting whichever
+    //   socket got through would need the Demux swapped mid-punch.
+    // - The pool only keeps sockets behind an independent NAT. Behind a dependent
+    //   one a socket's mapping towards the peer is unknown until it sends, so the
+    //   sockets would have to be opened per attempt: hundreds of descriptors and
+    //   NAT mappings per connect for even odds, at Config::kPunchSprayBurst a
+    //   punch interval.
+    // - Both sides allocating at random is the case it would help, and the relay
+    //   fallback covers it.
+    struct CheckPair {
+        struct sockaddr_in mRemote;
+        uint64_t mPriority;
+    };
+    std::vector<CheckPair> mCheckPairs {}; // empty once a pair is nominated
+    // One Demux host callback per remote address rather than one per pair, a
+    // predicted candidate alone stands for up to Config::kMaxPredictedPorts pairs
+    std::vector<Demux::callback_ident_t> mCheckCallbacks {};
+    size_t mCheckCursor {}; // next pair to punch, when they exceed a burst
+
+    size_t GatherLocalCandidates(struct signal_candidate* candidates) const;
+    // The controlling socket is the one which sent the connect request
+    Error StartChecks(const struct signal* remote,
+        std::span<const struct signal_candidate> local, bool controlling);
+    // false if source is none of our pairs, e.g another connection from the same host
+    bool CheckRecvCallback(const struct sockaddr_in* source, const void* buffer, size_t length);
+    void ClearCheckPairs();
+    void SprayCheckPairs(const void* datagram, size_t length);
+
+    /* Relay fallback, see relay.h */
+
+    // After Config::kRelayFallbackTimeout of punching, datagrams also go through
+    // the relay. If the relay path answers first the connection is established
+    // over it, but the direct pairs keep being punched until mPunchTimeout and the
+    // connection moves over to the first one which answers.
+    uint64_t mRelayToken {}; // 0 without a relay
+    struct sockaddr_in mRelayAddress {};
+    Demux::callback_ident_t mRelayRecvCallback {}; // set while the relay is in use, by token
+    bool mRelayed {}; // the peer is currently reached through the relay
+
+    Error StartRelay();
+    void StopRelay();
+    void RelayRecvCallback(const struct sockaddr_in* source, const void* buffer, size_t length);
+    void SendRelayDatagram(const void* datagram, size_t length);
+
+    /* 0.5-RTT data */
+
+    // The first segment the application writes before ESTABLISHED rides on every
+    // THRU until the peer acknowledges it, so a request arrives along with the
+    // handshake instead of after it. The receiver holds it until Established(),
+    // and tells retransmissions apart by sequence number. It acks only what the
+    // application had room for, the rest is taken from the next THRU.
+    // The ring is read for it on every THRU. The socketpair is not connected
+    // before ESTABLISHED, so Context::Write() hands it over, see WriteEarlyData().
+    std::vector<std::byte> mEarlyData {}; // sent, not yet acknowledged
+    bool mEarlyDataTaken {}; // at most one segment per connection
+    std::vector<std::byte> mEarlyDataReceived {}; // not acked before Established()
+    bool mPeerSequenceKnown {}; // mAckNumber is set from the first peer datagram
+
+    void TakeEarlyData();
+    void ReceiveEarlyData(const struct atp_hdr* header, const void* payload, size_t length);
+    void DeliverEarlyData(const std::byte* bytes, size_t length);
+    void AckEarlyData(const struct atp_hdr* header);
+
     void NetworkRecvPunch(const struct atp_hdr* header,
         const void* payload, size_t length);
     void NetworkRecvThru(const struct atp_hdr* header,
@@ -98,25 +273,77 @@ private:
     void NetworkRecvEstablished(const struct atp_hdr* header,
         const void* payload, size_t length);
 
-    mseconds_t ApplicationRecvCallback(epoll_data_t data);
+    /* Data transfer */
+
+    // What the application writes is cut into segments of at most
+    // kAtpPayloadMaxLimit bytes, sent while the bytes in flight fit the window
+    // the peer advertises, and kept until cumulatively acknowledged. The receiver
+    // acks every segment and only takes the next one in sequence, so losses are
+    // repaired go-back-N: after Config::kDupAckThreshold duplicate acks, or once
+    // the RTO expires. There is no congestion control, the window is fixed.
+    struct SentSegment {
+        uint32_t mSequence;
+        std::vector<std::byte> mPayload;
+        uint64_t mSentUs;
+        bool mRetransmitted; // Karn's algorithm, no RTT sample from it
+    };
+    std::deque<SentSegment> mSendQueue {}; // in flight, oldest first
+    uint32_t mPeerWindow {}; // as last advertised
+    int mDupAcks {};
+    // The application end is still readable, but the window is full (or early
+    // data is unacknowledged). Resumed by the ack which makes room.
+    bool mApplicationRecvSuspended {};
+
+    // RFC 6298, in microseconds. mSmoothedRttUs is 0 until the first sample.
+    uint64_t mSmoothedRttUs {};
+    uint64_t mRttVarianceUs {};
+    mseconds_t mRto { Config::kRtoInitial };
+    uint64_t mRetransmitDeadlineMs {};
+    EventCore::callback_ident_t mRetransmitCallback {};
+
+    mseconds_t ApplicationRecvCallback();
     EventCore::callback_ident_t mApplicationRecvCallback {};
+    void SendApplicationData();
+    void SuspendApplicationRecv();
+    void ReceiveData(const struct atp_hdr* header, const void* payload, size_t length);
+    void ReceiveAck(const struct atp_hdr* header);
+    void SampleRtt(uint64_t rttUs);
+    void Retransmit(); // everything in flight
+    mseconds_t RetransmitCallback();
+
+    static void NotifyWaiters(std::vector<completion_t>& waiters, Error error);
+    mseconds_t ApplicationReadyCallback(bool writable);
+
+    std::vector<completion_t> mConnectedWaiters {};
+    std::vector<completion_t> mConnectionWaiters {};
+    completion_t mApplicationReadWaiter {};
+    completion_t mApplicationWriteWaiter {};
+    EventCore::callback_ident_t mApplicationReadWait {};
+    EventCore::callback_ident_t mApplicationWriteWait {};
+    // A second descriptor for the application socket, epoll only allows a
+    // single registration per descriptor and reads already use the first one
+    std::unique_ptr<ISocket> mApplicationWriteWatch {};
 
     struct sockaddr_atp mPeerAddressAtp {};
     struct sockaddr_in mPeerAddressIn {};
     // helpers
-    void SendDatagram(const void* datagram, size_t length);
+    void SendDatagram(const void* datagram, size_t length,
+        const struct sockaddr_in* destination); // e.g &mPeerAddressIn
     void SendControlDatagram(union atp_control control);
+    // Over the relay or the direct path, whichever is in use
+    void SendSegment(const struct atp_hdr* header, const void* payload, size_t length);
 
     /* Signalling */
 
-    mseconds_t SignallingRecvCallback(epoll_data_t data);
+    mseconds_t SignallingRecvCallback();
     EventCore::callback_ident_t mSignallingRecvCallback {};
     
+    Error SendConnectRequest(const struct sockaddr_atp* addr);
     void SignallingRecvRequest(const struct signal* request, const struct sockaddr_atp* source);
     void SignallingRecvResponse(const struct signal* response, const struct sockaddr_atp* source);
 
     ISignallingProvider* mSignallingProvider {};
-    int mSignallingSocket { -1 };
+    std::unique_ptr<ISocket> mSignallingSocket {}; // the provider's eventfd, ours to close
     std::unique_ptr<struct sockaddr_atp> mSignallingAddress {};
 
     /* Passive sockets */
@@ -129,6 +356,11 @@ private:
     std::queue<std::unique_ptr<AtpSocket>> mCompletedConnections {};
     std::vector<std::unique_ptr<AtpSocket>> mIncompleteConnections {};
 
+    // The application fd of a listening socket is an eventfd, which is kept
+    // readable exactly while mCompletedConnections is non-empty
+    void SetupListenEvent();
+    void UpdateListenEvent();
+
     void ConnectionEstablished(AtpSocket* socket);
     void ConnectionClosed(AtpSocket* socket);
 
@@ -138,10 +370,31 @@ private:
 
     /* Stats */
 
+    // Only touched on the event loop thread, GetSockOpt(ATP_INFO) included,
+    // so these are plain counters
     struct Stats {
-        long mSocketsAccepted {};
-        long mConnectionsRefused {};
+        uint64_t mKeepAlivesSent {};
+        uint32_t mPunchPacketsSent {};
+        uint64_t mPunchStartMs {};
+        uint32_t mPunchDurationMs {};
+        uint64_t mSignallingSentMs {};
+        mseconds_t mSignallingRttMs { -1 }; // active sockets, -1 until the response
+        uint64_t mSocketsAccepted {};
+        uint64_t mConnectionsRefused {};
+        uint64_t mConnectionsEstablished {};
+        uint64_t mRetransmits {};
+        uint64_t mDupAcks {};
+        uint64_t mReordered {};
     } mStats;
+
+    // Keeps the NAT mapping of the UDP socket open while nothing else goes out
+    mseconds_t NatKeepAliveCallback();
+    EventCore::callback_ident_t mNatKeepAliveCallback {};
+
+    void StartPunching();
+    void MaybeStopPunching(); // once nothing is left for PunchThroughCallback to do
+    void Established();
+    Error GetInfo(struct atp_info* info);
 };
 
 }
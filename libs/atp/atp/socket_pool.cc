@@ -0,0 +1,133 @@
+#include "socket_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sys/socket.h>
+
+namespace Atp {
+
+static uint64_t GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+SocketPool::SocketPool(IEventCore* eventCore, INatResolver* natResolver,
+    ISocketFactory* socketFactory, size_t size)
+    : mEventCore { eventCore }
+    , mNatResolver { natResolver }
+    , mSocketFactory { socketFactory }
+    , mSize { size }
+{
+    if (mSize == 0)
+        return;
+
+    // The first invocation fills the pool
+    THROW_IF((mRefreshCallback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+                  [this](void*) -> mseconds_t {
+                      return RefreshCallback();
+                  },
+                  nullptr))
+        == 0);
+}
+
+SocketPool::~SocketPool()
+{
+    for (auto& entry : mEntries)
+        if (entry->mResolution)
+            mNatResolver->Cancel(entry->mResolution);
+    if (mRefreshCallback)
+        mEventCore->DeleteCallback(mRefreshCallback);
+}
+
+std::optional<ResolvedSocket> SocketPool::Take()
+{
+    // An entry being refreshed still has a perfectly usable mapping, but prefer
+    // one which is not
+    auto it = std::find_if(mEntries.begin(), mEntries.end(), [](const auto& entry) {
+        return entry->mResolved && !entry->mResolution;
+    });
+    if (it == mEntries.end())
+        it = std::find_if(mEntries.begin(), mEntries.end(), [](const auto& entry) {
+            return entry->mResolved;
+        });
+    if (it == mEntries.end())
+        return std::nullopt;
+
+    std::unique_ptr<Entry> entry = std::move(*it);
+    *it = std::move(mEntries.back());
+    mEntries.pop_back();
+
+    if (entry->mResolution)
+        mNatResolver->Cancel(entry->mResolution);
+
+    Refill();
+    return ResolvedSocket { std::move(entry->mSocket), entry->mReflexiveAddress };
+}
+
+void SocketPool::Refill()
+{
+    while (mEntries.size() < mSize) {
+        std::unique_ptr<ISocket> socket = mSocketFactory->Socket(AF_INET, SOCK_DGRAM, 0);
+        if (socket == nullptr)
+            return;
+
+        mEntries.push_back(std::make_unique<Entry>(Entry { .mSocket = std::move(socket) }));
+        if (!Resolve(mEntries.back().get()))
+            return;
+    }
+}
+
+bool SocketPool::Resolve(Entry* entry)
+{
+    entry->mResolution = mNatResolver->Resolve(entry->mSocket.get(),
+        [this, entry](INatResolver::NatType type, const struct sockaddr_in* reflexiveAddress, int) {
+            Resolved(entry, type, reflexiveAddress);
+        });
+
+    // Dropped, the next refresh tries again
+    if (entry->mResolution == 0) {
+        std::erase_if(mEntries, [entry](const auto& e) { return e.get() == entry; });
+        return false;
+    }
+    return true;
+}
+
+void SocketPool::Resolved(Entry* entry, INatResolver::NatType type,
+    const struct sockaddr_in* reflexiveAddress)
+{
+    entry->mResolution = 0;
+
+    // Behind a dependent NAT (or with STUN unreachable) a pooled mapping is of
+    // no use to anyone, a predicted port goes stale as soon as anything else
+    // behind the NAT opens a mapping. Dropped and refilled on the next refresh.
+    // Hence no spraying from pooled sockets either, see AtpSocket::CheckPair.
+    if (type != INatResolver::NatType::kIndependent) {
+        std::erase_if(mEntries, [entry](const auto& e) { return e.get() == entry; });
+        return;
+    }
+
+    entry->mResolved = true;
+    entry->mResolvedMs = GetTimeMs();
+    entry->mReflexiveAddress = *reflexiveAddress;
+}
+
+mseconds_t SocketPool::RefreshCallback()
+{
+    uint64_t now = GetTimeMs();
+
+    // Resolve() may drop entries, so walk a snapshot
+    std::vector<Entry*> stale;
+    for (auto& entry : mEntries)
+        if (entry->mResolved && !entry->mResolution
+            && now - entry->mResolvedMs >= Config::kSocketPoolRefreshInterval)
+            stale.push_back(entry.get());
+    for (Entry* entry : stale)
+        Resolve(entry);
+
+    Refill();
+    return Config::kSocketPoolRefreshInterval;
+}
+
+}
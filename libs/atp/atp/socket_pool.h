@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+#include "eventcore.h"
+#include "nat_resolver.h"
+#include "posix_socket.h"
+
+#include <memory>
+#include <netinet/in.h>
+#include <optional>
+#include <vector>
+
+namespace Atp {
+
+// UDP socket whose NAT mapping is already known
+struct ResolvedSocket {
+    std::unique_ptr<ISocket> mSocket;
+    struct sockaddr_in mReflexiveAddress;
+};
+
+// Keeps up to `size` UDP sockets bound and STUN-resolved ahead of time, so that
+// Context::Socket() can hand out a socket whose Connect() goes straight to
+// signalling instead of first waiting a STUN round trip.
+//
+// Idle sockets are re-resolved every Config::kSocketPoolRefreshInterval. With the
+// NAT type cached by the resolver that is a single request, which both keeps the
+// mapping alive and notices when it changed (e.g the network did).
+//
+// Event loop thread only.
+class SocketPool final {
+public:
+    SocketPool(IEventCore* eventCore, INatResolver* natResolver,
+        ISocketFactory* socketFactory, size_t size);
+    ~SocketPool();
+
+    SocketPool(const SocketPool&) = delete;
+    SocketPool& operator=(const SocketPool&) = delete;
+
+    // A resolved socket if one is ready, the pool starts refilling right away
+    std::optional<ResolvedSocket> Take();
+
+private:
+    struct Entry {
+        std::unique_ptr<ISocket> mSocket;
+        struct sockaddr_in mReflexiveAddress {};
+        bool mResolved {};
+        uint64_t mResolvedMs {};
+        INatResolver::resolution_ident_t mResolution {};
+    };
+
+    void Refill();
+    bool Resolve(Entry* entry); // false if the entry had to be dropped
+    void Resolved(Entry* entry, INatResolver::NatType type,
+        const struct sockaddr_in* reflexiveAddress);
+    mseconds_t RefreshCallback();
+
+    IEventCore* mEventCore;
+    INatResolver* mNatResolver;
+    ISocketFactory* mSocketFactory;
+    size_t mSize;
+
+    // Resolved or being (re-)resolved. unique_ptr, resolutions capture the Entry.
+    std::vector<std::unique_ptr<Entry>> mEntries;
+    IEventCore::callback_ident_t mRefreshCallback {};
+};
+
+}
@@ -0,0 +1,90 @@
+#include "types.h"
+
+#include <cerrno>
+
+namespace Atp {
+
+const char* Strerror(Error err)
+{
+    switch (err) {
+    case Error::SUCCESS:
+        return "Success";
+    case Error::UNKNOWN:
+        return "Unknown error";
+    case Error::ACCESS:
+        return "Permission denied";
+    case Error::AFNOSUPPORT:
+        return "Address family not supported";
+    case Error::INVAL:
+        return "Invalid argument";
+    case Error::MFILE:
+        return "Too many open files in process";
+    case Error::NFILE:
+        return "Too many open files in system";
+    case Error::NOMEM:
+        return "Out of memory";
+    case Error::PROTONOSUPPORT:
+        return "Protocol not supported";
+    case Error::MAXSOCKETS:
+        return "Too many ATP sockets";
+    case Error::NATQUERYFAILURE:
+        return "Failed to query NAT type";
+    case Error::NATDEPENDENT:
+        return "NAT has endpoint-dependent mapping";
+    case Error::EVENTCORE:
+        return "Event core failure";
+    case Error::SIGNALLINGPROVIDER:
+        return "Signalling provider failure";
+    case Error::BADFD:
+        return "Bad file descriptor";
+    case Error::ALREADYSET:
+        return "Already set";
+    case Error::NOTBOUND:
+        return "Socket not bound";
+    case Error::DEMUX:
+        return "Demultiplexer failure";
+    case Error::WOULDBLOCK:
+        return "Operation would block";
+    case Error::TIMEDOUT:
+        return "Connection timed out";
+    case Error::NOPROTOOPT:
+        return "Protocol not available";
+    }
+    return "Unknown error";
+}
+
+Error ErrnoToErrorCode(int errnum)
+{
+    switch (errnum) {
+    case 0:
+        return Error::SUCCESS;
+    case EACCES:
+    case EPERM:
+        return Error::ACCESS;
+    case EAFNOSUPPORT:
+        return Error::AFNOSUPPORT;
+    case EINVAL:
+        return Error::INVAL;
+    case EMFILE:
+        return Error::MFILE;
+    case ENFILE:
+        return Error::NFILE;
+    case ENOMEM:
+    case ENOBUFS:
+        return Error::NOMEM;
+    case EPROTONOSUPPORT:
+        return Error::PROTONOSUPPORT;
+    case EBADF:
+        return Error::BADFD;
+    case EAGAIN:
+        return Error::WOULDBLOCK;
+    case ETIMEDOUT:
+        return Error::TIMEDOUT;
+    case ENOPROTOOPT:
+        return Error::NOPROTOOPT;
+    default:
+        return Error::UNKNOWN;
+    }
+}
+
+}
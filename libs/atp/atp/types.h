@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <expected>
 #include <sys/socket.h>
 #include <type_traits>
@@ -10,7 +11,62 @@ namespace Atp {
 // Because I think protocol.h = internal stuff
 // types.h = stuff exposed to atp user
 enum {
-    IPPROTO_ATP = 111
+    IPPROTO_ATP = 111,
+    SOL_ATP = IPPROTO_ATP // level for Context::GetSockOpt/SetSockOpt
+};
+
+// SOL_ATP options, all of them take an int.
+// Accepted sockets inherit the options of their listening socket.
+enum {
+    ATP_SNDBUF = 1, // bytes, application -> network buffering
+    ATP_RCVBUF, // bytes, network -> application buffering, also bounds the advertised window
+    ATP_KEEPALIVE_INTERVAL, // ms, NAT keepalive
+    ATP_PUNCH_INTERVAL, // ms, cap of the exponential backoff between punch attempts
+    ATP_PUNCH_TIMEOUT, // ms, give up punching after this long
+    ATP_NAT_REFRESH_INTERVAL, // ms, listening and idle sockets re-resolve their NAT mapping after this long
+    ATP_PROFILE, // ATP_PROFILE_*, setting it overwrites every option above
+    ATP_INFO, // read-only, struct atp_info
+    ATP_RELAY // struct sockaddr_in, relay to fall back to when punching fails, port 0 for none
+};
+
+// ATP_INFO, modelled on TCP_INFO. Cheap enough to sample every connection
+// periodically. Only what the engine actually measures: there is no congestion
+// control and no pacing, so no ssthresh or pacing rate either.
+struct atp_info {
+    uint8_t atpi_state; // Atp::State
+    uint8_t atpi_relayed; // 1 while the connection runs through the relay
+    uint8_t atpi_pad[2];
+
+    uint32_t atpi_rcv_wnd; // bytes, the window advertised to the peer
+
+    uint32_t atpi_rcv_queued; // bytes waiting for the application to read them
+    uint32_t atpi_snd_queued; // bytes written by the application, not yet taken by the engine
+
+    uint32_t atpi_punch_duration_ms; // Connect()/SYN to ESTABLISHED
+    uint32_t atpi_punch_packets_sent;
+    uint64_t atpi_keepalives_sent;
+
+    // Data transfer, RFC 6298 estimators
+    uint32_t atpi_rtt; // us, smoothed, 0 until the first sample
+    uint32_t atpi_rttvar; // us
+    uint32_t atpi_rto; // ms
+    uint32_t atpi_snd_cwnd; // bytes, the fixed window: min(peer window, ATP_SNDBUF)
+    uint32_t atpi_unacked; // bytes in flight
+    uint32_t atpi_unacked_segs;
+    uint64_t atpi_retransmits; // segments sent again, on RTO or duplicate acks
+    uint64_t atpi_dup_acks; // received
+    uint64_t atpi_reordering; // segments received beyond a gap, and dropped
+
+    // Listening sockets
+    uint64_t atpi_sockets_accepted;
+    uint64_t atpi_connections_refused;
+    uint64_t atpi_connections_established; // accepted or still queued
+};
+
+enum {
+    ATP_PROFILE_DEFAULT = 0,
+    ATP_PROFILE_LOW_LATENCY, // 64 KB buffers, punch interval 250 ms, punch timeout 30 s
+    ATP_PROFILE_BULK // 4 MB buffers
 };
 
 struct __attribute__((packed)) sockaddr_atp {
@@ -39,6 +95,8 @@ enum class Error : int {
     NOTBOUND = -16,
     DEMUX = -17,
     WOULDBLOCK = -18,
+    TIMEDOUT = -19,
+    NOPROTOOPT = -20,
 };
 
 // https://www.learncpp.com/cpp-tutorial/scoped-enumerations-enum-classes/#operatorplus
@@ -0,0 +1,118 @@
+#include "endpoint_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/format.h>
+#include <netdb.h>
+#include <plog/Log.h>
+#include <string.h>
+#include <sys/socket.h>
+
+namespace Stun {
+
+EndpointCache::EndpointCache(std::vector<Endpoint> endpoints, uint64_t ttlMs)
+    : mEndpoints { std::move(endpoints) }
+    , mTtlMs { ttlMs }
+    , mEntries(mEndpoints.size())
+    , mThread { &EndpointCache::Run, this }
+{
+}
+
+EndpointCache::~EndpointCache()
+{
+    {
+        std::lock_guard lock { mMutex };
+        mStop = true;
+    }
+    mStopCondition.notify_one();
+    // NOTE: A lookup in progress is waited for, getaddrinfo() can't be interrupted
+    mThread.join();
+}
+
+std::vector<struct sockaddr_in> EndpointCache::Get() const
+{
+    uint64_t now = GetTimeMs();
+    std::vector<struct sockaddr_in> addresses;
+
+    std::lock_guard lock { mMutex };
+    for (auto& entry : mEntries)
+        if (entry.mExpiresMs > now)
+            addresses.push_back(entry.mAddress);
+    return addresses;
+}
+
+bool EndpointCache::IsReady() const
+{
+    std::lock_guard lock { mMutex };
+    return mReady;
+}
+
+void EndpointCache::Run()
+{
+    std::unique_lock lock { mMutex };
+    while (!mStop) {
+        uint64_t now = GetTimeMs();
+        for (size_t i = 0; i < mEndpoints.size() && !mStop; i++) {
+            if (mEntries[i].mRefreshMs > now)
+                continue;
+
+            // Looked up without the lock, Get() must not wait on DNS
+            lock.unlock();
+            struct sockaddr_in address;
+            int ret = Lookup(mEndpoints[i], &address);
+            lock.lock();
+
+            now = GetTimeMs();
+            if (ret == 0) {
+                mEntries[i].mAddress = address;
+                mEntries[i].mExpiresMs = now + mTtlMs;
+                mEntries[i].mRefreshMs = now + mTtlMs / 2;
+            } else {
+                mEntries[i].mRefreshMs = now + kRetryMs;
+            }
+        }
+        mReady = true;
+
+        uint64_t next = UINT64_MAX;
+        for (auto& entry : mEntries)
+            next = std::min(next, entry.mRefreshMs);
+        if (next == UINT64_MAX)
+            break; // no endpoints at all
+
+        now = GetTimeMs();
+        mStopCondition.wait_for(lock, std::chrono::milliseconds(next > now ? next - now : 0),
+            [this]() { return mStop; });
+    }
+}
+
+int EndpointCache::Lookup(const Endpoint& endpoint, struct sockaddr_in* address)
+{
+    struct addrinfo hints;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* res;
+    int ret = getaddrinfo(endpoint.mHostname.c_str(), endpoint.mPort.c_str(), &hints, &res);
+    if (ret != 0) {
+        PLOG_WARNING << fmt::format("Stun::EndpointCache getaddrinfo failed for {}:{}, {}",
+            endpoint.mHostname, endpoint.mPort, gai_strerror(ret));
+        return -1;
+    }
+
+    // Like Client, only the first address of a multihomed server
+    THROW_IF(res == nullptr);
+    THROW_IF(res->ai_family != AF_INET);
+    memcpy(address, res->ai_addr, sizeof(*address));
+    freeaddrinfo(res);
+    return 0;
+}
+
+uint64_t EndpointCache::GetTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "stun.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+namespace Stun {
+
+// Resolves STUN endpoints on a helper thread, so that getaddrinfo() never runs on
+// the caller's (event loop) thread.
+//
+// getaddrinfo() does not expose the record TTL, so every address is trusted for
+// a fixed ttlMs. Addresses are refreshed in the background once half of it has
+// passed. A failed refresh keeps the old address until it expires, and is
+// retried every kRetryMs.
+class EndpointCache final {
+public:
+    inline static const uint64_t kDefaultTtlMs { 10 * 60 * 1000 };
+    inline static const uint64_t kRetryMs { 5 * 1000 };
+
+    explicit EndpointCache(std::vector<Endpoint> endpoints, uint64_t ttlMs = kDefaultTtlMs);
+    ~EndpointCache();
+
+    EndpointCache(const EndpointCache&) = delete;
+    EndpointCache& operator=(const EndpointCache&) = delete;
+
+    // Never blocks, thread-safe. Addresses which have not expired, in endpoint
+    // order. Empty until the first lookups complete.
+    std::vector<struct sockaddr_in> Get() const;
+    // Whether every endpoint has been looked up at least once, successfully or not
+    bool IsReady() const;
+
+private:
+    struct Entry {
+        struct sockaddr_in mAddress {};
+        uint64_t mExpiresMs {}; // 0 until resolved
+        uint64_t mRefreshMs {}; // next lookup is due
+    };
+
+    void Run();
+    static int Lookup(const Endpoint& endpoint, struct sockaddr_in* address);
+    static uint64_t GetTimeMs();
+
+    const std::vector<Endpoint> mEndpoints;
+    const uint64_t mTtlMs;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mStopCondition;
+    bool mStop {};
+    bool mReady {};
+    std::vector<Entry> mEntries; // parallel to mEndpoints
+
+    std::thread mThread; // last, started once everything above is
+};
+
+}
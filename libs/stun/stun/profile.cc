@@ -0,0 +1,117 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <fstream>
+#include <netinet/in.h>
+#include <plog/Log.h>
+#include <sstream>
+#include <string>
+#include <strings.h>
+
+namespace Stun {
+
+int LoadProfile(const std::string& path, Profile* profile)
+{
+    std::ifstream file(path);
+    if (!file)
+        return -1;
+
+    Profile loaded {};
+    bool hasNatType = false;
+    bool hasPublicAddress = false;
+
+    std::string line;
+    if (!std::getline(file, line))
+        return -1;
+    {
+        std::istringstream header(line);
+        std::string magic;
+        int version;
+        if (!(header >> magic >> version) || magic != "stun-profile" || version != Profile::kVersion) {
+            PLOG_INFO << "Stun::LoadProfile ignoring " << path << ", unknown format or version";
+            return -1;
+        }
+    }
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        if (!(fields >> key))
+            continue;
+
+        if (key == "nat") {
+            int type;
+            if (!(fields >> type) || type < static_cast<int>(NatType::kUnknown)
+                || type > static_cast<int>(NatType::kDependent))
+                return -1;
+            loaded.mNatType = static_cast<NatType>(type);
+            hasNatType = true;
+        } else if (key == "public") {
+            std::string address;
+            if (!(fields >> address) || inet_pton(AF_INET, address.c_str(), &loaded.mPublicAddress) != 1)
+                return -1;
+            hasPublicAddress = true;
+        } else if (key == "server") {
+            std::string address;
+            int port;
+            int64_t rtt;
+            Client::ServerResult server;
+            bzero(&server.mAddress, sizeof(server.mAddress));
+            if (!(fields >> address >> port >> rtt) || port <= 0 || port > UINT16_MAX
+                || inet_pton(AF_INET, address.c_str(), &server.mAddress.sin_addr) != 1)
+                return -1;
+            server.mAddress.sin_family = AF_INET;
+            server.mAddress.sin_port = htons(static_cast<uint16_t>(port));
+            server.mRttMs = rtt;
+            loaded.mServers.push_back(server);
+        }
+        // Unknown keys are skipped, so newer writers can add optional lines
+    }
+
+    if (!hasNatType || !hasPublicAddress || loaded.mServers.empty())
+        return -1;
+
+    *profile = std::move(loaded);
+    return 0;
+}
+
+int SaveProfile(const std::string& path, const Profile& profile)
+{
+    // Fastest answering servers first, silent ones last
+    std::vector<Client::ServerResult> servers = profile.mServers;
+    std::stable_sort(servers.begin(), servers.end(),
+        [](const Client::ServerResult& a, const Client::ServerResult& b) {
+            if ((a.mRttMs < 0) != (b.mRttMs < 0))
+                return a.mRttMs >= 0;
+            return a.mRttMs < b.mRttMs;
+        });
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file)
+            return -1;
+
+        char address[INET_ADDRSTRLEN];
+        file << "stun-profile " << Profile::kVersion << "\n";
+        file << "nat " << static_cast<int>(profile.mNatType) << "\n";
+        file << "public " << inet_ntop(AF_INET, &profile.mPublicAddress, address, sizeof(address)) << "\n";
+        for (auto& server : servers) {
+            file << "server " << inet_ntop(AF_INET, &server.mAddress.sin_addr, address, sizeof(address))
+                 << " " << ntohs(server.mAddress.sin_port) << " " << server.mRttMs << "\n";
+        }
+
+        if (!file.flush())
+            return -1;
+    }
+
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "stun.h"
+
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+namespace Stun {
+
+// What Client learnt about the network, persisted so that a restarted process
+// can validate it with a single request instead of classifying the NAT again.
+//
+// Stored as a small text file:
+//     stun-profile <version>
+//     nat <NatType as integer>
+//     public <ipv4>
+//     server <ipv4> <port> <rtt ms>
+//     ...
+// A file with any other version is treated as missing.
+struct Profile {
+    static constexpr int kVersion = 1;
+
+    NatType mNatType { NatType::kUnknown };
+    struct in_addr mPublicAddress {}; // port is per socket, so not kept
+    std::vector<Client::ServerResult> mServers {}; // fastest first
+};
+
+// Both return 0 on success, -1 otherwise. SaveProfile replaces the file
+// atomically, a concurrent reader sees either the old or the new profile.
+int LoadProfile(const std::string& path, Profile* profile);
+int SaveProfile(const std::string& path, const Profile& profile);
+
+}
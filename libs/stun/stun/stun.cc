@@ -1,10 +1,12 @@
 #include "stun.h"
+#include "endpoint_cache.h"
 
+#include <algorithm>
+#include <array>
 #include <cerrno>
 #include <chrono>
 #include <cmath>
 #include <cstdint>
-#include <ctime>
 #include <fmt/format.h>
 #include <iostream>
 #include <netdb.h>
@@ -12,10 +14,68 @@
 #include <plog/Log.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 namespace Stun {
 
+// RFC 5389 15.5
+static constexpr uint32_t kFingerprintXor { 0x5354554E };
+
+// CRC-32 of IEEE 802.3 (reflected polynomial 0xEDB88320), as FINGERPRINT uses.
+// NOTE: SSE4.2's crc32 instruction computes CRC-32C, a different polynomial, and
+// PCLMUL folding only pays off past 64 bytes or so, more than most STUN messages.
+// x86 gets slicing-by-8 tables, ARMv8 its crc32 instructions (IEEE polynomial).
+static constexpr auto kCrc32Tables = [] {
+    std::array<std::array<uint32_t, 256>, 8> tables {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        tables[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+        for (uint32_t i = 0; i < 256; i++)
+            tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+    return tables;
+}();
+
+uint32_t Crc32(const void* data, size_t length)
+{
+    const uint8_t* ptr = static_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+
+#if defined(__ARM_FEATURE_CRC32)
+    for (; length >= 8; ptr += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        crc = __crc32d(crc, word);
+    }
+    for (; length > 0; ptr++, length--)
+        crc = __crc32b(crc, *ptr);
+#else
+    const auto& t = kCrc32Tables;
+    auto load32 = [](const uint8_t* p) -> uint32_t {
+        // Byte order independent, compiles to a single load on little endian
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    };
+    for (; length >= 8; ptr += 8, length -= 8) {
+        uint32_t low = load32(ptr) ^ crc;
+        uint32_t high = load32(ptr + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+    for (; length > 0; ptr++, length--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *ptr) & 0xFF];
+#endif
+
+    return ~crc;
+}
+
 bool IsStunMessage(const void* buffer, size_t length)
 {
     if (length < sizeof(Header))
@@ -39,32 +99,127 @@ bool IsStunMessage(const void* buffer, size_t length)
     return true;
 }
 
+TransactionIdGenerator::TransactionIdGenerator()
+{
+    // An all-zero state would only ever produce zeroes
+    do
+        THROW_IF(getrandom(mState, sizeof(mState), 0) != sizeof(mState));
+    while ((mState[0] | mState[1] | mState[2] | mState[3]) == 0);
+}
+
+uint64_t TransactionIdGenerator::NextU64()
+{
+    auto rotl = [](uint64_t x, int k) { return (x << k) | (x >> (64 - k)); };
+
+    uint64_t result = rotl(mState[1] * 5, 7) * 9;
+    uint64_t t = mState[1] << 17;
+    mState[2] ^= mState[0];
+    mState[3] ^= mState[1];
+    mState[1] ^= mState[2];
+    mState[0] ^= mState[3];
+    mState[2] ^= t;
+    mState[3] = rotl(mState[3], 45);
+    return result;
+}
+
+TransactionId TransactionIdGenerator::Next()
+{
+    // big endian = little endian for uint8_t, the byte order of the words is moot
+    uint64_t words[2] = { NextU64(), NextU64() };
+    TransactionId id;
+    memcpy(id.mId, words, sizeof(id.mId));
+    return id;
+}
+
 MessageBuilder::MessageBuilder(uint16_t messageType)
+    : MessageBuilder(messageType, [] {
+        thread_local TransactionIdGenerator generator;
+        return generator.Next();
+    }())
+{
+}
+
+MessageBuilder::MessageBuilder(uint16_t messageType, TransactionId transactionId)
+    : MessageBuilder(mStorage, sizeof(mStorage), messageType, transactionId)
+{
+}
+
+MessageBuilder::MessageBuilder(void* buffer, size_t bufferLength, uint16_t messageType,
+    TransactionId transactionId)
+    : mBuffer { static_cast<uint8_t*>(buffer) }
+    , mBufferLength { bufferLength }
+    , mLength { sizeof(Header) }
 {
-    mMessage = malloc(sizeof(Header));
+    THROW_IF(mBufferLength < sizeof(Header));
 
-    Header* header = reinterpret_cast<Header*>(mMessage);
+    Header* header = reinterpret_cast<Header*>(mBuffer);
     header->mMessageType = htons(messageType);
     header->mMessageLength = htons(0);
     header->mMagicCookie = htonl(kHeader::MagicCookie);
+    header->mTransactionId = transactionId;
+}
 
-    std::srand(std::time({}));
-    for (int i = 0; i < 12; i++) {
-        // big endian = little endian for uint8_t
-        header->mTransactionId.mId[i] = std::rand() % (UINT8_MAX + 1);
-    }
+int MessageBuilder::AddAttribute(const Attribute& attribute)
+{
+    if (mFingerprinted)
+        return -1;
 
-    mLength = sizeof(Header);
+    size_t paddedLength = (attribute.mLength + 3) & ~static_cast<size_t>(3);
+    size_t totalLength = 2 * sizeof(uint16_t) + paddedLength; // mType, mLength
+    if (mBufferLength - mLength < totalLength
+        || mLength + totalLength - sizeof(Header) > UINT16_MAX)
+        return -1;
+
+    uint8_t* ptr = mBuffer + mLength;
+    uint16_t type = htons(attribute.mType);
+    uint16_t length = htons(attribute.mLength);
+    memcpy(ptr, &type, sizeof(type));
+    memcpy(ptr + sizeof(type), &length, sizeof(length));
+    ptr += sizeof(type) + sizeof(length);
+    if (attribute.mLength > 0)
+        memcpy(ptr, attribute.mValue, attribute.mLength);
+    // RFC 5389 15: padding MUST be ignored by receivers, zeroes anyway
+    memset(ptr + attribute.mLength, 0, paddedLength - attribute.mLength);
+
+    mLength += totalLength;
+    Header* header = reinterpret_cast<Header*>(mBuffer);
+    header->mMessageLength = htons(mLength - sizeof(Header));
+    return 0;
 }
 
-MessageBuilder::~MessageBuilder()
+int MessageBuilder::AddSoftware(std::string_view software)
 {
-    free(mMessage);
+    // RFC 5389 15.10: fewer than 128 characters, at most 763 bytes of UTF-8
+    if (software.size() > 763)
+        return -1;
+
+    Attribute attribute { .mType = kAttribute::Optional::Software,
+        .mLength = static_cast<uint16_t>(software.size()),
+        .mValue = (uint8_t*)software.data() };
+    return AddAttribute(attribute);
+}
+
+int MessageBuilder::AddFingerprint()
+{
+    // The header length must already count the FINGERPRINT when the CRC is taken
+    uint32_t placeholder = 0;
+    Attribute attribute { .mType = kAttribute::Optional::Fingerprint,
+        .mLength = sizeof(placeholder),
+        .mValue = (uint8_t*)&placeholder };
+    if (AddAttribute(attribute) != 0)
+        return -1;
+
+    uint32_t fingerprint = htonl(Crc32(mBuffer, mLength - sizeof(Attribute::mType)
+                                       - sizeof(Attribute::mLength) - sizeof(placeholder))
+        ^ kFingerprintXor);
+    memcpy(mBuffer + mLength - sizeof(fingerprint), &fingerprint, sizeof(fingerprint));
+    mFingerprinted = true;
+    return 0;
 }
 
 const void* MessageBuilder::GetMessage() const
 {
-    return mMessage;
+    return mBuffer;
 }
 
 size_t MessageBuilder::GetMessageSize() const
@@ -74,9 +229,7 @@ size_t MessageBuilder::GetMessageSize() const
 
 TransactionId MessageBuilder::GetTransactionId() const
 {
-    Header* header = (Header*)mMessage;
-    TransactionId id;
-    memcpy(&id, &header->mTransactionId, sizeof(id));
+    const Header* header = reinterpret_cast<const Header*>(mBuffer);
     return header->mTransactionId;
 }
 
@@ -86,7 +239,11 @@ MessageReader::MessageReader(const void* buffer, size_t length)
     , mCurrent { static_cast<const char*>(buffer) }
     , mCurrentLength { length }
 {
-    THROW_IF(mCurrentLength < sizeof(Header));
+    if (mCurrentLength < sizeof(Header)) {
+        mMalformed = true;
+        mCurrentLength = 0;
+        return;
+    }
     mCurrent += sizeof(Header);
     mCurrentLength -= sizeof(Header);
 }
@@ -101,7 +258,11 @@ const Attribute* MessageReader::Next()
     if (mCurrentLength == 0)
         return nullptr;
 
-    THROW_IF(mCurrentLength < 2 * sizeof(uint16_t));
+    if (mCurrentLength < 2 * sizeof(uint16_t)) {
+        mMalformed = true;
+        mCurrentLength = 0;
+        return nullptr;
+    }
 
     Attribute* ptr = (Attribute*)mCurrent;
     mCurrentAttribute.mType = ntohs(ptr->mType);
@@ -109,24 +270,33 @@ const Attribute* MessageReader::Next()
     mCurrentAttribute.mValue = (uint8_t*)(mCurrent + offsetof(Attribute, mValue));
 
     size_t totalAttributeLength = mCurrentAttribute.mLength;
-    totalAttributeLength += (totalAttributeLength) % 4; // Length field does not include padding
+    totalAttributeLength += (4 - totalAttributeLength % 4) % 4; // Length field does not include padding
     totalAttributeLength += sizeof(uint16_t) + sizeof(uint16_t); // mType, mLength
 
-    THROW_IF(mCurrentLength < totalAttributeLength);
+    if (mCurrentLength < totalAttributeLength) {
+        mMalformed = true;
+        mCurrentLength = 0;
+        return nullptr;
+    }
     mCurrent += totalAttributeLength;
     mCurrentLength -= totalAttributeLength;
 
     return &mCurrentAttribute;
 }
 
+bool MessageReader::Malformed() const
+{
+    return mMalformed;
+}
+
 int MessageReader::ParseXorMappedAddress(const Attribute* attribute,
     struct sockaddr* address, socklen_t* addressLength)
 {
     if (attribute->mType != kAttribute::Required::XorMappedAddress)
         return -1;
 
-    THROW_IF(attribute->mLength < sizeof(MappedAddressIPv4));
-    THROW_IF(attribute->mValue == nullptr);
+    if (attribute->mLength < sizeof(MappedAddressIPv4) || attribute->mValue == nullptr)
+        return -1;
     MappedAddressIPv4* ptr = reinterpret_cast<MappedAddressIPv4*>(attribute->mValue);
 
     if (ptr->mZero != 0)
@@ -151,6 +321,19 @@ int MessageReader::ParseXorMappedAddress(const Attribute* attribute,
     return 0;
 }
 
+bool MessageReader::CheckFingerprint(const Attribute* attribute) const
+{
+    const uint8_t* begin = static_cast<const uint8_t*>(mBuffer);
+    size_t offset = attribute->mValue - begin; // of the value
+    if (attribute->mLength != sizeof(uint32_t) || offset + sizeof(uint32_t) != mBufferLength)
+        return false;
+
+    uint32_t fingerprint;
+    memcpy(&fingerprint, attribute->mValue, sizeof(fingerprint));
+    offset -= sizeof(Attribute::mType) + sizeof(Attribute::mLength);
+    return ntohl(fingerprint) == (Crc32(begin, offset) ^ kFingerprintXor);
+}
+
 Client::Client(int sockfd)
     : Client(sockfd, kDefaultServers, kDefaultTimeout)
 {
@@ -167,16 +350,15 @@ Client::Client(int sockfd, const std::vector<Endpoint>& servers, Timeout timeout
     , mNatType { NatType::kUnknown }
     , mTimeout { timeout }
 {
-    std::srand(std::time({}));
-
     bzero(&mReflexiveAddress, sizeof(mReflexiveAddress));
     // To represent an empty sockaddr_in structure
     mReflexiveAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    bzero(&mLastMappedAddress, sizeof(mLastMappedAddress));
 
     // RFC 5389 7.2.1
     mStunTtlMs = 0;
     uint64_t rto = mTimeout.mTimeoutMs;
-    for (int i = 0; i < mTimeout.mMaxRetransmissions; i++) {
+    for (uint64_t i = 0; i < mTimeout.mMaxRetransmissions; i++) {
         mStunTtlMs += rto;
         rto *= 2;
     }
@@ -185,136 +367,274 @@ Client::Client(int sockfd, const std::vector<Endpoint>& servers, Timeout timeout
 
 int Client::QueryAllServers()
 {
+    // NOTE: Every datagram read here is consumed, STUN or not. Fine for a socket
+    // nothing else uses, anything sharing it must drive the event-driven API.
+    int64_t timeout = Start();
+
+    struct pollfd fd;
+    fd.fd = mSockfd;
+    fd.events = POLLIN;
+
+    while (timeout >= 0) {
+        errno = 0;
+        int pollret = poll(&fd, 1, static_cast<int>(timeout));
+
+        if (pollret == -1) {
+            if (errno == EINTR)
+                continue;
+            PLOG_WARNING << "Stun::Client::QueryAllServers poll failed - " << strerror(errno);
+            return -1;
+        }
+
+        if (pollret > 0) {
+            char buffer[kMtu];
+            errno = 0;
+            struct sockaddr_in source;
+            socklen_t sourceLength = sizeof(source);
+            ssize_t ret;
+            while ((ret = recvfrom(mSockfd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                        reinterpret_cast<struct sockaddr*>(&source), &sourceLength))
+                > 0) {
+                if (sourceLength == sizeof(source))
+                    OnDatagram(&source, buffer, ret);
+                sourceLength = sizeof(source);
+            }
+
+            if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                PLOG_WARNING << "Stun::Client::QueryAllServers recv failed - " << strerror(errno);
+                return -1;
+            }
+        }
+
+        timeout = OnTimer();
+    }
+
+    return GetQueryState() == QueryState::kSucceeded ? 0 : -1;
+}
+
+int64_t Client::Start(size_t serverCount)
+{
+    if (mQuery.mState == QueryState::kRunning)
+        return QueryTimeout();
+
+    mQuery = Query {};
+    mQuery.mState = QueryState::kRunning;
+
     if (mNatType == NatType::kDependent) {
-        PLOG_WARNING << "Nat type is Dependent, skipping Stun::Client::QueryAllServers";
+        PLOG_WARNING << "Nat type is Dependent, skipping Stun::Client::Start";
+        mQuery.mState = QueryState::kFailed;
         return -1;
     }
 
-    std::vector<struct sockaddr*> servers;
-    std::vector<struct addrinfo*> addrinfos;
-
     struct addrinfo hints;
     bzero(&hints, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM;
 
+    for (auto& server : mResolvedServers) {
+        if (mQuery.mServers.size() == serverCount)
+            break;
+        mQuery.mServers.push_back(server);
+    }
+
+    if (mResolvedServers.empty() && mEndpointCache != nullptr) {
+        for (auto& server : mEndpointCache->Get()) {
+            if (mQuery.mServers.size() == serverCount)
+                break;
+            mQuery.mServers.push_back(server);
+        }
+    }
+
+    // NOTE: getaddrinfo blocks, the endpoints should be resolved ahead of time
     for (auto& endpoint : mServers) {
+        if (!mResolvedServers.empty() || mEndpointCache != nullptr
+            || mQuery.mServers.size() == serverCount)
+            break;
+
         struct addrinfo* res;
         int ret = getaddrinfo(endpoint.mHostname.c_str(), endpoint.mPort.c_str(),
             &hints, &res);
 
         if (ret != 0) {
-            PLOG_WARNING << fmt::format("Stun::Client::QueryAllServers getaddrinfo failed for "
+            PLOG_WARNING << fmt::format("Stun::Client::Start getaddrinfo failed for "
                                         "{}:{}, {}",
                 endpoint.mHostname, endpoint.mPort, gai_strerror(ret));
             continue;
         }
 
-        // In the case of multiple retries being required, it is not realistic to
-        // query all the addresses returned by getaddrinfo (say multihomed server)
-        // So, we simply pick only the first address
         THROW_IF(res == nullptr);
         THROW_IF(res->ai_family != AF_INET);
         THROW_IF(res->ai_socktype != SOCK_DGRAM);
-        servers.emplace_back(res->ai_addr);
-        addrinfos.emplace_back(res);
+        mQuery.mServers.push_back(*reinterpret_cast<struct sockaddr_in*>(res->ai_addr));
+        freeaddrinfo(res);
     }
 
-    size_t nServers { servers.size() };
-    if (!nServers) {
-        PLOG_WARNING << "Stun::Client::QueryAllServers - failed to resolve all servers!";
+    if (mQuery.mServers.empty()) {
+        PLOG_WARNING << "Stun::Client::Start - failed to resolve all servers!";
+        mQuery.mState = QueryState::kFailed;
         return -1;
     }
 
-    // RFC 5389 states that RTO estimate should be cached and reused for 10 minutes.
-    // We do not cache the RTO altogether to simply avoid the complexity involved in
-    // maintaining the RTO for each server separately.
+    mQuery.mSuccessfulResponsesFrom.assign(mQuery.mServers.size(), false);
+    mQuery.mRttMs.assign(mQuery.mServers.size(), -1);
+    mQuery.mMappedAddresses.assign(mQuery.mServers.size(), sockaddr_in {});
+    mQuery.mAttempt = 1;
+    mQuery.mRto = mTimeout.mMaxRetransmissions == 1
+        ? mTimeout.mTimeoutMs * mTimeout.mFinalTimeoutMultiplier
+        : mTimeout.mTimeoutMs;
+    mQuery.mDeadlineMs = GetTimeMs() + mQuery.mRto;
+
+    SendQueryRequests();
+    return QueryTimeout();
+}
 
-    uint32_t rto = static_cast<uint32_t>(mTimeout.mTimeoutMs);
-    std::vector<bool> successfulResponsesFrom(nServers, false);
-    int successfulServerCount = 0;
-    std::vector<std::pair<TransactionId, int>> requests; // transaction id -> server index
+int64_t Client::OnDatagram(const struct sockaddr_in* source, const void* message, size_t length)
+{
+    if (mQuery.mState != QueryState::kRunning)
+        return -1;
+    // Anyone can send to the socket, only the servers' answers are parsed at all
+    bool fromServer = std::ranges::any_of(mQuery.mServers, [source](const struct sockaddr_in& server) {
+        return server.sin_addr.s_addr == source->sin_addr.s_addr && server.sin_port == source->sin_port;
+    });
+    if (!fromServer || !IsStunMessage(message, length))
+        return QueryTimeout();
 
-    for (int i = 0; i < nServers; i++) {
-        TransactionId id;
-        if (SendRequest(servers[i], sizeof(struct sockaddr_in), &id) == 0)
-            requests.push_back({ id, i });
+    TransactionId id;
+    if (ProcessResponse(message, length, &id) == 0) {
+        for (auto& request : mQuery.mRequests) {
+            if (id == request.mTransactionId && !mQuery.mSuccessfulResponsesFrom[request.mServer]) {
+                mQuery.mSuccessfulResponsesFrom[request.mServer] = true;
+                mQuery.mSuccessfulServerCount++;
+                // Every retransmission has its own transaction id, so no Karn ambiguity
+                mQuery.mRttMs[request.mServer] = GetTimeMs() - request.mSendTimeMs;
+                mQuery.mMappedAddresses[request.mServer] = mLastMappedAddress;
+            }
+        }
     }
 
-    struct pollfd fd;
-    fd.fd = mSockfd;
-    fd.events = POLLIN;
+    if (mQuery.mSuccessfulServerCount == mQuery.mServers.size())
+        return FinishQuery();
+    return QueryTimeout();
+}
 
-    for (int i = 1; i <= mTimeout.mMaxRetransmissions && successfulServerCount < nServers; i++) {
-        bool isFinalTimeout = (i == mTimeout.mMaxRetransmissions);
+int64_t Client::OnTimer()
+{
+    if (mQuery.mState != QueryState::kRunning)
+        return -1;
+    if (GetTimeMs() < mQuery.mDeadlineMs)
+        return QueryTimeout();
+
+    // The final, longer timeout has expired too
+    if (mQuery.mAttempt >= mTimeout.mMaxRetransmissions)
+        return FinishQuery();
+
+    mQuery.mAttempt++;
+    if (mQuery.mAttempt == mTimeout.mMaxRetransmissions)
+        mQuery.mRto = mTimeout.mTimeoutMs * mTimeout.mFinalTimeoutMultiplier;
+    else
+        mQuery.mRto *= 2;
+    mQuery.mDeadlineMs = GetTimeMs() + mQuery.mRto;
+
+    SendQueryRequests();
+    return QueryTimeout();
+}
 
-        if (isFinalTimeout)
-            rto = mTimeout.mTimeoutMs * mTimeout.mFinalTimeoutMultiplier;
+Client::QueryState Client::GetQueryState() const
+{
+    return mQuery.mState;
+}
 
-        errno = 0;
-        int pollret = poll(&fd, 1, static_cast<int>(rto));
-        rto *= 2;
+std::vector<Client::ServerResult> Client::GetServerResults() const
+{
+    std::vector<ServerResult> results;
+    for (size_t i = 0; i < mQuery.mServers.size(); i++)
+        results.push_back({ .mAddress = mQuery.mServers[i],
+            .mRttMs = mQuery.mRttMs[i],
+            .mMappedAddress = mQuery.mMappedAddresses[i] });
+    return results;
+}
 
-        if (pollret == -1) {
-            if (errno == EINTR)
-                continue;
-            else {
-                PLOG_WARNING << "Stun::Client::QueryAllServers poll failed - " << strerror(errno);
-                goto error;
-            }
-        }
+void Client::SetResolvedServers(std::vector<struct sockaddr_in> servers)
+{
+    mResolvedServers = std::move(servers);
+}
 
-        if (pollret > 0) {
-            char buffer[kMtu];
-            errno = 0;
-            ssize_t ret;
-            while ((ret = recv(mSockfd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
-                if (!IsStunMessage(buffer, ret))
-                    continue;
-
-                TransactionId id;
-                if (ProcessResponse(buffer, ret, &id) == 0) {
-                    int serverIndex = -1;
-                    for (auto& [transactionId, index] : requests)
-                        if (id == transactionId)
-                            serverIndex = index;
-
-                    if (serverIndex != -1 && successfulResponsesFrom[serverIndex] == false) {
-                        successfulServerCount++;
-                        successfulResponsesFrom[serverIndex] = true;
-                    }
-                }
-            }
+void Client::SetEndpointCache(const EndpointCache* cache)
+{
+    mEndpointCache = cache;
+}
 
-            if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                PLOG_WARNING << "Stun::Client::QueryAllServers recv failed - " << strerror(errno);
-                goto error;
-            }
-        }
+void Client::SendQueryRequests()
+{
+    for (size_t i = 0; i < mQuery.mServers.size(); i++) {
+        if (mQuery.mSuccessfulResponsesFrom[i])
+            continue;
 
-        if (!isFinalTimeout) {
-            for (int j = 0; j < nServers; j++) {
-                TransactionId id;
-                if (successfulResponsesFrom[j] == false
-                    && SendRequest(servers[j], sizeof(struct sockaddr_in), &id) == 0)
-                    requests.push_back({ id, j });
-            }
-        }
+        TransactionId id;
+        if (SendRequest(reinterpret_cast<const struct sockaddr*>(&mQuery.mServers[i]),
+                sizeof(struct sockaddr_in), &id)
+            == 0)
+            mQuery.mRequests.push_back({ .mTransactionId = id, .mServer = static_cast<int>(i), .mSendTimeMs = GetTimeMs() });
     }
+}
 
-    if (!successfulServerCount) {
-        PLOG_WARNING << "Stun::Client::QueryAllServers failure to transact with all STUN servers";
-        goto error;
+int64_t Client::FinishQuery()
+{
+    if (mQuery.mSuccessfulServerCount == 0) {
+        PLOG_WARNING << "Stun::Client::OnTimer failure to transact with all STUN servers";
+        mQuery.mState = QueryState::kFailed;
+    } else {
+        mQuery.mState = QueryState::kSucceeded;
     }
+    return -1;
+}
 
-    for (auto& ai : addrinfos)
-        freeaddrinfo(ai);
-    return 0;
+int64_t Client::QueryTimeout() const
+{
+    uint64_t now = GetTimeMs();
+    return mQuery.mDeadlineMs > now ? static_cast<int64_t>(mQuery.mDeadlineMs - now) : 0;
+}
 
-error:
-    for (auto& ai : addrinfos)
-        freeaddrinfo(ai);
-    return -1;
+int Client::PredictMapping(struct sockaddr_in* nextMapping, int* portDelta) const
+{
+    // Requests go out in server order, so that is the order mappings were made in
+    std::vector<const struct sockaddr_in*> mappings;
+    for (size_t i = 0; i < mQuery.mServers.size(); i++)
+        if (mQuery.mSuccessfulResponsesFrom[i])
+            mappings.push_back(&mQuery.mMappedAddresses[i]);
+    if (mappings.size() < 2)
+        return -1;
+
+    // The most common step between successive mappings, the smallest on a tie.
+    // Other hosts behind the NAT grabbing ports in between only add larger steps.
+    std::vector<int> deltas;
+    for (size_t i = 1; i < mappings.size(); i++) {
+        if (mappings[i]->sin_addr.s_addr != mappings[0]->sin_addr.s_addr)
+            return -1; // NAT pool with several public addresses
+        deltas.push_back(static_cast<int>(ntohs(mappings[i]->sin_port))
+            - static_cast<int>(ntohs(mappings[i - 1]->sin_port)));
+    }
+
+    int best = 0;
+    int bestCount = 0;
+    for (int delta : deltas) {
+        int count = std::count(deltas.begin(), deltas.end(), delta);
+        if (count > bestCount || (count == bestCount && std::abs(delta) < std::abs(best))) {
+            best = delta;
+            bestCount = count;
+        }
+    }
+    if (best == 0 || std::abs(best) > kMaxPortDelta)
+        return -1;
+
+    int port = ntohs(mappings.back()->sin_port) + best;
+    if (port <= 0 || port > UINT16_MAX)
+        return -1;
+
+    *nextMapping = *mappings.back();
+    nextMapping->sin_port = htons(static_cast<uint16_t>(port));
+    *portDelta = best;
+    return 0;
 }
 
 NatType Client::GetNatType() const
@@ -344,7 +664,23 @@ void Client::InvalidateReflexiveAddress()
 
 int Client::NatKeepAliveSend()
 {
-    const Endpoint& endpoint { mServers[std::rand() % mServers.size()] };
+    // Any server already resolved will do, getaddrinfo() blocks
+    std::vector<struct sockaddr_in> resolved = mResolvedServers.empty()
+        ? mQuery.mServers
+        : mResolvedServers;
+    if (resolved.empty() && mEndpointCache != nullptr)
+        resolved = mEndpointCache->Get();
+    if (!resolved.empty()) {
+        const struct sockaddr_in& server = resolved[mIdGenerator.NextU64() % resolved.size()];
+        return SendRequest(reinterpret_cast<const struct sockaddr*>(&server),
+            sizeof(server), nullptr);
+    }
+    if (mEndpointCache != nullptr) {
+        PLOG_WARNING << "Stun::Client::NatKeepAliveSend no STUN server resolved yet, skipping";
+        return -1;
+    }
+
+    const Endpoint& endpoint { mServers[mIdGenerator.NextU64() % mServers.size()] };
     struct addrinfo hints;
     bzero(&hints, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -377,8 +713,7 @@ int Client::NatKeepAliveSend()
 
 int Client::NatKeepAliveReceive(const void* message, size_t length)
 {
-    THROW_IF(!IsStunMessage(message, length));
-    if (!ProcessResponse(message, length, nullptr))
+    if (ProcessResponse(message, length, nullptr) != 0)
         return -1;
     return 0;
 }
@@ -388,7 +723,9 @@ int Client::SendRequest(const struct sockaddr* serverAddress, socklen_t serverAd
 {
     PurgeStaleTransactions();
 
-    MessageBuilder builder(kHeader::MessageType::Request);
+    MessageBuilder builder(kHeader::MessageType::Request, mIdGenerator.Next());
+    THROW_IF(builder.AddSoftware(kSoftware) != 0);
+    THROW_IF(builder.AddFingerprint() != 0);
 
     TransactionId id = builder.GetTransactionId();
     const void* message = builder.GetMessage();
@@ -403,13 +740,15 @@ int Client::SendRequest(const struct sockaddr* serverAddress, socklen_t serverAd
         return -1;
     }
 
-    if (ret < length) {
+    if (static_cast<size_t>(ret) < length) {
         PLOG_WARNING << fmt::format("Stun::Client::SendRequest sendto incomplete send - {} of {} bytes",
             ret, length);
         return -1;
     }
 
     AddNewTransaction(id);
+    if (transactionId != nullptr)
+        *transactionId = id;
     return 0;
 }
 
@@ -424,16 +763,34 @@ int Client::ProcessResponse(const void* message, size_t length,
     MessageReader reader(message, length);
     const Header* header = reader.GetHeader();
 
-    if (!EraseTransactionIfExists(header->mTransactionId)) {
+    // The cheapest check first, an answer to nothing we sent goes no further
+    if (!TransactionExists(header->mTransactionId)) {
         PLOG_INFO << "Received a packet with an unknown transaction id, too much network congestion?";
         return -1;
     }
 
-    if (mNatType == NatType::kDependent)
-        // No point of further processing
-        return 0;
-
+    // Checked before anything is acted upon, FINGERPRINT comes last. Until then
+    // the transaction stays open, a forged answer must not close it.
     const Attribute* attribute;
+    MessageReader pass(message, length);
+    while ((attribute = pass.Next()) != nullptr) {
+        if (attribute->mType == kAttribute::Optional::Fingerprint
+            && !pass.CheckFingerprint(attribute)) {
+            PLOG_WARNING << "Stun::Client::ProcessResponse fingerprint mismatch";
+            return -1;
+        }
+    }
+    if (pass.Malformed()) {
+        PLOG_WARNING << "Stun::Client::ProcessResponse malformed attribute";
+        return -1;
+    }
+
+    EraseTransactionIfExists(header->mTransactionId);
+    if (transactionId != nullptr)
+        *transactionId = header->mTransactionId;
+
+    // NOTE: Processed even once the NAT is known to be dependent, the mappings
+    // are what PredictMapping() works from
     std::set<uint16_t> attributesProcessed;
     int ret = -1;
     while ((attribute = reader.Next()) != nullptr) {
@@ -453,6 +810,10 @@ int Client::ProcessResponse(const void* message, size_t length,
                 == 0) {
                 ret = 0;
                 THROW_IF(addressLength != sizeof(reflexiveAddress));
+                mLastMappedAddress = reflexiveAddress;
+
+                if (mNatType == NatType::kDependent)
+                    break;
 
                 if (mNatType == NatType::kUnknown
                     && mReflexiveAddress.sin_addr.s_addr == htonl(INADDR_ANY)) {
@@ -482,9 +843,10 @@ int Client::ProcessResponse(const void* message, size_t length,
         case Required::UnknownAttributes:
         case Required::Realm:
         case Required::Nonce:
+        case Optional::Fingerprint:
+            break; // checked above
         case Optional::Software:
-        case Optional::AlternateServer:
-        case Optional::Fingerprint: {
+        case Optional::AlternateServer: {
             PLOG_INFO << fmt::format(
                 "Stun::Client::ProcessResponse known-but-unexpected attribute of type {},"
                 "ignoring",
@@ -498,13 +860,11 @@ int Client::ProcessResponse(const void* message, size_t length,
                     "attribute {}",
                     type);
                 return -1;
-            } else if (type >= OptionalMin && type <= OptionalMax) {
+            } else {
                 PLOG_INFO << fmt::format(
                     "Stun::Client::ProcessResponse ignoring unknown comprehension-optional"
                     "attribute {}",
                     type);
-            } else {
-                THROW("Stun::Client::ProcessResponse malformed attribute type");
             }
         }
     }
@@ -520,27 +880,29 @@ uint64_t Client::GetTimeMs() const
 
 void Client::AddNewTransaction(TransactionId id)
 {
-    mOngoingTransactions.insert({ .mSendTimeMs = GetTimeMs(),
-        .mTransactionId = id });
+    uint64_t time = GetTimeMs();
+    mOngoingTransactions[id] = time;
+    mTransactionExpiry.push_back({ .mSendTimeMs = time, .mTransactionId = id });
+}
+bool Client::TransactionExists(TransactionId id) const
+{
+    return mOngoingTransactions.contains(id);
 }
-
 bool Client::EraseTransactionIfExists(TransactionId id)
 {
-    for (auto& transaction : mOngoingTransactions) {
-        if (transaction.mTransactionId == id) {
-            mOngoingTransactions.erase(transaction);
-            return true;
-        }
-    }
-    return false;
+    return mOngoingTransactions.erase(id) > 0;
 }
-
 void Client::PurgeStaleTransactions()
 {
     uint64_t time = GetTimeMs();
-    while (!mOngoingTransactions.empty()
-        && (time - mOngoingTransactions.begin()->mSendTimeMs) > mStunTtlMs) {
-        mOngoingTransactions.erase(mOngoingTransactions.begin());
+    while (!mTransactionExpiry.empty()
+        && (time - mTransactionExpiry.front().mSendTimeMs) > mStunTtlMs) {
+        const OngoingTransaction& transaction = mTransactionExpiry.front();
+        // Answered, or the id was reused by a newer transaction still in flight
+        auto it = mOngoingTransactions.find(transaction.mTransactionId);
+        if (it != mOngoingTransactions.end() && it->second == transaction.mSendTimeMs)
+            mOngoingTransactions.erase(it);
+        mTransactionExpiry.pop_front();
     }
 }
 
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <set>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <netdb.h>
@@ -100,6 +106,32 @@ struct __attribute__((packed)) TransactionId {
     }
 };
 
+struct TransactionIdHash {
+    // Ids are random, any 8 of their bytes make as good a hash as any
+    size_t operator()(const TransactionId& id) const
+    {
+        size_t hash;
+        memcpy(&hash, id.mId, sizeof(hash));
+        return hash;
+    }
+};
+
+// xoshiro256** (Blackman, Vigna) seeded from getrandom(): a few instructions per
+// id, and unlike rand() reseeded from time(), generators started within the same
+// second do not hand out the same ids.
+// NOTE: Not a CSPRNG itself, enough consecutive outputs give its state away. An
+// off-path attacker, what random ids defend against (RFC 5389 6), sees none.
+class TransactionIdGenerator final {
+public:
+    TransactionIdGenerator();
+
+    TransactionId Next();
+    uint64_t NextU64();
+
+private:
+    uint64_t mState[4];
+};
+
 struct __attribute__((packed)) Header {
     uint16_t mMessageType;
     uint16_t mMessageLength;
@@ -124,40 +156,71 @@ struct __attribute__((packed)) MappedAddressIPv4 {
 
 bool IsStunMessage(const void* buffer, size_t length);
 
+// CRC-32 of IEEE 802.3, which FINGERPRINT (RFC 5389 15.5) is computed with
+uint32_t Crc32(const void* data, size_t length);
+
+// Builds into a caller-provided buffer, or into the builder itself, so a builder
+// on the stack allocates nothing
 class MessageBuilder final {
 public:
-    MessageBuilder(uint16_t messageType);
-    ~MessageBuilder();
-
-    // Function not implemented, because well, it is not needed for now.
-    int AddAttribute(const Attribute& attribute) = delete;
+    // RFC 5389 7.1: 576 byte IPv4 path MTU less the IP and UDP headers
+    inline static const size_t kMaxMessageSize { 548 };
+
+    MessageBuilder(uint16_t messageType); // id from a per-thread TransactionIdGenerator
+    MessageBuilder(uint16_t messageType, TransactionId transactionId);
+    // buffer must outlive the builder and hold at least a Header
+    MessageBuilder(void* buffer, size_t bufferLength, uint16_t messageType,
+        TransactionId transactionId);
+    ~MessageBuilder() = default;
+
+    MessageBuilder(const MessageBuilder&) = delete;
+    MessageBuilder& operator=(const MessageBuilder&) = delete;
+
+    // Appenders pad the value to 32 bits. -1 if the attribute does not fit, or
+    // after AddFingerprint().
+    int AddAttribute(const Attribute& attribute);
+    int AddSoftware(std::string_view software);
+    // Must come last, covers everything added before it
+    int AddFingerprint();
 
     const void* GetMessage() const;
     size_t GetMessageSize() const;
     TransactionId GetTransactionId() const;
 
 private:
-    void* mMessage;
+    uint8_t* const mBuffer;
+    const size_t mBufferLength;
     size_t mLength;
+    bool mFingerprinted {};
+
+    alignas(uint32_t) uint8_t mStorage[kMaxMessageSize]; // unused with a caller's buffer
 };
 
-// Assumes a well-formed STUN message, can throw otherwise
+// Reads whatever came off the network without trusting it. Next() returns nullptr
+// at the end of the message, and also at an attribute running past it, or when
+// the buffer is shorter than a Header - Malformed() tells the two apart.
 class MessageReader final {
 public:
     MessageReader(const void* buffer, size_t length);
     ~MessageReader() = default;
 
+    // Only if the buffer holds a Header, e.g once IsStunMessage() said so
     const Header* GetHeader() const;
     const Attribute* Next();
+    bool Malformed() const;
 
+    // -1 unless attribute is a well-formed IPv4 XOR-MAPPED-ADDRESS
     int ParseXorMappedAddress(const Attribute* attribute,
         struct sockaddr* address, socklen_t* addressLength);
+    // Whether attribute, a FINGERPRINT, is the last one and matches the message
+    bool CheckFingerprint(const Attribute* attribute) const;
 
 private:
     const void* const mBuffer;
     const size_t mBufferLength;
     const char* mCurrent; // char* for easy pointer arithmetic
     size_t mCurrentLength;
+    bool mMalformed {};
 
     Attribute mCurrentAttribute;
 };
@@ -167,6 +230,8 @@ struct Endpoint {
     std::string mPort;
 };
 
+class EndpointCache;
+
 enum class NatType {
     kUnknown = 0,
     kIndependent,
@@ -181,19 +246,75 @@ public:
         uint64_t mFinalTimeoutMultiplier;
     };
 
+    inline static const std::vector<Endpoint> kDefaultServers {
+        { "stun.l.google.com", "19302" },
+        { "stun.freeswitch.org", "3478" },
+        { "stun.voip.blackberry.com", "3478" }
+    };
+
     Client(int sockfd);
     Client(int sockfd, Timeout timeout);
     Client(int sockfd, const std::vector<Endpoint>& servers, Timeout timeout);
     ~Client() = default;
 
+    // Blocking, runs the Start()/OnDatagram()/OnTimer() state machine below on its
+    // own poll() loop. It reads (and drops) whatever else arrives on the socket.
     int QueryAllServers();
+
+    // Event-driven mode, for use from an event loop on a socket shared with other
+    // traffic. None of these block or read from the socket:
+    //   Start() sends the first round of requests to every server,
+    //   OnDatagram() consumes a datagram the caller read from the socket, and
+    //     drops it unless source is one of the queried servers,
+    //   OnTimer() retransmits, call it once the last returned timeout expires.
+    // All three return the ms until OnTimer() is due, or -1 once the query is
+    // over - GetQueryState() then tells whether it succeeded.
+    enum class QueryState {
+        kIdle = 0,
+        kRunning,
+        kSucceeded,
+        kFailed
+    };
+
+    // serverCount limits how many servers are queried: a single one is enough
+    // to learn the mapping, classifying the NAT needs more
+    int64_t Start(size_t serverCount = SIZE_MAX);
+    int64_t OnDatagram(const struct sockaddr_in* source, const void* message, size_t length);
+    int64_t OnTimer();
+    QueryState GetQueryState() const;
+
+    struct ServerResult {
+        struct sockaddr_in mAddress;
+        int64_t mRttMs; // -1 if the server never answered
+        struct sockaddr_in mMappedAddress {}; // as seen by this server, zero if no answer
+    };
+    // Servers queried by the last Start(), in query order
+    std::vector<ServerResult> GetServerResults() const;
+
+    // Query these instead of resolving the endpoints, e.g loaded from a Profile.
+    // Start(1) picks the first one, so put the fastest first.
+    void SetResolvedServers(std::vector<struct sockaddr_in> servers);
+
+    // Without resolved servers, take the addresses from cache (which must outlive
+    // the client) rather than calling getaddrinfo(). Nothing then blocks on DNS:
+    // if the cache has no addresses yet, Start() fails and keepalives are skipped.
+    void SetEndpointCache(const EndpointCache* cache);
+
+    // Dependent NATs hand out a new mapping per destination, but commonly from a
+    // counter: the ports seen by successive servers then differ by a constant step.
+    // Guesses the mapping the next destination will get from the last Start().
+    // Returns -1 if the ports show no usable pattern.
+    int PredictMapping(struct sockaddr_in* nextMapping, int* portDelta) const;
+
     NatType GetNatType() const;
     int GetReflexiveAddress(struct sockaddr* reflexiveAddress,
         socklen_t* reflexiveAddressLength) const;
 
     void InvalidateReflexiveAddress();
 
-    // Using these, you can multiplex keepalive messages with other data
+    // Using these, you can multiplex keepalive messages with other data.
+    // NatKeepAliveSend() only resolves an endpoint (blocking) if no query did yet
+    // and there is no EndpointCache.
     int NatKeepAliveSend();
     int NatKeepAliveReceive(const void* message, size_t length);
 
@@ -201,19 +322,6 @@ private:
     struct OngoingTransaction {
         uint64_t mSendTimeMs;
         TransactionId mTransactionId;
-
-        bool operator<(const OngoingTransaction& other) const
-        {
-            if (mSendTimeMs != other.mSendTimeMs)
-                return mSendTimeMs < other.mSendTimeMs;
-            return mTransactionId < other.mTransactionId;
-        }
-    };
-
-    inline static const std::vector<Endpoint> kDefaultServers {
-        { "stun.l.google.com", "19302" },
-        { "stun.freeswitch.org", "3478" },
-        { "stun.voip.blackberry.com", "3478" }
     };
 
     inline static const Timeout kDefaultTimeout {
@@ -222,9 +330,16 @@ private:
         .mFinalTimeoutMultiplier = 16
     };
 
+    // Steps larger than this are more likely random allocation than a counter
+    // shared with other hosts behind the NAT
+    inline static const int kMaxPortDelta { 64 };
+
     // Path MTU is unknown, so 576 is the safe value
     inline static const uint32_t kMtu { 576 };
 
+    // RFC 5389 7.1: requests SHOULD carry SOFTWARE
+    inline static const std::string_view kSoftware { "atp" };
+
     int SendRequest(const struct sockaddr* serverAddress,
         socklen_t serverAddressLength, TransactionId* transactionId);
 
@@ -233,22 +348,57 @@ private:
     int ProcessResponse(const void* message, size_t length,
         TransactionId* transactionId);
 
+    // State of the query driven by Start()/OnDatagram()/OnTimer()
+    struct Query {
+        QueryState mState { QueryState::kIdle };
+        std::vector<struct sockaddr_in> mServers {};
+        std::vector<bool> mSuccessfulResponsesFrom {};
+        size_t mSuccessfulServerCount {};
+        std::vector<int64_t> mRttMs {};
+        std::vector<struct sockaddr_in> mMappedAddresses {};
+        struct Request {
+            TransactionId mTransactionId;
+            int mServer;
+            uint64_t mSendTimeMs;
+        };
+        std::vector<Request> mRequests {};
+        uint64_t mAttempt {};
+        uint64_t mRto {};
+        uint64_t mDeadlineMs {};
+    };
+
+    void SendQueryRequests();
+    int64_t FinishQuery();
+    int64_t QueryTimeout() const;
+
     uint64_t GetTimeMs() const;
     void AddNewTransaction(TransactionId id);
+    bool TransactionExists(TransactionId id) const;
     bool EraseTransactionIfExists(TransactionId id);
     void PurgeStaleTransactions();
 
     int mSockfd;
     const std::vector<Endpoint> mServers;
+    std::vector<struct sockaddr_in> mResolvedServers;
+    const EndpointCache* mEndpointCache {};
     NatType mNatType;
 
     Timeout mTimeout; // RTO = Retransmission TimeOut
     uint64_t mStunTtlMs;
-    std::set<OngoingTransaction> mOngoingTransactions;
+    TransactionIdGenerator mIdGenerator;
+    // Id -> send time, for the O(1) lookup of every response. Ids also go on the
+    // expiry list in send order, which is expiry order as the TTL is the same for
+    // all. Answered ids are left on the list, dropped when they reach its front.
+    std::unordered_map<TransactionId, uint64_t, TransactionIdHash> mOngoingTransactions;
+    std::deque<OngoingTransaction> mTransactionExpiry;
+
+    Query mQuery;
 
     // Current code only support IPv4, although I have tried to make
     // the function signatures protocol-independent
     struct sockaddr_in mReflexiveAddress;
+    // Set by every ProcessResponse() which carried a mapping, whatever the NAT type
+    struct sockaddr_in mLastMappedAddress;
 };
 
 }
@@ -0,0 +1,79 @@
+#include "check.h"
+
+#include <atp/eventcore.h>
+#include <atp/posix_socket.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <thread>
+#include <vector>
+
+using namespace Atp;
+
+// Wakeup latency of the EventCore with and without busy-polling: a thread sends
+// timestamped datagrams over loopback, spaced out so the loop goes idle in
+// between, and the callback records how long each one took to be dispatched.
+// Busy-polling only pays off with a core to spare for the loop.
+
+static constexpr int kSamples = 20000;
+static constexpr int kGapUs = 200;
+
+static std::vector<double> Run(int busyPollUs)
+{
+    EventCore eventCore { EventCore::Options { .mBusyPollUs = busyPollUs, .mCpu = -1 } };
+    PosixSocketFactory factory;
+    std::unique_ptr<ISocket> receiver = factory.Socket(AF_INET, SOCK_DGRAM, 0);
+    std::unique_ptr<ISocket> sender = factory.Socket(AF_INET, SOCK_DGRAM, 0);
+
+    struct sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    CHECK(bind(receiver->GetFd(), reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0);
+    CHECK(getsockname(receiver->GetFd(), reinterpret_cast<struct sockaddr*>(&address), &length) == 0);
+
+    std::vector<double> latencies;
+    latencies.reserve(kSamples);
+    CHECK(eventCore.RegisterCallback(receiver.get(), 0,
+              [&](void*) -> mseconds_t {
+                  double sentUs;
+                  while (receiver->RecvFrom(&sentUs, sizeof(sentUs), MSG_DONTWAIT, nullptr, nullptr)
+                      == sizeof(sentUs))
+                      latencies.push_back(Test::NowUs() - sentUs);
+                  if (latencies.size() >= kSamples)
+                      eventCore.Stop();
+                  return -1;
+              },
+              nullptr)
+        != 0);
+
+    std::thread loop([&] { eventCore.Run(); });
+    for (int i = 0; i < kSamples; i++) {
+        double deadline = Test::NowUs() + kGapUs;
+        while (Test::NowUs() < deadline)
+            ;
+        double nowUs = Test::NowUs();
+        CHECK(sender->SendTo(&nowUs, sizeof(nowUs), 0,
+                  reinterpret_cast<struct sockaddr*>(&address), sizeof(address))
+            == sizeof(nowUs));
+    }
+    loop.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+int main()
+{
+    std::printf("%-12s %10s %10s %10s\n", "busy poll", "p50 us", "p99 us", "p99.9 us");
+    for (int busyPollUs : { 0, 50, 1000 }) {
+        std::vector<double> latencies = Run(busyPollUs);
+        auto percentile = [&](double p) { return latencies[static_cast<size_t>(p * (latencies.size() - 1))]; };
+        std::printf("%-12d %10.1f %10.1f %10.1f\n", busyPollUs, percentile(0.5), percentile(0.99),
+            percentile(0.999));
+    }
+    return 0;
+}
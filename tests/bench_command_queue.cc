@@ -0,0 +1,93 @@
+#include "check.h"
+
+#include <atp/command_queue.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace Atp;
+
+// Contention benchmark for the command queue, against the mutex-guarded
+// std::queue it replaced. Producers push as fast as they can while a single
+// consumer drains, like application threads posting to the EventCore.
+
+static constexpr uint64_t kPerProducer = 1000000;
+static constexpr size_t kCapacity = 4096;
+
+class MutexQueue {
+public:
+    bool TryPush(uint64_t&& value)
+    {
+        std::lock_guard lock { mMutex };
+        if (mQueue.size() == kCapacity)
+            return false;
+        mQueue.push(value);
+        return true;
+    }
+
+    bool TryPop(uint64_t& value)
+    {
+        std::lock_guard lock { mMutex };
+        if (mQueue.empty())
+            return false;
+        value = mQueue.front();
+        mQueue.pop();
+        return true;
+    }
+
+private:
+    std::mutex mMutex;
+    std::queue<uint64_t> mQueue;
+};
+
+template <typename Queue>
+static double Run(int producerCount)
+{
+    Queue queue;
+    std::atomic<bool> start { false };
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producerCount; p++) {
+        producers.emplace_back([&] {
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for (uint64_t i = 0; i < kPerProducer; i++) {
+                uint64_t value = i;
+                // Yielding keeps the numbers sane with fewer cores than threads
+                while (!queue.TryPush(std::move(value)))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    double startUs = Test::NowUs();
+    start.store(true, std::memory_order_release);
+    uint64_t total = kPerProducer * producerCount;
+    for (uint64_t popped = 0; popped < total;) {
+        uint64_t value;
+        if (queue.TryPop(value))
+            popped++;
+        else
+            std::this_thread::yield();
+    }
+    double elapsedUs = Test::NowUs() - startUs;
+    for (std::thread& thread : producers)
+        thread.join();
+
+    return total / elapsedUs; // million operations per second
+}
+
+int main()
+{
+    std::printf("%-10s %14s %14s\n", "producers", "mpsc Mops/s", "mutex Mops/s");
+    for (int producers : { 1, 2, 4, 8 }) {
+        double mpsc = Run<MpscQueue<uint64_t, kCapacity>>(producers);
+        double mutex = Run<MutexQueue>(producers);
+        std::printf("%-10d %14.2f %14.2f\n", producers, mpsc, mutex);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "loopback.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+using namespace Atp;
+
+// The socketpair and the shared memory ring data paths against each other, with
+// the application writing 64 byte and 64 KB messages over a loopback connection.
+// Throughput streams one way, latency is the round trip of a message echoed back.
+// Both ends and the engine share one thread, so this is the cost of the data
+// path plus the engine's per-segment work, not what two cores would reach.
+
+static constexpr size_t kStreamBytes = 64 * 1024 * 1024;
+static constexpr size_t kSmallStreamBytes = 4 * 1024 * 1024;
+static constexpr int kRoundTrips = 2000;
+
+static const char* Name(AtpSocket::DataPath dataPath)
+{
+    return dataPath == AtpSocket::DataPath::kRing ? "ring" : "socketpair";
+}
+
+static void BenchThroughput(EventCore& eventCore, Test::Connection& connection, size_t messageSize,
+    size_t total, const char* name)
+{
+    std::vector<std::byte> message(messageSize);
+    std::vector<std::byte> buffer(64 * 1024);
+    size_t written = 0;
+    size_t read = 0;
+
+    double startUs = Test::NowUs();
+    CHECK(Test::RunUntil(eventCore, [&] {
+        // One message per call, or what is left of it
+        while (written < total) {
+            size_t length = messageSize - written % messageSize;
+            size_t count = Test::Write(connection.mConnector.get(), message.data(), length);
+            if (count == 0)
+                break;
+            written += count;
+        }
+        while (size_t count = Test::Read(connection.mAccepted, buffer.data(), buffer.size()))
+            read += count;
+        return read == total;
+    }, 120000));
+    double elapsedUs = Test::NowUs() - startUs;
+
+    std::printf("%-10s %6zu B  throughput %8.1f MB/s\n", name, messageSize,
+        static_cast<double>(total) / elapsedUs);
+}
+
+static void BenchLatency(EventCore& eventCore, Test::Connection& connection, size_t messageSize,
+    const char* name)
+{
+    std::vector<std::byte> message(messageSize);
+    std::vector<std::byte> buffer(messageSize);
+    std::vector<double> latencies;
+
+    for (int i = 0; i < kRoundTrips; i++) {
+        size_t sent = 0;
+        size_t echoed = 0;
+        size_t returned = 0;
+        double startUs = Test::NowUs();
+        CHECK(Test::RunUntil(eventCore, [&] {
+            if (sent < messageSize)
+                sent += Test::Write(connection.mConnector.get(), message.data() + sent, messageSize - sent);
+            // The accepted end echoes whatever arrives
+            if (size_t count = Test::Read(connection.mAccepted, buffer.data(), messageSize - echoed)) {
+                size_t done = 0;
+                while (done < count) {
+                    done += Test::Write(connection.mAccepted, buffer.data() + done, count - done);
+                    eventCore.ProcessEvents(0);
+                }
+                echoed += count;
+            }
+            returned += Test::Read(connection.mConnector.get(), buffer.data(), messageSize - returned);
+            return returned == messageSize;
+        }));
+        latencies.push_back(Test::NowUs() - startUs);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("%-10s %6zu B  round trip p50 %8.1f us  p99 %8.1f us\n", name, messageSize,
+        latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+}
+
+int main()
+{
+    for (AtpSocket::DataPath dataPath : { AtpSocket::DataPath::kSocketpair, AtpSocket::DataPath::kRing }) {
+        EventCore eventCore;
+        Test::LoopbackSignalling signalling { &eventCore };
+        Test::LoopbackResolver resolver { &eventCore };
+        PosixSocketFactory factory;
+        Context context { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+
+        Test::Connection connection = Test::Connect(eventCore, &signalling, &resolver, &factory,
+            &context, dataPath);
+        BenchThroughput(eventCore, connection, 64, kSmallStreamBytes, Name(dataPath));
+        BenchThroughput(eventCore, connection, 64 * 1024, kStreamBytes, Name(dataPath));
+        BenchLatency(eventCore, connection, 64, Name(dataPath));
+        BenchLatency(eventCore, connection, 64 * 1024, Name(dataPath));
+    }
+    return 0;
+}
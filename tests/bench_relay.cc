@@ -0,0 +1,150 @@
+#include "check.h"
+
+#include <relay_server.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Relay::Server forwarding datagrams between one pair of peers over loopback,
+// with the allocation table nearly empty and with 60k other allocations live.
+// The peers send and drain a batch at a time on the same thread as the relay;
+// "relay" is the time spent in ProcessBatch() alone, i.e what one relay core
+// could forward, "total" includes the peers' syscalls.
+
+static constexpr size_t kDatagrams = 1000000;
+static constexpr size_t kBatch = Relay::Server::kBatchSize;
+static constexpr size_t kCrowd = 60000;
+
+static int Bind(struct sockaddr_in* address)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    CHECK(fd >= 0);
+    *address = {};
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(fd, reinterpret_cast<struct sockaddr*>(address), sizeof(*address)) == 0);
+    socklen_t length = sizeof(*address);
+    CHECK(getsockname(fd, reinterpret_cast<struct sockaddr*>(address), &length) == 0);
+    return fd;
+}
+
+static void SendBatch(int fd, const struct sockaddr_in& relay, uint64_t firstToken, size_t count,
+    size_t size)
+{
+    std::vector<std::vector<char>> datagrams(count, std::vector<char>(size));
+    std::vector<struct iovec> iov(count);
+    std::vector<struct mmsghdr> messages(count);
+    for (size_t i = 0; i < count; i++) {
+        Atp::relay_hdr header { .magic = Atp::kRelayMagic, .version = Atp::kRelayVersion, .zero = 0,
+            .token = firstToken + i };
+        memcpy(datagrams[i].data(), &header, sizeof(header));
+        iov[i] = { .iov_base = datagrams[i].data(), .iov_len = size };
+        messages[i] = {};
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = const_cast<struct sockaddr_in*>(&relay);
+        messages[i].msg_hdr.msg_namelen = sizeof(relay);
+    }
+    for (size_t sent = 0; sent < count;) {
+        int n = sendmmsg(fd, messages.data() + sent, count - sent, 0);
+        CHECK(n > 0);
+        sent += n;
+    }
+}
+
+static void Bench(size_t size, size_t crowd)
+{
+    struct sockaddr_in relayAddress, aAddress, bAddress, crowdAddress;
+    int relayFd = Bind(&relayAddress);
+    int a = Bind(&aAddress);
+    int b = Bind(&bAddress);
+    int crowdFd = Bind(&crowdAddress);
+    int bufferSize = 4 * 1024 * 1024;
+    CHECK(setsockopt(relayFd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)) == 0);
+
+    auto server = std::make_unique<Relay::Server>(relayFd, crowd + 1);
+
+    // Half open allocations, one peer each, filling the table around ours
+    for (size_t done = 0; done < crowd; done += kBatch) {
+        size_t count = std::min(kBatch, crowd - done);
+        SendBatch(crowdFd, relayAddress, 1000 + done, count, sizeof(Atp::relay_hdr));
+        for (size_t processed = 0; processed < count;)
+            processed += server->ProcessBatch(MSG_DONTWAIT);
+    }
+
+    // Pair up token 1
+    SendBatch(a, relayAddress, 1, 1, size);
+    SendBatch(b, relayAddress, 1, 1, size);
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 2);
+    CHECK(server->Allocations() == crowd + 1);
+
+    std::vector<std::vector<char>> buffers(kBatch, std::vector<char>(size));
+    std::vector<struct iovec> iov(kBatch);
+    std::vector<struct mmsghdr> messages(kBatch);
+    for (size_t i = 0; i < kBatch; i++) {
+        iov[i] = { .iov_base = buffers[i].data(), .iov_len = size };
+        messages[i] = {};
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    recvmmsg(b, messages.data(), kBatch, MSG_DONTWAIT, nullptr); // the pairing datagram
+
+    // Token 1 over and over, unlike SendBatch() which counts up
+    std::vector<char> datagram(size);
+    Atp::relay_hdr header { .magic = Atp::kRelayMagic, .version = Atp::kRelayVersion, .zero = 0, .token = 1 };
+    memcpy(datagram.data(), &header, sizeof(header));
+    std::vector<struct iovec> sendIov(kBatch, { .iov_base = datagram.data(), .iov_len = size });
+    std::vector<struct mmsghdr> sendMessages(kBatch);
+    for (size_t i = 0; i < kBatch; i++) {
+        sendMessages[i] = {};
+        sendMessages[i].msg_hdr.msg_iov = &sendIov[i];
+        sendMessages[i].msg_hdr.msg_iovlen = 1;
+        sendMessages[i].msg_hdr.msg_name = &relayAddress;
+        sendMessages[i].msg_hdr.msg_namelen = sizeof(relayAddress);
+    }
+
+    double relayUs = 0;
+    size_t received = 0;
+    double startUs = Test::NowUs();
+    while (received < kDatagrams) {
+        CHECK(sendmmsg(a, sendMessages.data(), kBatch, 0) == static_cast<int>(kBatch));
+        for (size_t forwarded = 0; forwarded < kBatch;) {
+            double batchUs = Test::NowUs();
+            int count = server->ProcessBatch(MSG_DONTWAIT);
+            relayUs += Test::NowUs() - batchUs;
+            CHECK(count > 0);
+            forwarded += count;
+        }
+        for (size_t drained = 0; drained < kBatch;) {
+            int count = recvmmsg(b, messages.data(), kBatch, MSG_DONTWAIT, nullptr);
+            CHECK(count > 0);
+            drained += count;
+        }
+        received += kBatch;
+    }
+    double totalUs = Test::NowUs() - startUs;
+    CHECK(server->GetStats().mDropped == 0);
+
+    std::printf("%4zu B  %5zu allocations  relay %6.0f ns/datagram %8.1f MB/s  total %6.0f ns/datagram\n",
+        size, crowd + 1, relayUs * 1000 / received, static_cast<double>(received * size) / relayUs,
+        totalUs * 1000 / received);
+
+    for (int fd : { relayFd, a, b, crowdFd })
+        close(fd);
+}
+
+int main()
+{
+    for (size_t crowd : { size_t { 0 }, kCrowd }) {
+        Bench(64, crowd);
+        Bench(576, crowd);
+    }
+    return 0;
+}
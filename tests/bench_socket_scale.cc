@@ -0,0 +1,100 @@
+#include "loopback.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace Atp;
+
+// Opens, punches and closes 100k sockets through a Context, in batches which are
+// all open at once, so that the Context's FdTable holds many live descriptors
+// while they come and go. Per operation:
+//   open  - Context::Socket()
+//   punch - Context::Connect() until both ends are ESTABLISHED over loopback
+//   close - Context::Close() of both ends
+// Everything runs on this thread: the Context in inline mode, and next to it the
+// EventCore of the listener and the loopback resolver.
+// Usage: bench_socket_scale [sockets] [batch], every socket takes 4 descriptors.
+
+static constexpr int kDefaultSockets = 100000;
+static constexpr int kDefaultBatch = 1000;
+
+static void Report(const char* name, std::vector<double>& latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("%-6s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+        latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+}
+
+int main(int argc, char** argv)
+{
+    int sockets = argc > 1 ? std::atoi(argv[1]) : kDefaultSockets;
+    int batch = argc > 2 ? std::atoi(argv[2]) : kDefaultBatch;
+
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+    Context context { &signalling,
+        Context::Options { .mMode = Context::Mode::kInline, .mNatResolver = &resolver } };
+
+    struct sockaddr_atp server = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, AtpSocket::DataPath::kSocketpair);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    std::vector<double> open, punch, close;
+    double startUs = Test::NowUs();
+    for (int done = 0; done < sockets; done += batch) {
+        int count = std::min(batch, sockets - done);
+        std::vector<int> fds;
+        for (int i = 0; i < count; i++) {
+            double openUs = Test::NowUs();
+            int fd = context.Socket(AF_INET, SOCK_STREAM, IPPROTO_ATP);
+            CHECK(fd >= 0);
+            open.push_back(Test::NowUs() - openUs);
+            fds.push_back(fd);
+        }
+
+        std::vector<int> acceptedFds;
+        for (int fd : fds) {
+            double punchUs = Test::NowUs();
+            CHECK(context.Connect(fd, &server) == 0);
+            int acceptedFd = -1;
+            uint8_t state = 0;
+            while (acceptedFd < 0 || state != static_cast<uint8_t>(State::ESTABLISHED)) {
+                CHECK(Test::NowUs() - punchUs < 10 * 1000 * 1000);
+                eventCore.ProcessEvents(0);
+                CHECK(context.ProcessEvents(0) == 0);
+
+                if (acceptedFd < 0) {
+                    if (Result<AtpSocket*> accepted = (*listener)->Accept(&context))
+                        acceptedFd = (*accepted)->GetApplicationFd();
+                }
+                struct atp_info info;
+                socklen_t length = sizeof(info);
+                CHECK(context.GetSockOpt(fd, SOL_ATP, ATP_INFO, &info, &length) == 0);
+                state = info.atpi_state;
+            }
+            punch.push_back(Test::NowUs() - punchUs);
+            acceptedFds.push_back(acceptedFd);
+        }
+
+        for (int i = 0; i < count; i++) {
+            double closeUs = Test::NowUs();
+            CHECK(context.Close(fds[i]) == 0);
+            CHECK(context.Close(acceptedFds[i]) == 0);
+            close.push_back(Test::NowUs() - closeUs);
+        }
+    }
+    double elapsedUs = Test::NowUs() - startUs;
+
+    std::printf("%d sockets in %.1f s\n", sockets, elapsedUs / 1000 / 1000);
+    Report("open", open);
+    Report("punch", punch);
+    Report("close", close);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "check.h"
+
+#include <stun/stun.h>
+
+#include <cstdio>
+
+using namespace Stun;
+
+// Cost of a binding request as Client::SendRequest builds it (SOFTWARE and
+// FINGERPRINT), and of reading a response as Client::RecvCallback does.
+
+static constexpr int kIterations = 1000000;
+
+// RFC 5769 2.2, sample IPv4 response
+static const uint8_t kSampleResponse[] = {
+    0x01, 0x01, 0x00, 0x3c, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+    0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x0b,
+    0x74, 0x65, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x20,
+    0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xa1, 0x47, 0xe1, 0x12, 0xa6, 0x43,
+    0x00, 0x08, 0x00, 0x14, 0x2b, 0x91, 0xf5, 0x99, 0xfd, 0x9e, 0x90, 0xc3,
+    0x8c, 0x74, 0x89, 0xf9, 0x2a, 0xf9, 0xba, 0x53, 0xf0, 0x6b, 0xe7, 0xd7,
+    0x80, 0x28, 0x00, 0x04, 0xc0, 0x7d, 0x4c, 0x96,
+};
+
+static void BenchBuild()
+{
+    size_t bytes = 0;
+    double startUs = Test::NowUs();
+    for (int i = 0; i < kIterations; i++) {
+        MessageBuilder builder(kHeader::MessageType::Request);
+        CHECK(builder.AddSoftware("atp") == 0);
+        CHECK(builder.AddFingerprint() == 0);
+        bytes += builder.GetMessageSize();
+    }
+    double elapsedUs = Test::NowUs() - startUs;
+    std::printf("build %8.1f ns/message (%zu bytes)\n", elapsedUs * 1000 / kIterations,
+        bytes / kIterations);
+}
+
+static void BenchParse()
+{
+    int mapped = 0;
+    double startUs = Test::NowUs();
+    for (int i = 0; i < kIterations; i++) {
+        CHECK(IsStunMessage(kSampleResponse, sizeof(kSampleResponse)));
+        MessageReader reader(kSampleResponse, sizeof(kSampleResponse));
+        while (const Attribute* attribute = reader.Next()) {
+            struct sockaddr_in address;
+            socklen_t addressLength = sizeof(address);
+            if (attribute->mType == kAttribute::Optional::Fingerprint)
+                CHECK(reader.CheckFingerprint(attribute));
+            else if (reader.ParseXorMappedAddress(attribute,
+                         reinterpret_cast<struct sockaddr*>(&address), &addressLength)
+                == 0)
+                mapped++;
+        }
+    }
+    double elapsedUs = Test::NowUs() - startUs;
+    CHECK(mapped == kIterations);
+    std::printf("parse %8.1f ns/message (%zu bytes)\n", elapsedUs * 1000 / kIterations,
+        sizeof(kSampleResponse));
+}
+
+static void BenchCrc32()
+{
+    uint8_t buffer[MessageBuilder::kMaxMessageSize] {};
+    for (size_t length : { size_t { 32 }, size_t { 72 }, sizeof(buffer) }) {
+        uint32_t crc = 0;
+        double startUs = Test::NowUs();
+        for (int i = 0; i < kIterations; i++) {
+            buffer[0] = static_cast<uint8_t>(crc);
+            crc = Crc32(buffer, length);
+        }
+        double elapsedUs = Test::NowUs() - startUs;
+        std::printf("crc32 %8.1f ns/call (%zu bytes, %.2f GB/s)\n", elapsedUs * 1000 / kIterations,
+            length, static_cast<double>(length) * kIterations / elapsedUs / 1000);
+    }
+}
+
+int main()
+{
+    BenchBuild();
+    BenchParse();
+    BenchCrc32();
+    return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Just enough for the tests here: a failed CHECK prints where and exits non-zero,
+// which is all ctest looks at
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,        \
+                __LINE__, #condition);                                         \
+            std::exit(1);                                                      \
+        }                                                                      \
+    } while (0)
+
+namespace Test {
+
+inline double NowUs()
+{
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "check.h"
+
+#include <atp/context.h>
+#include <atp/eventcore.h>
+#include <atp/nat_resolver.h>
+#include <atp/posix_socket.h>
+#include <atp/signalling.h>
+#include <atp/socket.h>
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <random>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// In-process stand-ins for the network around an AtpSocket, so that two of them
+// can connect over loopback on a single EventCore: signalling through memory, a
+// "NAT" which maps every socket to its own 127.0.0.1 address, and UDP sockets
+// which can drop a share of what they send.
+
+namespace Test {
+
+using namespace Atp;
+
+inline struct sockaddr_atp MakeAtpAddress(const char* hostname, const char* service = "1")
+{
+    struct sockaddr_atp address {};
+    address.sa_family = AF_INET; // as the preload shim fills it in
+    strncpy(address.hostname, hostname, sizeof(address.hostname) - 1);
+    strncpy(address.service, service, sizeof(address.service) - 1);
+    return address;
+}
+
+// Reliable and ordered, like ISignallingProvider requires. Unbound sockets get
+// an address of their own on their first Send(), so that they can be answered.
+class LoopbackSignalling final : public ISignallingProvider {
+public:
+    explicit LoopbackSignalling(EventCore* eventCore)
+        : ISignallingProvider(eventCore)
+    {
+    }
+
+    int Socket() override
+    {
+        int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+        CHECK(fd >= 0);
+        mEndpoints[fd] = Endpoint {}; // the AtpSocket closes it, the number gets reused
+        return fd;
+    }
+
+    int Bind(int sigfd, const struct sockaddr_atp* addr) override
+    {
+        mEndpoints[sigfd].mAddress = Key(addr);
+        mEndpoints[sigfd].mAtpAddress = *addr;
+        return 1;
+    }
+
+    int Send(int sigfd, const void* buf, size_t len, const struct sockaddr_atp* dest) override
+    {
+        Endpoint& source = mEndpoints[sigfd];
+        if (source.mAddress.empty()) {
+            std::string name = "peer" + std::to_string(mNextPeer++);
+            struct sockaddr_atp address = MakeAtpAddress(name.c_str());
+            Bind(sigfd, &address);
+        }
+
+        for (auto& [fd, endpoint] : mEndpoints) {
+            if (endpoint.mAddress != Key(dest))
+                continue;
+            const char* bytes = static_cast<const char*>(buf);
+            endpoint.mMessages.push_back(Message { std::vector<char>(bytes, bytes + len), source.mAtpAddress });
+            uint64_t value = 1;
+            CHECK(write(fd, &value, sizeof(value)) == sizeof(value));
+            return 0;
+        }
+        return -1;
+    }
+
+    int Recv(int sigfd, void* buf, size_t* len, struct sockaddr_atp* source) override
+    {
+        Endpoint& endpoint = mEndpoints[sigfd];
+        if (endpoint.mMessages.empty())
+            return -1;
+        uint64_t value;
+        CHECK(read(sigfd, &value, sizeof(value)) == sizeof(value));
+
+        Message message = std::move(endpoint.mMessages.front());
+        endpoint.mMessages.pop_front();
+        if (buf != nullptr) {
+            memcpy(buf, message.mBytes.data(), std::min(*len, message.mBytes.size()));
+            *len = message.mBytes.size();
+            *source = message.mSource;
+        }
+        return 0;
+    }
+
+private:
+    struct Message {
+        std::vector<char> mBytes;
+        struct sockaddr_atp mSource;
+    };
+
+    struct Endpoint {
+        std::string mAddress;
+        struct sockaddr_atp mAtpAddress;
+        std::deque<Message> mMessages;
+    };
+
+    static std::string Key(const struct sockaddr_atp* addr)
+    {
+        return std::string(addr->hostname, strnlen(addr->hostname, sizeof(addr->hostname))) + ":"
+            + std::string(addr->service, strnlen(addr->service, sizeof(addr->service)));
+    }
+
+    std::map<int, Endpoint> mEndpoints;
+    int mNextPeer {};
+};
+
+// Binds each socket to 127.0.0.1 and reports that as its mapping, from the loop
+// like the real resolver. SetMappedPort() changes what later resolutions report.
+class LoopbackResolver final : public INatResolver {
+public:
+    explicit LoopbackResolver(IEventCore* eventCore)
+        : mEventCore { eventCore }
+    {
+    }
+
+    resolution_ident_t Resolve(ISocket* socket, completion_t completion) override
+    {
+        return Start(socket, std::move(completion));
+    }
+
+    resolution_ident_t ResolveShared(ISocket* socket, completion_t completion) override
+    {
+        return Start(socket, std::move(completion));
+    }
+
+    void OnStunDatagram(resolution_ident_t, const struct sockaddr_in*, const void*, size_t) override { }
+
+    void Cancel(resolution_ident_t resolution) override
+    {
+        if (auto it = mPending.find(resolution); it != mPending.end()) {
+            mEventCore->DeleteCallback(it->second.mCallback);
+            mPending.erase(it);
+        }
+    }
+
+    void Invalidate(ISocket*) override
+    {
+        mInvalidations++;
+    }
+
+    // The next resolutions report this port instead of the real one, 0 to stop
+    void SetMappedPort(uint16_t port)
+    {
+        mMappedPort = port;
+    }
+
+    int mInvalidations {};
+    int mResolutions {};
+
+private:
+    struct Pending {
+        completion_t mCompletion;
+        struct sockaddr_in mAddress;
+        IEventCore::callback_ident_t mCallback;
+    };
+
+    resolution_ident_t Start(ISocket* socket, completion_t completion)
+    {
+        struct sockaddr_in address {};
+        socklen_t length = sizeof(address);
+        CHECK(getsockname(socket->GetFd(), reinterpret_cast<struct sockaddr*>(&address), &length) == 0);
+        if (address.sin_port == 0) {
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            CHECK(bind(socket->GetFd(), reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0);
+            CHECK(getsockname(socket->GetFd(), reinterpret_cast<struct sockaddr*>(&address), &length) == 0);
+        }
+        if (mMappedPort != 0)
+            address.sin_port = htons(mMappedPort);
+
+        resolution_ident_t resolution = ++mNext;
+        mResolutions++;
+        IEventCore::callback_ident_t callback = mEventCore->RegisterCallback(IEventCore::kInvokeImmediately,
+            [this, resolution](void*) -> mseconds_t {
+                Pending pending = std::move(mPending.at(resolution));
+                mPending.erase(resolution);
+                mEventCore->DeleteCallback(pending.mCallback);
+                pending.mCompletion(NatType::kIndependent, &pending.mAddress, 0);
+                return -1;
+            },
+            nullptr);
+        CHECK(callback != 0);
+        mPending.emplace(resolution, Pending { std::move(completion), address, callback });
+        return resolution;
+    }
+
+    IEventCore* mEventCore;
+    resolution_ident_t mNext {};
+    uint16_t mMappedPort {};
+    std::map<resolution_ident_t, Pending> mPending;
+};
+
+// UDP sockets dropping mLoss of their datagrams on the way out, and with
+// mOnlyPort set everything not sent to that port, e.g all but the relay traffic.
+// mObserver, if set, sees every datagram before it is dropped or sent.
+class LossySocketFactory final : public ISocketFactory {
+public:
+    using Observer = std::function<void(int fd, const void* buffer, size_t length,
+        const struct sockaddr_in* destination)>;
+
+    double mLoss {};
+    in_port_t mOnlyPort {}; // network order, 0 for any
+    Observer mObserver;
+
+    std::unique_ptr<ISocket> Socket(int domain, int type, int protocol) override
+    {
+        std::unique_ptr<ISocket> socket = mFactory.Socket(domain, type, protocol);
+        if (domain != AF_INET || type != SOCK_DGRAM)
+            return socket;
+        return std::make_unique<LossySocket>(this, std::move(socket));
+    }
+
+    std::pair<std::unique_ptr<ISocket>, std::unique_ptr<ISocket>>
+    SocketPair(int domain, int type, int protocol) override
+    {
+        return mFactory.SocketPair(domain, type, protocol);
+    }
+
+    std::unique_ptr<ISocket> Dup(const ISocket& socket) override
+    {
+        return mFactory.Dup(socket);
+    }
+
+private:
+    class LossySocket final : public ISocket {
+    public:
+        LossySocket(LossySocketFactory* factory, std::unique_ptr<ISocket> socket)
+            : mFactory { factory }
+            , mSocket { std::move(socket) }
+        {
+        }
+
+        ssize_t SendTo(const void* buf, size_t len, int flags,
+            const struct sockaddr* dest_addr, socklen_t addrlen) override
+        {
+            if (mFactory->mObserver && dest_addr != nullptr)
+                mFactory->mObserver(mSocket->GetFd(), buf, len,
+                    reinterpret_cast<const struct sockaddr_in*>(dest_addr));
+            if (std::uniform_real_distribution<double> {}(mFactory->mRandom) < mFactory->mLoss)
+                return static_cast<ssize_t>(len);
+            if (mFactory->mOnlyPort != 0 && dest_addr != nullptr
+                && reinterpret_cast<const struct sockaddr_in*>(dest_addr)->sin_port != mFactory->mOnlyPort)
+                return static_cast<ssize_t>(len);
+            return mSocket->SendTo(buf, len, flags, dest_addr, addrlen);
+        }
+
+        ssize_t RecvFrom(void* buf, size_t len, int flags,
+            struct sockaddr* src_addr, socklen_t* addrlen) override
+        {
+            return mSocket->RecvFrom(buf, len, flags, src_addr, addrlen);
+        }
+
+        int Dup2(const ISocket& oldSocket) override { return mSocket->Dup2(oldSocket); }
+        int GetFd() const override { return mSocket->GetFd(); }
+
+    private:
+        LossySocketFactory* mFactory;
+        std::unique_ptr<ISocket> mSocket;
+    };
+
+    PosixSocketFactory mFactory;
+    std::minstd_rand mRandom { 42 };
+};
+
+// Runs the loop until done() or timeoutMs went by, returns done()
+template <typename Predicate>
+bool RunUntil(EventCore& eventCore, Predicate done, double timeoutMs = 10000)
+{
+    double deadline = NowUs() + timeoutMs * 1000;
+    while (!done()) {
+        if (NowUs() > deadline)
+            return false;
+        eventCore.ProcessEvents(5);
+    }
+    return true;
+}
+
+// A connection over loopback and both of its ends. The accepted socket belongs
+// to owner, like Context::Accept() it can only be handed to a Context.
+struct Connection {
+    std::unique_ptr<AtpSocket> mListener;
+    std::unique_ptr<AtpSocket> mConnector;
+    AtpSocket* mAccepted {};
+};
+
+inline Connection Connect(EventCore& eventCore, ISignallingProvider* signalling,
+    INatResolver* resolver, ISocketFactory* factory, Context* owner,
+    AtpSocket::DataPath dataPath, mseconds_t timeoutMs = 10000)
+{
+    Connection connection;
+    struct sockaddr_atp server = MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, signalling,
+        resolver, factory, nullptr, dataPath);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+    connection.mListener = std::move(*listener);
+
+    Result<std::unique_ptr<AtpSocket>> connector = AtpSocket::Create(&eventCore, signalling,
+        resolver, factory, nullptr, dataPath);
+    CHECK(connector);
+    CHECK((*connector)->Connect(&server) == Error::SUCCESS);
+    connection.mConnector = std::move(*connector);
+
+    bool connected = false;
+    connection.mConnector->AwaitConnected([&](Error error) {
+        CHECK(error == Error::SUCCESS);
+        connected = true;
+    });
+    Result<AtpSocket*> accepted = std::unexpected(Error::WOULDBLOCK);
+    CHECK(RunUntil(eventCore, [&] {
+        if (!accepted)
+            accepted = connection.mListener->Accept(owner);
+        return connected && accepted;
+    }, timeoutMs));
+    connection.mAccepted = *accepted;
+    return connection;
+}
+
+// The application's end of either data path, non-blocking. Bytes moved, 0 if none.
+inline size_t Write(AtpSocket* socket, const void* buffer, size_t length)
+{
+    ssize_t ret = socket->GetRingChannel()
+        ? socket->GetRingChannel()->ApplicationWrite(buffer, length)
+        : send(socket->GetApplicationFd(), buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return ret > 0 ? static_cast<size_t>(ret) : 0;
+}
+
+inline size_t Read(AtpSocket* socket, void* buffer, size_t length)
+{
+    ssize_t ret = socket->GetRingChannel()
+        ? socket->GetRingChannel()->ApplicationRead(buffer, length)
+        : recv(socket->GetApplicationFd(), buffer, length, MSG_DONTWAIT);
+    return ret > 0 ? static_cast<size_t>(ret) : 0;
+}
+
+}
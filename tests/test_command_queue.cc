@@ -0,0 +1,117 @@
+#include "check.h"
+
+#include <atp/command_queue.h>
+#include <atp/eventcore.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace Atp;
+
+static void TestFull()
+{
+    MpscQueue<int, 8> queue;
+    for (int i = 0; i < 8; i++) {
+        int value = i;
+        CHECK(queue.TryPush(std::move(value)));
+    }
+    int rejected = 8;
+    CHECK(!queue.TryPush(std::move(rejected)));
+    CHECK(rejected == 8); // left untouched
+
+    int value;
+    for (int i = 0; i < 8; i++) {
+        CHECK(queue.TryPop(value));
+        CHECK(value == i);
+    }
+    CHECK(!queue.TryPop(value));
+
+    // Wraps around
+    for (int i = 0; i < 20; i++) {
+        int pushed = i;
+        CHECK(queue.TryPush(std::move(pushed)));
+        CHECK(queue.TryPop(value));
+        CHECK(value == i);
+    }
+}
+
+// Every producer's values come out exactly once and in the order it pushed them,
+// which only holds if the release store of a cell's sequence publishes its value
+static void TestProducers()
+{
+    constexpr int kProducers = 8;
+    constexpr uint64_t kPerProducer = 50000;
+
+    MpscQueue<uint64_t, 1024> queue;
+    std::atomic<bool> start { false };
+    std::vector<std::thread> producers;
+    for (uint64_t producer = 0; producer < kProducers; producer++) {
+        producers.emplace_back([&, producer] {
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for (uint64_t i = 0; i < kPerProducer; i++) {
+                uint64_t value = producer << 32 | i;
+                while (!queue.TryPush(std::move(value)))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    std::vector<uint64_t> next(kProducers, 0);
+    start.store(true, std::memory_order_release);
+    for (uint64_t popped = 0; popped < kProducers * kPerProducer;) {
+        uint64_t value;
+        if (!queue.TryPop(value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t producer = value >> 32;
+        CHECK(producer < kProducers);
+        CHECK((value & 0xffffffff) == next[producer]);
+        next[producer]++;
+        popped++;
+    }
+    for (std::thread& thread : producers)
+        thread.join();
+
+    uint64_t value;
+    CHECK(!queue.TryPop(value));
+}
+
+// Same through EventCore::Post(), which also has to wake the loop up
+static void TestPost()
+{
+    constexpr int kThreads = 4;
+    constexpr int kPerThread = 5000;
+
+    EventCore eventCore;
+    std::thread loop([&] { eventCore.Run(); });
+
+    std::atomic<int> executed { 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < kPerThread; i++)
+                while (!eventCore.Post([&] { executed.fetch_add(1, std::memory_order_relaxed); }))
+                    std::this_thread::yield();
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    while (executed.load() != kThreads * kPerThread)
+        std::this_thread::yield();
+    eventCore.Stop();
+    loop.join();
+}
+
+int main()
+{
+    TestFull();
+    TestProducers();
+    TestPost();
+    return 0;
+}
@@ -0,0 +1,369 @@
+#include "loopback.h"
+
+#include <atp/context.h>
+#include <atp/path_cache.h>
+#include <atp/protocol.h>
+#include <atp/ring.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace Atp;
+
+static constexpr int kReconnects = 20;
+
+static uint64_t ConnectionsEstablished(AtpSocket* listener)
+{
+    struct atp_info info;
+    socklen_t length = sizeof(info);
+    CHECK(listener->GetSockOpt(SOL_ATP, ATP_INFO, &info, &length) == Error::SUCCESS);
+    return info.atpi_connections_established;
+}
+
+// Returns the time from Connect() to ESTABLISHED in ms, once the listener side
+// is established as well
+static double Connect(EventCore& eventCore, AtpSocket* connector, AtpSocket* listener,
+    const struct sockaddr_atp* server)
+{
+    uint64_t established = ConnectionsEstablished(listener);
+
+    bool done = false;
+    Error result = Error::UNKNOWN;
+    double startUs = Test::NowUs();
+    CHECK(connector->Connect(server) == Error::SUCCESS);
+    connector->AwaitConnected([&](Error error) {
+        result = error;
+        done = true;
+    });
+    CHECK(Test::RunUntil(eventCore, [&] { return done; }));
+    CHECK(result == Error::SUCCESS);
+    double latencyMs = (Test::NowUs() - startUs) / 1000;
+
+    CHECK(Test::RunUntil(eventCore, [&] { return ConnectionsEstablished(listener) == established + 1; }));
+    return latencyMs;
+}
+
+// Connects over loopback cold, then reconnects to the same peer again and again
+// through the PathCache. Every reconnect comes from the mapping of the previous
+// connection, whose listener side is still established and has to give the
+// mapping up to the new connection.
+static void TestReconnect()
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+    PathCache pathCache { &eventCore, 60 * 1000 };
+
+    struct sockaddr_atp server = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, AtpSocket::DataPath::kSocketpair);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    Result<std::unique_ptr<AtpSocket>> connector = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, &pathCache, AtpSocket::DataPath::kSocketpair);
+    CHECK(connector);
+    double coldMs = Connect(eventCore, connector->get(), listener->get(), &server);
+
+    std::vector<double> warmMs;
+    for (int i = 0; i < kReconnects; i++) {
+        // Hands its path to the cache
+        connector->reset();
+
+        connector = AtpSocket::Create(&eventCore, &signalling, &resolver, &factory, &pathCache,
+            AtpSocket::DataPath::kSocketpair);
+        CHECK(connector);
+        warmMs.push_back(Connect(eventCore, connector->get(), listener->get(), &server));
+    }
+    CHECK(ConnectionsEstablished(listener->get()) == kReconnects + 1);
+
+    std::sort(warmMs.begin(), warmMs.end());
+    std::printf("cold connect %.2f ms, warm reconnect p50 %.2f ms max %.2f ms\n", coldMs,
+        warmMs[warmMs.size() / 2], warmMs.back());
+}
+
+// Unknown options are refused rather than silently stored, and leave the socket
+// as it was
+static void TestUnknownOptions()
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+
+    Result<std::unique_ptr<AtpSocket>> socket = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, AtpSocket::DataPath::kSocketpair);
+    CHECK(socket);
+    for (int option : { 0, ATP_RELAY + 1, 1000 }) {
+        int value = 1;
+        socklen_t length = sizeof(value);
+        CHECK((*socket)->SetSockOpt(SOL_ATP, option, &value, sizeof(value)) == Error::INVAL);
+        CHECK((*socket)->GetSockOpt(SOL_ATP, option, &value, &length) == Error::INVAL);
+    }
+    int value = 64 * 1024;
+    CHECK((*socket)->SetSockOpt(SOL_ATP, ATP_SNDBUF, &value, sizeof(value)) == Error::SUCCESS);
+}
+
+// The inline-mode calls fail outright on a threaded Context, rather than return
+// a timeout a poll loop would take for "no timer"
+static void TestInlineOnly()
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Context threaded { &signalling };
+    CHECK(threaded.NextTimeout() == std::unexpected(Error::INVAL));
+    CHECK(threaded.GetEventFd() == +Error::INVAL);
+
+    Context inlined { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+    CHECK(inlined.NextTimeout().has_value());
+    CHECK(inlined.GetEventFd() >= 0);
+}
+
+// Streams in both directions at once, with a share of the datagrams lost, and
+// checks every byte arrives once and in order
+static void TestTransfer(AtpSocket::DataPath dataPath, double loss, size_t size)
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    Test::LossySocketFactory factory;
+    Context context { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+
+    Test::Connection connection = Test::Connect(eventCore, &signalling, &resolver, &factory,
+        &context, dataPath);
+    factory.mLoss = loss;
+
+    AtpSocket* ends[] = { connection.mConnector.get(), connection.mAccepted };
+    size_t written[2] {};
+    size_t read[2] {};
+    auto pattern = [](size_t i, size_t offset) {
+        return static_cast<uint8_t>((offset * 7 + i * 13) >> 3);
+    };
+    CHECK(Test::RunUntil(eventCore, [&] {
+        for (size_t i = 0; i < 2; i++) {
+            uint8_t buffer[16 * 1024];
+            size_t length = std::min(sizeof(buffer), size - written[i]);
+            for (size_t k = 0; k < length; k++)
+                buffer[k] = pattern(i, written[i] + k);
+            written[i] += Test::Write(ends[i], buffer, length);
+
+            // What ends[i] wrote arrives at the other end
+            size_t count = Test::Read(ends[1 - i], buffer, sizeof(buffer));
+            for (size_t k = 0; k < count; k++)
+                CHECK(buffer[k] == pattern(i, read[i] + k));
+            read[i] += count;
+        }
+        return read[0] == size && read[1] == size;
+    }, 60000));
+
+    // Everything is acked once the other end has read it all
+    CHECK(Test::RunUntil(eventCore, [&] {
+        struct atp_info info;
+        socklen_t length = sizeof(info);
+        CHECK(ends[0]->GetSockOpt(SOL_ATP, ATP_INFO, &info, &length) == Error::SUCCESS);
+        return info.atpi_unacked == 0;
+    }));
+    struct atp_info info;
+    socklen_t length = sizeof(info);
+    CHECK(ends[0]->GetSockOpt(SOL_ATP, ATP_INFO, &info, &length) == Error::SUCCESS);
+    CHECK(info.atpi_rtt > 0);
+    CHECK(info.atpi_rto >= Config::kRtoMin && info.atpi_rto <= Config::kRtoMax);
+    CHECK(info.atpi_snd_cwnd > 0);
+    CHECK(info.atpi_unacked_segs == 0);
+    if (loss > 0)
+        CHECK(info.atpi_retransmits > 0 && info.atpi_dup_acks > 0 && info.atpi_reordering > 0);
+}
+
+// Both ends of every connection start from an unpredictable sequence number:
+// the first ATP datagram each end sends carries its ISN, no two are the same
+// and none is 0, what an active socket used to start from
+static void TestInitialSequenceNumbers()
+{
+    static constexpr int kConnections = 8;
+    std::set<uint32_t> sequenceNumbers;
+    for (int i = 0; i < kConnections; i++) {
+        EventCore eventCore;
+        Test::LoopbackSignalling signalling { &eventCore };
+        Test::LoopbackResolver resolver { &eventCore };
+        Test::LossySocketFactory factory;
+        Context context { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+
+        // The accepted end shares the listener's UDP socket, hence the destination
+        std::map<std::pair<int, in_port_t>, uint32_t> first;
+        factory.mObserver = [&](int fd, const void* buffer, size_t length,
+                                const struct sockaddr_in* destination) {
+            struct atp_hdr header;
+            if (!IsAtpDatagram(buffer, length))
+                return;
+            memcpy(&header, buffer, sizeof(header));
+            first.try_emplace({ fd, destination->sin_port }, uint32_t { header.seq_num });
+        };
+        Test::Connection connection = Test::Connect(eventCore, &signalling, &resolver, &factory,
+            &context, AtpSocket::DataPath::kSocketpair);
+        factory.mObserver = nullptr;
+
+        CHECK(first.size() == 2);
+        for (const auto& [end, sequence] : first) {
+            CHECK(sequence != 0);
+            CHECK(sequenceNumbers.insert(sequence).second);
+        }
+    }
+}
+
+// A listener re-resolves its mapping once it is ATP_NAT_REFRESH_INTERVAL old, not
+// on every keepalive, and drops what the resolver knows about the NAT once the
+// mapping moved
+static void TestMappingChange()
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+
+    struct sockaddr_atp server = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, AtpSocket::DataPath::kSocketpair);
+    CHECK(listener);
+    int interval = 10;
+    CHECK((*listener)->SetSockOpt(SOL_ATP, ATP_KEEPALIVE_INTERVAL, &interval, sizeof(interval))
+        == Error::SUCCESS);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    // Keepalives alone leave a fresh mapping alone
+    Test::RunUntil(eventCore, [] { return false; }, 100);
+    CHECK(resolver.mResolutions == 1);
+
+    CHECK((*listener)->SetSockOpt(SOL_ATP, ATP_NAT_REFRESH_INTERVAL, &interval, sizeof(interval))
+        == Error::SUCCESS);
+
+    // Unchanged mapping
+    CHECK(Test::RunUntil(eventCore, [&] { return resolver.mResolutions >= 3; }));
+    CHECK(resolver.mInvalidations == 0);
+
+    resolver.SetMappedPort(40000);
+    CHECK(Test::RunUntil(eventCore, [&] { return resolver.mInvalidations == 1; }));
+    int resolutions = resolver.mResolutions;
+    CHECK(Test::RunUntil(eventCore, [&] { return resolver.mResolutions >= resolutions + 2; }));
+    CHECK(resolver.mInvalidations == 1);
+}
+
+static Task<void> ReadOnce(Context& context, int fd, std::span<std::byte> buffer,
+    std::optional<ssize_t>* result)
+{
+    *result = co_await context.ReadAsync(fd, buffer);
+}
+
+// Reading right after Connect() finds nothing to read yet, on either data path,
+// and a ReadAsync completes with the first data of the connection
+static void TestReadBeforeEstablished(AtpSocket::DataPath dataPath)
+{
+    static constexpr char kResponse[] = "200 OK";
+
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+    Context context { &signalling,
+        Context::Options { .mMode = Context::Mode::kInline, .mDataPath = dataPath, .mNatResolver = &resolver } };
+
+    struct sockaddr_atp server = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, dataPath);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    int fd = context.Socket(AF_INET, SOCK_STREAM, IPPROTO_ATP);
+    CHECK(fd >= 0);
+    CHECK(context.Connect(fd, &server) == 0);
+
+    std::byte buffer[sizeof(kResponse)];
+    CHECK(context.Read(fd, buffer, sizeof(buffer)) == +Error::WOULDBLOCK);
+    std::optional<ssize_t> result;
+    ReadOnce(context, fd, buffer, &result).Detach();
+
+    Result<AtpSocket*> accepted = std::unexpected(Error::WOULDBLOCK);
+    CHECK(Test::RunUntil(eventCore, [&] {
+        CHECK(context.ProcessEvents(0) == 0);
+        if (!accepted && (accepted = (*listener)->Accept(&context)))
+            CHECK(Test::Write(*accepted, kResponse, sizeof(kResponse)) == sizeof(kResponse));
+        return result.has_value();
+    }));
+    CHECK(*result == sizeof(kResponse));
+    CHECK(memcmp(buffer, kResponse, sizeof(kResponse)) == 0);
+}
+
+// A request written while punching arrives with the handshake, on either data path
+static void TestEarlyData(AtpSocket::DataPath dataPath)
+{
+    static constexpr char kRequest[] = "GET /";
+
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    PosixSocketFactory factory;
+    // Only owns the accepted socket
+    Context context { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+
+    struct sockaddr_atp server = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, dataPath);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&server) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    Result<std::unique_ptr<AtpSocket>> connector = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, dataPath);
+    CHECK(connector);
+    CHECK((*connector)->Connect(&server) == Error::SUCCESS);
+    if (dataPath == AtpSocket::DataPath::kRing) {
+        CHECK((*connector)->GetRingChannel()->ApplicationWrite(kRequest, sizeof(kRequest))
+            == sizeof(kRequest));
+    } else {
+        CHECK((*connector)->WriteEarlyData(kRequest, sizeof(kRequest)) == sizeof(kRequest));
+        // One segment only
+        CHECK((*connector)->WriteEarlyData(kRequest, sizeof(kRequest))
+            == std::unexpected(Error::WOULDBLOCK));
+    }
+
+    bool connected = false;
+    (*connector)->AwaitConnected([&](Error) { connected = true; });
+    CHECK(Test::RunUntil(eventCore, [&] { return connected && ConnectionsEstablished(listener->get()) == 1; }));
+
+    Result<AtpSocket*> accepted = (*listener)->Accept(&context);
+    CHECK(accepted);
+    char buffer[64] {};
+    ssize_t length = dataPath == AtpSocket::DataPath::kRing
+        ? (*accepted)->GetRingChannel()->ApplicationRead(buffer, sizeof(buffer))
+        : recv((*accepted)->GetApplicationFd(), buffer, sizeof(buffer), MSG_DONTWAIT);
+    CHECK(length == sizeof(kRequest));
+    CHECK(memcmp(buffer, kRequest, sizeof(kRequest)) == 0);
+}
+
+int main()
+{
+    TestUnknownOptions();
+    TestInlineOnly();
+    TestReconnect();
+    TestMappingChange();
+    TestInitialSequenceNumbers();
+    TestEarlyData(AtpSocket::DataPath::kSocketpair);
+    TestEarlyData(AtpSocket::DataPath::kRing);
+    TestReadBeforeEstablished(AtpSocket::DataPath::kSocketpair);
+    TestReadBeforeEstablished(AtpSocket::DataPath::kRing);
+    for (AtpSocket::DataPath dataPath : { AtpSocket::DataPath::kSocketpair, AtpSocket::DataPath::kRing }) {
+        TestTransfer(dataPath, 0, 4 * 1024 * 1024);
+        TestTransfer(dataPath, 0.05, 256 * 1024);
+    }
+    return 0;
+}
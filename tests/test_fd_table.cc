@@ -0,0 +1,105 @@
+#include "check.h"
+
+#include <atp/fd_table.h>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace Atp;
+
+struct Entry {
+    explicit Entry(int fd)
+        : mFd { fd }
+    {
+    }
+    ~Entry()
+    {
+        mAlive = false;
+    }
+
+    int mFd;
+    std::atomic<bool> mAlive { true };
+};
+
+// 100k sockets, each found again by its descriptor
+static void TestScale()
+{
+    static constexpr int kSockets = 100000;
+
+    auto table = std::make_unique<FdTable<Entry>>();
+    for (int fd = 0; fd < kSockets; fd++)
+        table->Insert(fd, std::make_unique<Entry>(fd));
+    CHECK(table->Size() == kSockets);
+
+    double startUs = Test::NowUs();
+    for (int fd = 0; fd < kSockets; fd++) {
+        FdTable<Entry>::Ref entry = table->Acquire(fd);
+        CHECK(entry && entry->mFd == fd);
+    }
+    double elapsedUs = Test::NowUs() - startUs;
+    std::printf("%d sockets, %.1f ns per Acquire()\n", kSockets, elapsedUs * 1000 / kSockets);
+
+    CHECK(!table->Acquire(kSockets));
+    CHECK(!table->Acquire(-1));
+    CHECK(!table->Acquire(FdTable<Entry>::kMaxFds));
+
+    for (int fd = 0; fd < kSockets; fd += 2)
+        CHECK(table->Erase(fd)->mFd == fd);
+    CHECK(table->Size() == kSockets / 2);
+    for (int fd = 0; fd < kSockets; fd++)
+        CHECK(static_cast<bool>(table->Acquire(fd)) == (fd % 2 == 1));
+}
+
+// Readers on other threads never see an entry after the writer destroyed it
+static void TestErase()
+{
+    static constexpr int kFds = 64;
+    static constexpr int kReaders = 3;
+    static constexpr int kRounds = 20000;
+
+    auto table = std::make_unique<FdTable<Entry>>();
+    std::atomic<bool> done { false };
+    std::atomic<uint64_t> hits { 0 };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; i++) {
+        readers.emplace_back([&, i] {
+            std::minstd_rand random(i + 1);
+            while (!done.load(std::memory_order_relaxed)) {
+                int fd = static_cast<int>(random() % kFds);
+                if (FdTable<Entry>::Ref entry = table->Acquire(fd)) {
+                    // Lets the writer run while the entry is held
+                    std::this_thread::yield();
+                    CHECK(entry->mAlive && entry->mFd == fd);
+                    hits.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+
+    std::minstd_rand random(42);
+    for (int round = 0; round < kRounds; round++) {
+        int fd = static_cast<int>(random() % kFds);
+        if (round % 3 == 0)
+            table->Erase(fd);
+        else
+            table->Insert(fd, std::make_unique<Entry>(fd));
+        if (round % 64 == 0)
+            std::this_thread::yield();
+    }
+    done = true;
+    for (std::thread& reader : readers)
+        reader.join();
+    CHECK(hits > 0);
+}
+
+int main()
+{
+    TestScale();
+    TestErase();
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include "loopback.h"
+
+#include <relay_server.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Atp;
+
+// A UDP socket on 127.0.0.1, with its address
+struct Endpoint {
+    int mFd;
+    struct sockaddr_in mAddress;
+};
+
+static Endpoint Bind()
+{
+    Endpoint endpoint { socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0), {} };
+    CHECK(endpoint.mFd >= 0);
+    endpoint.mAddress.sin_family = AF_INET;
+    endpoint.mAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(endpoint.mFd, reinterpret_cast<struct sockaddr*>(&endpoint.mAddress),
+              sizeof(endpoint.mAddress))
+        == 0);
+    socklen_t length = sizeof(endpoint.mAddress);
+    CHECK(getsockname(endpoint.mFd, reinterpret_cast<struct sockaddr*>(&endpoint.mAddress), &length) == 0);
+    return endpoint;
+}
+
+static void Send(const Endpoint& from, const Endpoint& relay, uint64_t token, char payload)
+{
+    char datagram[sizeof(relay_hdr) + 1];
+    relay_hdr header { .magic = kRelayMagic, .version = kRelayVersion, .zero = 0, .token = token };
+    memcpy(datagram, &header, sizeof(header));
+    datagram[sizeof(header)] = payload;
+    CHECK(sendto(from.mFd, datagram, sizeof(datagram), 0,
+              reinterpret_cast<const struct sockaddr*>(&relay.mAddress), sizeof(relay.mAddress))
+        == sizeof(datagram));
+}
+
+// The payload of what the relay forwarded to endpoint, 0 if nothing. Loopback
+// delivers synchronously, there is nothing to wait for.
+static char Receive(const Endpoint& endpoint, uint64_t token)
+{
+    char datagram[64];
+    struct sockaddr_in source;
+    socklen_t length = sizeof(source);
+    ssize_t count = recvfrom(endpoint.mFd, datagram, sizeof(datagram), 0,
+        reinterpret_cast<struct sockaddr*>(&source), &length);
+    if (count < 0)
+        return 0;
+    // Forwarded as is, header included
+    relay_hdr header;
+    CHECK(count == sizeof(header) + 1);
+    memcpy(&header, datagram, sizeof(header));
+    CHECK(header.magic == kRelayMagic && header.token == token);
+    return datagram[sizeof(header)];
+}
+
+// The first two addresses sending a token are paired, anyone else is ignored
+static void TestPairing()
+{
+    Endpoint relay = Bind();
+    Endpoint a = Bind(), b = Bind(), c = Bind();
+    auto server = std::make_unique<Relay::Server>(relay.mFd, 16);
+
+    // Nobody to forward to yet
+    Send(a, relay, 1, 'a');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 1);
+    CHECK(server->Allocations() == 1);
+
+    // The second address completes the allocation, both ways
+    Send(b, relay, 1, 'b');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 1);
+    CHECK(Receive(a, 1) == 'b');
+    Send(a, relay, 1, 'A');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 1);
+    CHECK(Receive(b, 1) == 'A');
+
+    // A third address knowing the token gets nowhere, with another token it
+    // opens an allocation of its own
+    Send(c, relay, 1, 'c');
+    Send(c, relay, 2, 'c');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 2);
+    CHECK(Receive(a, 1) == 0 && Receive(b, 1) == 0);
+    CHECK(server->Allocations() == 2);
+    CHECK(server->GetStats().mForwarded == 2);
+    CHECK(server->GetStats().mDropped == 1);
+
+    // Not a relay datagram
+    CHECK(sendto(c.mFd, "x", 1, 0, reinterpret_cast<const struct sockaddr*>(&relay.mAddress),
+              sizeof(relay.mAddress))
+        == 1);
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 1);
+    CHECK(server->GetStats().mDropped == 2);
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 0);
+
+    for (int fd : { relay.mFd, a.mFd, b.mFd, c.mFd })
+        close(fd);
+}
+
+// Idle allocations go away, traffic keeps them
+static void TestIdleExpiry()
+{
+    Endpoint relay = Bind();
+    Endpoint a = Bind(), b = Bind();
+    auto server = std::make_unique<Relay::Server>(relay.mFd, 16);
+
+    Send(a, relay, 1, 'a');
+    Send(b, relay, 1, 'b');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 2);
+    CHECK(Receive(a, 1) == 'b');
+
+    uint64_t now = Relay::GetTimeMs();
+    CHECK(server->Expire(now + kRelayIdleTimeoutMs - 1000) == 0);
+    CHECK(server->Expire(now + kRelayIdleTimeoutMs + 1000) == 1);
+    CHECK(server->Allocations() == 0);
+
+    // The token starts over, b is the first peer now and a the second
+    Send(b, relay, 1, 'b');
+    Send(a, relay, 1, 'a');
+    CHECK(server->ProcessBatch(MSG_DONTWAIT) == 2);
+    CHECK(Receive(b, 1) == 'a');
+    CHECK(Receive(a, 1) == 0);
+
+    for (int fd : { relay.mFd, a.mFd, b.mFd })
+        close(fd);
+}
+
+// Expiring half of a crowded table leaves the other half reachable, whatever
+// the erasures shifted around
+static void TestTableChurn()
+{
+    static constexpr uint64_t kCount = 4096;
+    Relay::AllocationTable table(kCount);
+    for (uint64_t token = 1; token <= kCount; token++) {
+        Relay::AllocationTable::Allocation* allocation = table.Insert(token * 0x1000193);
+        CHECK(allocation != nullptr);
+        allocation->mLastSeenMs = token % 2 ? 0 : kRelayIdleTimeoutMs;
+    }
+    CHECK(table.Insert(1) == nullptr);
+
+    // An entry shifted back across the scan position waits for the next sweep
+    size_t expired = 0;
+    for (int sweep = 0; sweep < 4; sweep++)
+        expired += table.Expire(kRelayIdleTimeoutMs);
+    CHECK(expired == kCount / 2);
+    CHECK(table.Size() == kCount / 2);
+    for (uint64_t token = 1; token <= kCount; token++)
+        CHECK((table.Find(token * 0x1000193) != nullptr) == (token % 2 == 0));
+}
+
+// With the direct path blocked, a connection falls back to the relay after
+// Config::kRelayFallbackTimeout of punching, and carries data over it
+static void TestFallback(AtpSocket::DataPath dataPath)
+{
+    EventCore eventCore;
+    Test::LoopbackSignalling signalling { &eventCore };
+    Test::LoopbackResolver resolver { &eventCore };
+    Test::LossySocketFactory factory;
+    Context context { &signalling, Context::Options { .mMode = Context::Mode::kInline } };
+
+    Endpoint relay = Bind();
+    auto server = std::make_unique<Relay::Server>(relay.mFd, 16);
+    factory.mOnlyPort = relay.mAddress.sin_port;
+
+    struct sockaddr_atp address = Test::MakeAtpAddress("server");
+    Result<std::unique_ptr<AtpSocket>> listener = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, dataPath);
+    CHECK(listener);
+    CHECK((*listener)->Bind(&address) == Error::SUCCESS);
+    CHECK((*listener)->Listen(Config::kMaxBacklog) == Error::SUCCESS);
+
+    Result<std::unique_ptr<AtpSocket>> connector = AtpSocket::Create(&eventCore, &signalling,
+        &resolver, &factory, nullptr, dataPath);
+    CHECK(connector);
+    CHECK((*connector)->SetSockOpt(SOL_ATP, ATP_RELAY, &relay.mAddress, sizeof(relay.mAddress))
+        == Error::SUCCESS);
+
+    double startUs = Test::NowUs();
+    CHECK((*connector)->Connect(&address) == Error::SUCCESS);
+    bool connected = false;
+    (*connector)->AwaitConnected([&](Error error) {
+        CHECK(error == Error::SUCCESS);
+        connected = true;
+    });
+    Result<AtpSocket*> accepted = std::unexpected(Error::WOULDBLOCK);
+    CHECK(Test::RunUntil(eventCore, [&] {
+        CHECK(server->ProcessBatch(MSG_DONTWAIT) >= 0);
+        if (!accepted)
+            accepted = (*listener)->Accept(&context);
+        return connected && accepted;
+    }));
+    CHECK(Test::NowUs() - startUs >= Config::kRelayFallbackTimeout * 1000.0);
+
+    AtpSocket* ends[] = { connector->get(), *accepted };
+    for (AtpSocket* end : ends) {
+        struct atp_info info;
+        socklen_t length = sizeof(info);
+        CHECK(end->GetSockOpt(SOL_ATP, ATP_INFO, &info, &length) == Error::SUCCESS);
+        CHECK(info.atpi_state == static_cast<uint8_t>(State::ESTABLISHED));
+        CHECK(info.atpi_relayed == 1);
+    }
+    CHECK(server->Allocations() == 1);
+
+    // Both ways through the relay
+    static constexpr size_t kSize = 64 * 1024;
+    size_t written[2] {};
+    size_t read[2] {};
+    CHECK(Test::RunUntil(eventCore, [&] {
+        CHECK(server->ProcessBatch(MSG_DONTWAIT) >= 0);
+        for (size_t i = 0; i < 2; i++) {
+            char buffer[4096];
+            memset(buffer, 'a' + static_cast<int>(i), sizeof(buffer));
+            written[i] += Test::Write(ends[i], buffer, std::min(sizeof(buffer), kSize - written[i]));
+            size_t count = Test::Read(ends[1 - i], buffer, sizeof(buffer));
+            for (size_t k = 0; k < count; k++)
+                CHECK(buffer[k] == 'a' + static_cast<int>(i));
+            read[i] += count;
+        }
+        return read[0] == kSize && read[1] == kSize;
+    }));
+    CHECK(server->GetStats().mForwarded > 0);
+
+    close(relay.mFd);
+}
+
+int main()
+{
+    TestPairing();
+    TestIdleExpiry();
+    TestTableChurn();
+    for (AtpSocket::DataPath dataPath : { AtpSocket::DataPath::kSocketpair, AtpSocket::DataPath::kRing })
+        TestFallback(dataPath);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "check.h"
+
+#include <atp/ring.h>
+
+#include <cstdint>
+#include <poll.h>
+#include <random>
+#include <thread>
+
+using namespace Atp;
+
+// Waits for an eventfd like a real application would. A wakeup lost to a
+// missing fence shows up as a timeout instead of a hang.
+static void Sleep(const ISocket* event)
+{
+    struct pollfd pollFd { .fd = event->GetFd(), .events = POLLIN, .revents = 0 };
+    CHECK(poll(&pollFd, 1, 5000) == 1);
+}
+
+static void TestWrapAround()
+{
+    SpscRing ring { 16 };
+    uint8_t buffer[16];
+    for (int round = 0; round < 40; round++) {
+        uint8_t out[11];
+        for (int i = 0; i < 11; i++)
+            out[i] = static_cast<uint8_t>(round + i);
+        CHECK(ring.Write(out, sizeof(out)) == sizeof(out));
+        CHECK(ring.Size() == sizeof(out));
+        CHECK(ring.Read(buffer, sizeof(buffer)) == sizeof(out));
+        for (int i = 0; i < 11; i++)
+            CHECK(buffer[i] == out[i]);
+    }
+
+    // Partial writes when nearly full, nothing when full
+    uint8_t fill[20] {};
+    CHECK(ring.Write(fill, sizeof(fill)) == 16);
+    CHECK(ring.Write(fill, 1) == 0);
+    CHECK(ring.Read(buffer, 4) == 4);
+    CHECK(ring.Write(fill, sizeof(fill)) == 4);
+}
+
+// Producer and consumer race on a tiny ring, so it keeps going full and empty,
+// both going to sleep on their eventfd whenever they cannot make progress. Every
+// byte must arrive intact and in order (the acquire/release pairs on head and
+// tail), and neither side may sleep through a wakeup (the seq_cst fences).
+static void TestStress()
+{
+    constexpr uint64_t kBytes = 8 * 1024 * 1024;
+    SpscRing ring { 64 };
+
+    std::thread producer([&] {
+        std::minstd_rand random { 1 };
+        uint8_t buffer[100];
+        for (uint64_t sent = 0; sent < kBytes;) {
+            size_t length = std::min<uint64_t>(1 + random() % sizeof(buffer), kBytes - sent);
+            for (size_t i = 0; i < length; i++)
+                buffer[i] = static_cast<uint8_t>((sent + i) % 251);
+            size_t offset = 0;
+            while (offset < length) {
+                size_t count = ring.Write(buffer + offset, length - offset);
+                if (count == 0)
+                    Sleep(ring.GetSpaceEvent());
+                offset += count;
+            }
+            sent += length;
+        }
+    });
+
+    std::minstd_rand random { 2 };
+    uint8_t buffer[100];
+    for (uint64_t received = 0; received < kBytes;) {
+        size_t count = ring.Read(buffer, 1 + random() % sizeof(buffer));
+        if (count == 0) {
+            Sleep(ring.GetDataEvent());
+            continue;
+        }
+        for (size_t i = 0; i < count; i++)
+            CHECK(buffer[i] == (received + i) % 251);
+        received += count;
+    }
+    producer.join();
+    CHECK(ring.Size() == 0);
+}
+
+int main()
+{
+    TestWrapAround();
+    TestStress();
+    return 0;
+}
@@ -0,0 +1,351 @@
+#include "check.h"
+
+#include <stun/stun.h>
+
+#include <arpa/inet.h>
+#include <array>
+#include <cstring>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+
+using namespace Stun;
+
+// Transaction ids: unique, every byte uniform, and no two generators (or
+// threads) in step. The bounds are loose enough to fail by chance less than
+// once in a million runs.
+
+static constexpr int kIds = 100000;
+
+// Chi-squared of counts against a uniform distribution over their buckets
+template <size_t N>
+static double ChiSquared(const std::array<int, N>& counts, int total)
+{
+    double expected = static_cast<double>(total) / N;
+    double sum = 0;
+    for (int count : counts)
+        sum += (count - expected) * (count - expected) / expected;
+    return sum;
+}
+
+static void TestTransactionIds()
+{
+    TransactionIdGenerator generator;
+    std::unordered_set<TransactionId, TransactionIdHash> ids;
+    std::array<std::array<int, 256>, sizeof(TransactionId::mId)> bytes {};
+    std::array<int, sizeof(TransactionId::mId) * 8> bits {};
+    std::array<int, 1024> hashes {};
+
+    for (int i = 0; i < kIds; i++) {
+        TransactionId id = generator.Next();
+        CHECK(ids.insert(id).second);
+        for (size_t j = 0; j < sizeof(id.mId); j++) {
+            bytes[j][id.mId[j]]++;
+            for (int k = 0; k < 8; k++)
+                bits[j * 8 + k] += (id.mId[j] >> k) & 1;
+        }
+        hashes[TransactionIdHash {}(id) % hashes.size()]++;
+    }
+
+    // 255 degrees of freedom: mean 255, standard deviation 22.6
+    for (const auto& counts : bytes)
+        CHECK(ChiSquared(counts, kIds) < 400);
+    // 1023 degrees of freedom: mean 1023, standard deviation 45.2
+    CHECK(ChiSquared(hashes, kIds) < 1300);
+    // Standard deviation of a bit's share is 0.0016
+    for (int count : bits)
+        CHECK(count > kIds * 0.49 && count < kIds * 0.51);
+}
+
+static void TestGenerators()
+{
+    // Started back to back, they must not share a seed
+    TransactionIdGenerator a;
+    TransactionIdGenerator b;
+    CHECK(!(a.Next() == b.Next()));
+
+    // MessageBuilder draws from a generator per thread
+    TransactionId first = MessageBuilder(kHeader::MessageType::Request).GetTransactionId();
+    TransactionId second;
+    std::thread thread([&] {
+        second = MessageBuilder(kHeader::MessageType::Request).GetTransactionId();
+    });
+    thread.join();
+    CHECK(!(first == second));
+}
+
+// RFC 5769 2.1, sample request
+static const uint8_t kSampleRequest[] = {
+    0x00, 0x01, 0x00, 0x58, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+    0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x10,
+    0x53, 0x54, 0x55, 0x4e, 0x20, 0x74, 0x65, 0x73, 0x74, 0x20, 0x63, 0x6c,
+    0x69, 0x65, 0x6e, 0x74, 0x00, 0x24, 0x00, 0x04, 0x6e, 0x00, 0x01, 0xff,
+    0x80, 0x29, 0x00, 0x08, 0x93, 0x2f, 0xf9, 0xb1, 0x51, 0x26, 0x3b, 0x36,
+    0x00, 0x06, 0x00, 0x09, 0x65, 0x76, 0x74, 0x6a, 0x3a, 0x68, 0x36, 0x76,
+    0x59, 0x20, 0x20, 0x20, 0x00, 0x08, 0x00, 0x14, 0x9a, 0xea, 0xa7, 0x0c,
+    0xbf, 0xd8, 0xcb, 0x56, 0x78, 0x1e, 0xf2, 0xb5, 0xb2, 0xd3, 0xf2, 0x49,
+    0xc1, 0xb5, 0x71, 0xa2, 0x80, 0x28, 0x00, 0x04, 0xe5, 0x7a, 0x3b, 0xcf,
+};
+
+// RFC 5769 2.2, sample IPv4 response, mapped to 192.0.2.1:32853
+static const uint8_t kSampleResponse[] = {
+    0x01, 0x01, 0x00, 0x3c, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+    0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x0b,
+    0x74, 0x65, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x20,
+    0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xa1, 0x47, 0xe1, 0x12, 0xa6, 0x43,
+    0x00, 0x08, 0x00, 0x14, 0x2b, 0x91, 0xf5, 0x99, 0xfd, 0x9e, 0x90, 0xc3,
+    0x8c, 0x74, 0x89, 0xf9, 0x2a, 0xf9, 0xba, 0x53, 0xf0, 0x6b, 0xe7, 0xd7,
+    0x80, 0x28, 0x00, 0x04, 0xc0, 0x7d, 0x4c, 0x96,
+};
+
+// Bit at a time, what the table driven Crc32 must agree with
+static uint32_t ReferenceCrc32(const uint8_t* data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void TestCrc32()
+{
+    CHECK(Crc32("123456789", 9) == 0xCBF43926);
+    CHECK(Crc32(nullptr, 0) == 0);
+
+    // Every tail length, at every alignment
+    uint8_t bytes[80];
+    for (size_t i = 0; i < sizeof(bytes); i++)
+        bytes[i] = static_cast<uint8_t>(i * 37 + 11);
+    for (size_t offset = 0; offset < 8; offset++)
+        for (size_t length = 0; length + offset <= sizeof(bytes); length++)
+            CHECK(Crc32(bytes + offset, length) == ReferenceCrc32(bytes + offset, length));
+}
+
+// Whether the reader finds a matching FINGERPRINT attribute in message
+static bool CheckSample(const uint8_t* message, size_t length)
+{
+    MessageReader reader(message, length);
+    bool checked = false;
+    while (const Attribute* attribute = reader.Next()) {
+        if (attribute->mType == kAttribute::Optional::Fingerprint)
+            checked = reader.CheckFingerprint(attribute);
+    }
+    return checked && !reader.Malformed();
+}
+
+// The FINGERPRINT of message, checked against Crc32 directly, then by the reader
+static bool CheckValidSample(const uint8_t* message, size_t length)
+{
+    uint32_t expected;
+    memcpy(&expected, message + length - sizeof(expected), sizeof(expected));
+    CHECK(ntohl(expected) == (Crc32(message, length - 8) ^ 0x5354554E));
+    return CheckSample(message, length);
+}
+
+static void TestFingerprint()
+{
+    CHECK(IsStunMessage(kSampleRequest, sizeof(kSampleRequest)));
+    CHECK(CheckValidSample(kSampleRequest, sizeof(kSampleRequest)));
+    CHECK(CheckValidSample(kSampleResponse, sizeof(kSampleResponse)));
+
+    // A single flipped bit anywhere before it. One in an attribute length
+    // may leave the reader at a malformed attribute instead, or past the
+    // FINGERPRINT, which rejects the message as well.
+    uint8_t corrupt[sizeof(kSampleResponse)];
+    for (size_t i = 0; i < sizeof(corrupt) - 8; i++) {
+        memcpy(corrupt, kSampleResponse, sizeof(corrupt));
+        corrupt[i] ^= 0x10;
+        CHECK(!CheckSample(corrupt, sizeof(corrupt)));
+    }
+
+    MessageReader reader(kSampleResponse, sizeof(kSampleResponse));
+    bool mapped = false;
+    while (const Attribute* attribute = reader.Next()) {
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        if (reader.ParseXorMappedAddress(attribute, reinterpret_cast<struct sockaddr*>(&address),
+                &addressLength)
+            != 0)
+            continue;
+        CHECK(address.sin_addr.s_addr == inet_addr("192.0.2.1"));
+        CHECK(ntohs(address.sin_port) == 32853);
+        mapped = true;
+    }
+    CHECK(mapped);
+
+    // What we send passes our own check
+    MessageBuilder builder(kHeader::MessageType::Request);
+    CHECK(builder.AddSoftware("test vector") == 0);
+    CHECK(builder.AddFingerprint() == 0);
+    CHECK(CheckValidSample(static_cast<const uint8_t*>(builder.GetMessage()), builder.GetMessageSize()));
+}
+
+// A UDP socket on 127.0.0.1, address is where it is bound
+static int BindLoopback(struct sockaddr_in* address)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    CHECK(fd >= 0);
+    *address = {};
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(fd, reinterpret_cast<struct sockaddr*>(address), sizeof(*address)) == 0);
+    socklen_t length = sizeof(*address);
+    CHECK(getsockname(fd, reinterpret_cast<struct sockaddr*>(address), &length) == 0);
+    return fd;
+}
+
+// What a server answers request with, mapping it to mapped. Returns the length.
+static size_t BuildResponse(const uint8_t* request, const struct sockaddr_in& mapped,
+    uint8_t* buffer, size_t bufferLength)
+{
+    MessageBuilder builder(buffer, bufferLength, kHeader::MessageType::Response,
+        reinterpret_cast<const Header*>(request)->mTransactionId);
+    MappedAddressIPv4 value { .mZero = 0, .mFamily = kAttribute::MappedAddress::IPv4,
+        .mPort = htons(ntohs(mapped.sin_port) ^ (kHeader::MagicCookie >> 16)),
+        .mAddr = htonl(ntohl(mapped.sin_addr.s_addr) ^ kHeader::MagicCookie) };
+    CHECK(builder.AddAttribute(Attribute { .mType = kAttribute::Required::XorMappedAddress,
+              .mLength = sizeof(value), .mValue = reinterpret_cast<uint8_t*>(&value) })
+        == 0);
+    CHECK(builder.AddFingerprint() == 0);
+    return builder.GetMessageSize();
+}
+
+// Only the queried servers are listened to: a valid answer from anywhere else,
+// even the server's address on another port, does not complete the query
+static void TestSourceFilter()
+{
+    struct sockaddr_in serverAddress, clientAddress;
+    int server = BindLoopback(&serverAddress);
+    int clientFd = BindLoopback(&clientAddress);
+
+    Client client(clientFd);
+    client.SetResolvedServers({ serverAddress });
+    CHECK(client.Start(1) >= 0);
+
+    uint8_t request[MessageBuilder::kMaxMessageSize];
+    ssize_t length = recv(server, request, sizeof(request), 0);
+    CHECK(length > 0 && IsStunMessage(request, length));
+
+    struct sockaddr_in mapped {};
+    mapped.sin_family = AF_INET;
+    mapped.sin_addr.s_addr = inet_addr("192.0.2.1");
+    mapped.sin_port = htons(32853);
+    uint8_t response[MessageBuilder::kMaxMessageSize];
+    size_t responseLength = BuildResponse(request, mapped, response, sizeof(response));
+
+    struct sockaddr_in strangers[2] = { serverAddress, serverAddress };
+    strangers[0].sin_port = htons(ntohs(serverAddress.sin_port) + 1);
+    strangers[1].sin_addr.s_addr = inet_addr("127.0.0.2");
+    for (const struct sockaddr_in& stranger : strangers) {
+        CHECK(client.OnDatagram(&stranger, response, responseLength) >= 0);
+        CHECK(client.GetQueryState() == Client::QueryState::kRunning);
+    }
+
+    // The transaction is still open for the real answer
+    CHECK(client.OnDatagram(&serverAddress, response, responseLength) == -1);
+    CHECK(client.GetQueryState() == Client::QueryState::kSucceeded);
+    std::vector<Client::ServerResult> results = client.GetServerResults();
+    CHECK(results.size() == 1 && results[0].mRttMs >= 0);
+    CHECK(results[0].mMappedAddress.sin_addr.s_addr == mapped.sin_addr.s_addr
+        && results[0].mMappedAddress.sin_port == mapped.sin_port);
+
+    close(server);
+    close(clientFd);
+}
+
+// Whatever arrives from the server's address is parsed without throwing, and
+// nothing but a well-formed answer closes the transaction
+static void TestMalformedResponses()
+{
+    struct sockaddr_in serverAddress, clientAddress;
+    int server = BindLoopback(&serverAddress);
+    int clientFd = BindLoopback(&clientAddress);
+
+    Client client(clientFd);
+    client.SetResolvedServers({ serverAddress });
+    CHECK(client.Start(1) >= 0);
+
+    uint8_t request[MessageBuilder::kMaxMessageSize];
+    ssize_t length = recv(server, request, sizeof(request), 0);
+    CHECK(length > 0 && IsStunMessage(request, length));
+
+    struct sockaddr_in mapped = clientAddress;
+    uint8_t response[MessageBuilder::kMaxMessageSize];
+    size_t responseLength = BuildResponse(request, mapped, response, sizeof(response));
+
+    auto feed = [&](const uint8_t* message, size_t messageLength) {
+        CHECK(client.OnDatagram(&serverAddress, message, messageLength) >= 0);
+        CHECK(client.GetQueryState() == Client::QueryState::kRunning);
+    };
+
+    // 24 bytes: our transaction id, then an attribute claiming 8 bytes of value
+    uint8_t truncated[sizeof(Header) + 4];
+    memcpy(truncated, response, sizeof(Header));
+    uint16_t messageLength = htons(4);
+    memcpy(truncated + offsetof(Header, mMessageLength), &messageLength, sizeof(messageLength));
+    const uint8_t attribute[] = { 0x00, 0x20, 0x00, 0x08 };
+    memcpy(truncated + sizeof(Header), attribute, sizeof(attribute));
+    feed(truncated, sizeof(truncated));
+
+    // The same with an id we never sent
+    truncated[sizeof(Header) - 1] ^= 0xFF;
+    feed(truncated, sizeof(truncated));
+
+    // Every truncation of the real answer within an attribute, header fixed up
+    // to match. Cut right before the FINGERPRINT, which is optional, it is
+    // still a well-formed answer.
+    for (size_t cut = sizeof(Header) + 4; cut < responseLength; cut += 4) {
+        if (cut == responseLength - 8)
+            continue;
+        uint8_t shortened[MessageBuilder::kMaxMessageSize];
+        memcpy(shortened, response, cut);
+        messageLength = htons(static_cast<uint16_t>(cut - sizeof(Header)));
+        memcpy(shortened + offsetof(Header, mMessageLength), &messageLength, sizeof(messageLength));
+        feed(shortened, cut);
+    }
+
+    // XOR-MAPPED-ADDRESS too short for an address, but well within the message
+    uint8_t shortAddress[sizeof(Header) + 8];
+    memcpy(shortAddress, response, sizeof(Header));
+    messageLength = htons(8);
+    memcpy(shortAddress + offsetof(Header, mMessageLength), &messageLength, sizeof(messageLength));
+    const uint8_t shortAttribute[] = { 0x00, 0x20, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00 };
+    memcpy(shortAddress + sizeof(Header), shortAttribute, sizeof(shortAttribute));
+    MessageReader reader(shortAddress, sizeof(shortAddress));
+    const Attribute* parsed = reader.Next();
+    CHECK(parsed != nullptr && parsed->mType == kAttribute::Required::XorMappedAddress);
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    CHECK(reader.ParseXorMappedAddress(parsed, reinterpret_cast<struct sockaddr*>(&address),
+              &addressLength)
+        == -1);
+    CHECK(reader.Next() == nullptr && !reader.Malformed());
+
+    // A flipped FINGERPRINT
+    uint8_t forged[MessageBuilder::kMaxMessageSize];
+    memcpy(forged, response, responseLength);
+    forged[responseLength - 1] ^= 0x01;
+    feed(forged, responseLength);
+
+    // None of them used up the transaction
+    CHECK(client.OnDatagram(&serverAddress, response, responseLength) == -1);
+    CHECK(client.GetQueryState() == Client::QueryState::kSucceeded);
+
+    close(server);
+    close(clientFd);
+}
+
+int main()
+{
+    TestTransactionIds();
+    TestGenerators();
+    TestCrc32();
+    TestFingerprint();
+    TestSourceFilter();
+    TestMalformedResponses();
+    return 0;
+}